@@ -54,6 +54,32 @@ void KDF256(const uint8_t *in, uint8_t *out, const uint8_t *key)
     _mm_storeu_si128((__m128i*)out,((__m128i*)CIPHERTEXT)[0]);
 }
 
+//
+// Hirose's compression: with chain = G||H and K = H||block,
+// G' = E_K(G) ^ G and H' = E_K(G ^ c) ^ G ^ c for a constant c != 0.
+//
+void AES256_compress(uint8_t *chain, const uint8_t *block)
+{
+    ALIGN16 uint8_t USERKEY[32];
+    ALIGN16 uint8_t KEY[16*15];
+    ALIGN16 uint8_t PLAINTEXT[32];
+    ALIGN16 uint8_t CIPHERTEXT[32];
+
+    const __m128i C = _mm_set1_epi32(-1);
+    __m128i G = _mm_loadu_si128((__m128i*)chain);
+
+    _mm_store_si128((__m128i*)USERKEY, _mm_loadu_si128((__m128i*)(chain+16)));
+    _mm_store_si128((__m128i*)USERKEY+1, _mm_loadu_si128((__m128i*)block));
+    AES_256_Key_Expansion(USERKEY, KEY);
+
+    _mm_store_si128((__m128i*)PLAINTEXT, G);
+    _mm_store_si128((__m128i*)PLAINTEXT+1, _mm_xor_si128(G, C));
+    AES_ECB_encrypt(PLAINTEXT, CIPHERTEXT, 32, KEY, 14);
+
+    _mm_storeu_si128((__m128i*)chain, _mm_xor_si128(((__m128i*)CIPHERTEXT)[0], G));
+    _mm_storeu_si128((__m128i*)(chain+16), _mm_xor_si128(((__m128i*)CIPHERTEXT)[1], _mm_xor_si128(G, C)));
+}
+
 #else
 
 //
@@ -61,25 +87,49 @@ void KDF256(const uint8_t *in, uint8_t *out, const uint8_t *key)
 // where key = X||Y.
 //
 
+#include <openssl/aes.h>
 #include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <cstring>
 
 void KDF128(const uint8_t *in, uint8_t *out, const uint8_t *key)
 {
 	SHA256_CTX sha256;
+	uint8_t md[SHA256_DIGEST_LENGTH];
 
 	SHA256_Init(&sha256);
 	SHA256_Update(&sha256, key, 16);
-	SHA256_Final(out, &sha256);
+	SHA256_Final(md, &sha256);
+	memcpy(out, md, 16); // same 128-bit output as the AES-NI version
 }
 
 void KDF256(const uint8_t *in, uint8_t *out, const uint8_t *key)
 {
 	SHA256_CTX sha256;
+	uint8_t md[SHA256_DIGEST_LENGTH];
 
 	SHA256_Init(&sha256);
 	SHA256_Update(&sha256, key, 32);
-	SHA256_Final(out, &sha256);
+	SHA256_Final(md, &sha256);
+	memcpy(out, md, 16); // same 128-bit output as the AES-NI version
+}
+
+void AES256_compress(uint8_t *chain, const uint8_t *block)
+{
+	uint8_t key[32], G[16], out[16];
+	AES_KEY aes_key;
+
+	memcpy(key, chain+16, 16);
+	memcpy(key+16, block, 16);
+	AES_set_encrypt_key(key, 256, &aes_key);
+
+	memcpy(G, chain, 16);
+
+	AES_encrypt(G, out, &aes_key);
+	for (size_t ix = 0; ix < 16; ix++) { chain[ix] = out[ix] ^ G[ix]; G[ix] ^= 0xFF; }
+
+	AES_encrypt(G, out, &aes_key);
+	for (size_t ix = 0; ix < 16; ix++) { chain[16+ix] = out[ix] ^ G[ix]; }
 }
 #endif
 
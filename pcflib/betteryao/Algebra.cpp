@@ -1,7 +1,308 @@
+// EC_POINTs_mul() is deprecated in OpenSSL 3 but still its only way of
+// multiplying several points at once
+#define OPENSSL_SUPPRESS_DEPRECATED
+
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "Algebra.h"
+#include "Hash.h"
+
+namespace
+{
+
+Bytes s_params_hash; // names the group in table_path(), set by G_Base::Init
+
+// a file in TABLE_DIR, named after the group and what it holds
+std::string table_path(const Bytes &key, const char *ext)
+{
+	Hash hash;
+	hash.update(s_params_hash);
+	hash.update(key);
+	return std::string(G_Base::TABLE_DIR) + "/" + hash.sig(128).to_hex() + ext;
+}
+
+// written under a temporary name first, so that concurrent runs see all of it or nothing
+void write_file(const std::string &path, const Bytes &data)
+{
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), ".%d.tmp", int(getpid()));
+	std::string tmp = path + suffix;
+
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (!f) return; // a cache only, so it's fine to go without
+
+	bool ok = fwrite(&data[0], 1, data.size(), f) == data.size();
+	ok &= fclose(f) == 0;
+
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0) unlink(tmp.c_str());
+}
+
+}
+
+Bytes read_table_file(const std::string &name)
+{
+	Bytes data;
+	if (!G_Base::TABLE_DIR) return data;
+
+	const byte *key = reinterpret_cast<const byte*>(name.data());
+
+	FILE *f = fopen(table_path(Bytes(key, key+name.size()), ".elm").c_str(), "rb");
+	if (!f) return data;
+
+	byte bufr[4096];
+	for (size_t n; (n = fread(bufr, 1, sizeof(bufr), f)) > 0; )
+		data.insert(data.end(), bufr, bufr+n);
+	fclose(f);
+
+	return data;
+}
+
+void write_table_file(const std::string &name, const Bytes &data)
+{
+	if (!G_Base::TABLE_DIR) return;
+
+	const byte *key = reinterpret_cast<const byte*>(name.data());
+	write_file(table_path(Bytes(key, key+name.size()), ".elm"), data);
+}
+
+const char *G_Base::TABLE_DIR = getenv("BETTERYAO_TABLES");
+
+#ifdef ALGEBRA_EC
+
+#include <openssl/objects.h>
+
+//
+// The pbc FixedBase below on the curve: entry (i, j) is g^(j*2^(W*i)), so
+// that g^e is the sum of one entry per W-bit window of e, some 40 point
+// additions in place of a full multiplication. It is kept in memory only,
+// since building it takes less than decompressing it from disk would.
+//
+class FixedBase
+{
+public:
+	static const size_t W = 6;
+
+	static const FixedBase *get(const EC_GROUP *group, const EC_POINT *g, size_t exp_bits);
+
+	void pow(EC_POINT *out, const BIGNUM *e) const;
+
+private:
+	FixedBase(const EC_GROUP *group, const EC_POINT *g, size_t exp_bits);
+	~FixedBase();
+
+	const EC_GROUP        *m_group;
+	size_t                 m_win_cnt;
+	std::vector<EC_POINT*> m_tbl;  // m_win_cnt << W entries
+};
+
+namespace
+{
+
+// every table made so far, by the value of its base
+std::map<Bytes, const FixedBase*> s_tables;
+pthread_mutex_t s_tables_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+}
+
+G_Base::Init G_Base::I;
+
+G_Base::Init::Init()
+{
+	m_group = EC_GROUP_new_by_curve_name(NID_X9_62_prime256v1);
+	m_order = BN_new();
+	if (!m_group || !EC_GROUP_get_order(m_group, m_order, 0))
+	{
+		fprintf(stderr, "P-256 unavailable from OpenSSL\n");
+		abort();
+	}
+
+	const byte *name = reinterpret_cast<const byte*>(OBJ_nid2sn(NID_X9_62_prime256v1));
+	s_params_hash = Bytes(name, name+strlen(reinterpret_cast<const char*>(name))).hash(256);
+}
+
+G_Base::Init::~Init()
+{
+	BN_free(m_order);
+	EC_GROUP_free(m_group);
+}
+
+Z::Z(signed long int i) : m_n(BN_new())
+{
+	BN_set_word(m_n, i < 0? -i : i);
+	if (i < 0) BN_sub(m_n, I.m_order, m_n);
+}
+
+void Z::from_bytes(const Bytes &b)
+{
+	BN_CTX *ctx = BN_CTX_new();
+	BN_bin2bn(&b[0], b.size(), m_n);
+	BN_nnmod(m_n, m_n, I.m_order, ctx);
+	BN_CTX_free(ctx);
+}
+
+Z &Z::operator*= (const Z &rhs)
+{
+	BN_CTX *ctx = BN_CTX_new();
+	BN_mod_mul(m_n, m_n, rhs.m_n, I.m_order, ctx);
+	BN_CTX_free(ctx);
+	return *this;
+}
+
+G G::ret;
+
+Bytes G::to_bytes() const
+{
+	Bytes ret(length_in_bytes(), 0);
+	if (!EC_POINT_is_at_infinity(I.m_group, m_p))
+		EC_POINT_point2oct(I.m_group, m_p, POINT_CONVERSION_COMPRESSED, &ret[0], ret.size(), 0);
+	return ret;
+}
+
+void G::from_bytes(const Bytes &b)
+{
+	m_fb = 0;
+
+	if (b.size() != size_t(length_in_bytes()) || b[0] == 0 ||
+		!EC_POINT_oct2point(I.m_group, m_p, &b[0], b.size(), 0))
+	{
+		EC_POINT_set_to_infinity(I.m_group, m_p);
+	}
+}
+
+G &G::operator/= (const G &rhs)
+{
+	m_fb = 0;
+
+	EC_POINT *tmp = EC_POINT_dup(rhs.m_p, I.m_group);
+	EC_POINT_invert(I.m_group, tmp, 0);
+	EC_POINT_add(I.m_group, m_p, m_p, tmp, 0);
+	EC_POINT_free(tmp);
+	return *this;
+}
+
+FixedBase::FixedBase(const EC_GROUP *group, const EC_POINT *g, size_t exp_bits) :
+	m_group(group), m_win_cnt((exp_bits+W-1)/W), m_tbl(m_win_cnt << W)
+{
+	BN_CTX *ctx = BN_CTX_new();
+	EC_POINT *base = EC_POINT_dup(g, m_group);
+
+	for (size_t ix = 0; ix < m_win_cnt; ix++)
+	{
+		EC_POINT **row = &m_tbl[ix << W];
+
+		row[0] = EC_POINT_new(m_group);
+		EC_POINT_set_to_infinity(m_group, row[0]);
+
+		for (size_t jx = 1; jx < (size_t(1) << W); jx++)
+		{
+			row[jx] = EC_POINT_new(m_group);
+			EC_POINT_add(m_group, row[jx], row[jx-1], base, ctx);
+		}
+
+		EC_POINT_add(m_group, base, row[(size_t(1) << W) - 1], base, ctx); // base^(2^W)
+	}
+
+	EC_POINT_free(base);
+	BN_CTX_free(ctx);
+}
+
+FixedBase::~FixedBase()
+{
+	for (size_t ix = 0; ix < m_tbl.size(); ix++) EC_POINT_free(m_tbl[ix]);
+}
+
+const FixedBase *FixedBase::get(const EC_GROUP *group, const EC_POINT *g, size_t exp_bits)
+{
+	Bytes key(65);
+	key.resize(EC_POINT_point2oct(group, g, POINT_CONVERSION_UNCOMPRESSED, &key[0], key.size(), 0));
+
+	pthread_mutex_lock(&s_tables_mutex);
+		std::map<Bytes, const FixedBase*>::iterator it = s_tables.find(key);
+		const FixedBase *fb = (it == s_tables.end())? 0 : it->second;
+	pthread_mutex_unlock(&s_tables_mutex);
+
+	if (fb) return fb;
+
+	// made outside the lock, so that threads can build different tables at once
+	FixedBase *tbl = new FixedBase(group, g, exp_bits);
+
+	pthread_mutex_lock(&s_tables_mutex);
+		std::pair<std::map<Bytes, const FixedBase*>::iterator, bool> ins =
+			s_tables.insert(std::make_pair(key, tbl));
+	pthread_mutex_unlock(&s_tables_mutex);
+
+	if (!ins.second) delete tbl; // another thread got there first
+	return ins.first->second;
+}
+
+void FixedBase::pow(EC_POINT *out, const BIGNUM *e) const
+{
+	BN_CTX *ctx = BN_CTX_new();
+
+	EC_POINT_set_to_infinity(m_group, out);
+	for (size_t ix = 0; ix < m_win_cnt; ix++)
+	{
+		size_t digit = 0;
+		for (size_t jx = 0; jx < W; jx++) digit |= size_t(BN_is_bit_set(e, ix*W+jx)) << jx;
+
+		if (digit) EC_POINT_add(m_group, out, out, m_tbl[(ix << W) + digit], ctx);
+	}
+
+	BN_CTX_free(ctx);
+}
+
+void fb_pow(const FixedBase *fb, EC_POINT *out, const BIGNUM *e)
+{
+	fb->pow(out, e);
+}
+
+void G::fixed_base()
+{
+	m_fb = FixedBase::get(I.m_group, m_p, BN_num_bits(I.m_order));
+}
+
+void multi_exp(G &out, const G *const *bases, const Z *exps, size_t n)
+{
+	std::vector<const EC_POINT*> points;
+	std::vector<const BIGNUM*> scalars;
+
+	G acc, tmp;
+	for (size_t ix = 0; ix < n; ix++)
+	{
+		if (bases[ix]->m_fb)
+		{
+			fb_pow(bases[ix]->m_fb, tmp.m_p, exps[ix].m_n);
+			acc *= tmp;
+		}
+		else
+		{
+			points.push_back(bases[ix]->m_p);
+			scalars.push_back(exps[ix].m_n);
+		}
+	}
+
+	if (!points.empty())
+	{
+		EC_POINTs_mul(G::I.m_group, tmp.m_p, 0, points.size(), &points[0], &scalars[0], 0);
+		acc *= tmp;
+	}
+
+	out = acc;
+}
+
+#else
 
 static FILE *fp = 0;
 
@@ -49,6 +350,204 @@ static void my_close_random_file()
 	fclose(fp);
 }
 
+//
+// A fixed-base table in the manner of pbc's element_pp: entry (i, j) is
+// g^(j*2^(W*i)), so that g^e is the product of one entry per W-bit window
+// of e. Unlike element_pp it is made of plain elements, which lets it be
+// written out with element_to_bytes() and mapped back in by a later run.
+//
+class FixedBase
+{
+public:
+	static const size_t W = 5;
+
+	static const FixedBase *get(element_s *g, size_t exp_bits);
+
+	void pow(element_s *out, element_s *e) const;
+
+private:
+	FixedBase(element_s *g, size_t win_cnt);
+	~FixedBase();
+
+	static FixedBase *build(element_s *g, size_t exp_bits);
+	static FixedBase *load(const std::string &path, element_s *g, size_t exp_bits);
+	void save(const std::string &path) const;
+
+	size_t     m_win_cnt;
+	element_s *m_tbl;      // m_win_cnt << W entries
+};
+
+namespace
+{
+
+const char FB_MAGIC[4] = { 'F', 'B', 'T', '1' };
+
+struct fb_header_t
+{
+	char     magic[4];
+	uint32_t w;
+	uint32_t win_cnt;
+	uint32_t elm_len;
+};
+
+// every table made so far, by the value of its base
+std::map<Bytes, const FixedBase*> s_tables;
+pthread_mutex_t s_tables_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+Bytes elm_bytes(element_s *e)
+{
+	Bytes b(element_length_in_bytes(e));
+	element_to_bytes(&b[0], e);
+	return b;
+}
+
+}
+
+FixedBase::FixedBase(element_s *g, size_t win_cnt) : m_win_cnt(win_cnt)
+{
+	m_tbl = new element_s[m_win_cnt << W];
+	for (size_t ix = 0; ix < (m_win_cnt << W); ix++) element_init_same_as(&m_tbl[ix], g);
+}
+
+FixedBase::~FixedBase()
+{
+	for (size_t ix = 0; ix < (m_win_cnt << W); ix++) element_clear(&m_tbl[ix]);
+	delete [] m_tbl;
+}
+
+FixedBase *FixedBase::build(element_s *g, size_t exp_bits)
+{
+	FixedBase *fb = new FixedBase(g, (exp_bits+W-1)/W);
+
+	element_t base;
+	element_init_same_as(base, g);
+	element_set(base, g);
+
+	for (size_t ix = 0; ix < fb->m_win_cnt; ix++)
+	{
+		element_s *row = fb->m_tbl + (ix << W);
+
+		element_set1(&row[0]);
+		for (size_t jx = 1; jx < (size_t(1) << W); jx++) element_mul(&row[jx], &row[jx-1], base);
+
+		element_mul(base, &row[(size_t(1) << W) - 1], base); // base^(2^W)
+	}
+
+	element_clear(base);
+	return fb;
+}
+
+FixedBase *FixedBase::load(const std::string &path, element_s *g, size_t exp_bits)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return 0;
+
+	struct stat st;
+	const byte *data = 0;
+	if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(fb_header_t))
+	{
+		void *addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr != MAP_FAILED) data = reinterpret_cast<const byte*>(addr);
+	}
+	close(fd);
+
+	if (!data) return 0;
+
+	fb_header_t header;
+	memcpy(&header, data, sizeof(header));
+
+	const size_t elm_len = element_length_in_bytes(g), win_cnt = (exp_bits+W-1)/W;
+
+	FixedBase *fb = 0;
+	if (memcmp(header.magic, FB_MAGIC, sizeof(FB_MAGIC)) == 0 &&
+		header.w == W && header.win_cnt == win_cnt && header.elm_len == elm_len &&
+		size_t(st.st_size) == sizeof(header) + (win_cnt << W)*elm_len)
+	{
+		fb = new FixedBase(g, win_cnt);
+
+		const byte *p = data + sizeof(header);
+		for (size_t ix = 0; ix < (win_cnt << W); ix++, p += elm_len)
+			element_from_bytes(&fb->m_tbl[ix], const_cast<byte*>(p));
+	}
+
+	munmap(const_cast<byte*>(data), st.st_size);
+	return fb;
+}
+
+void FixedBase::save(const std::string &path) const
+{
+	fb_header_t header;
+	memcpy(header.magic, FB_MAGIC, sizeof(FB_MAGIC));
+	header.w       = W;
+	header.win_cnt = m_win_cnt;
+	header.elm_len = element_length_in_bytes(&m_tbl[0]);
+
+	Bytes data(sizeof(header) + (m_win_cnt << W)*header.elm_len);
+	memcpy(&data[0], &header, sizeof(header));
+
+	byte *p = &data[sizeof(header)];
+	for (size_t ix = 0; ix < (m_win_cnt << W); ix++, p += header.elm_len)
+		element_to_bytes(p, &m_tbl[ix]);
+
+	write_file(path, data);
+}
+
+const FixedBase *FixedBase::get(element_s *g, size_t exp_bits)
+{
+	Bytes key = elm_bytes(g);
+
+	pthread_mutex_lock(&s_tables_mutex);
+		std::map<Bytes, const FixedBase*>::iterator it = s_tables.find(key);
+		const FixedBase *fb = (it == s_tables.end())? 0 : it->second;
+	pthread_mutex_unlock(&s_tables_mutex);
+
+	if (fb) return fb;
+
+	// made outside the lock, so that threads can build different tables at once
+	FixedBase *tbl = 0;
+	if (G_Base::TABLE_DIR)
+	{
+		const std::string path = table_path(key, ".fb");
+		tbl = load(path, g, exp_bits);
+		if (!tbl) { tbl = build(g, exp_bits); tbl->save(path); }
+	}
+	else
+	{
+		tbl = build(g, exp_bits);
+	}
+
+	pthread_mutex_lock(&s_tables_mutex);
+		std::pair<std::map<Bytes, const FixedBase*>::iterator, bool> ins =
+			s_tables.insert(std::make_pair(key, tbl));
+	pthread_mutex_unlock(&s_tables_mutex);
+
+	if (!ins.second) delete tbl; // another thread got there first
+	return ins.first->second;
+}
+
+void FixedBase::pow(element_s *out, element_s *e) const
+{
+	mpz_t z;
+	mpz_init(z);
+	element_to_mpz(z, e);
+
+	element_set1(out);
+	for (size_t ix = 0; ix < m_win_cnt; ix++)
+	{
+		size_t digit = 0;
+		for (size_t jx = 0; jx < W; jx++) digit |= size_t(mpz_tstbit(z, ix*W+jx)) << jx;
+
+		if (digit) element_mul(out, out, &m_tbl[(ix << W) + digit]);
+	}
+
+	mpz_clear(z);
+}
+
+void fb_pow(const FixedBase *fb, element_s *out, element_s *e)
+{
+	fb->pow(out, e);
+}
+
 const char *G_Base::PARAMS_FILE = "CCS.params";
 G_Base::Init G_Base::I;
 
@@ -68,6 +567,9 @@ G_Base::Init::Init()
 
 	if (pairing_init_set_buf(m_p, s, count)) pbc_die("pairing init failed");
 
+	const byte *params = reinterpret_cast<const byte*>(s);
+	s_params_hash = Bytes(params, params+count).hash(256);
+
     // set random source
 	my_random_set_file(const_cast<char*>(Prng::RANDOM_FILE));
 
@@ -75,6 +577,20 @@ G_Base::Init::Init()
 	element_t g;
 	element_init_G1(g, m_p);
 	element_random(g);
+
+	m_g_fb = 0;
+	if (TABLE_DIR) // with the same g, and so the same table, every run
+	{
+		Bytes b = read_table_file("g");
+		if (b.size() == size_t(element_length_in_bytes(g))) element_from_bytes(g, &b[0]);
+		else write_table_file("g", elm_bytes(g));
+
+		element_t z;
+		element_init_Zr(z, m_p);
+		m_g_fb = FixedBase::get(g, element_length_in_bytes(z)*8);
+		element_clear(z);
+	}
+
 	element_pp_init(m_g_pp, g);
 	element_clear(g);
 
@@ -99,9 +615,58 @@ void exp(G &out, const G &lhs, const Z &rhs)
 	element_pow_zn(out.m_e, non_const_lhs_e, non_const_rhs_e);
 }
 
+void G::fixed_base()
+{
+	m_fb = FixedBase::get(m_e, Z().length_in_bytes()*8);
+	m_fptr_exp = &fb_exp;
+}
+
+void fb_exp(G &out, const G &lhs, const Z &rhs)
+{
+	element_s *non_const_rhs_e = const_cast<element_s*>(&(rhs.m_e[0]));
+	lhs.m_fb->pow(out.m_e, non_const_rhs_e);
+}
+
 void pp_exp(G &out, const G &lhs, const Z &rhs)
 {
 	element_pp_s *non_const_lhs_e_pp = const_cast<element_pp_s*>(&(lhs.m_e_pp[0]));
 	element_s *non_const_rhs_e = const_cast<element_s*>(&(rhs.m_e[0]));
 	element_pp_pow_zn(out.m_e, non_const_rhs_e, non_const_lhs_e_pp);
 }
+
+void multi_exp(G &out, const G *const *bases, const Z *exps, size_t n)
+{
+	G acc, tmp;
+	element_set1(acc.m_e);
+
+	std::vector<size_t> plain; // the bases without a table
+	for (size_t ix = 0; ix < n; ix++)
+	{
+		if (bases[ix]->m_fptr_exp == &exp) { plain.push_back(ix); continue; }
+
+		bases[ix]->m_fptr_exp(tmp, *bases[ix], exps[ix]);
+		acc *= tmp;
+	}
+
+	for (size_t ix = 0; ix < plain.size(); )
+	{
+		const size_t cnt = std::min(plain.size()-ix, size_t(3));
+
+		element_s *b[3], *e[3];
+		for (size_t jx = 0; jx < cnt; jx++, ix++)
+		{
+			b[jx] = const_cast<element_s*>(&(bases[plain[ix]]->m_e[0]));
+			e[jx] = const_cast<element_s*>(&(exps[plain[ix]].m_e[0]));
+		}
+
+		if (cnt == 3) element_pow3_zn(tmp.m_e, b[0], e[0], b[1], e[1], b[2], e[2]);
+		else if (cnt == 2) element_pow2_zn(tmp.m_e, b[0], e[0], b[1], e[1]);
+		else element_pow_zn(tmp.m_e, b[0], e[0]);
+
+		acc *= tmp;
+	}
+
+	out = acc;
+}
+
+#endif /* ALGEBRA_EC */
@@ -1,12 +1,29 @@
 #ifndef ALGEBRA_H_
 #define ALGEBRA_H_
 
-#include <pbc/pbc.h>
+#include <string>
 
 #include "Bytes.h"
 #include "Prng.h"
 
 
+// small files of elements in G_Base::TABLE_DIR that should stay the same
+// from run to run; reading gives nothing when there is no such file yet
+Bytes read_table_file(const std::string &name);
+void write_table_file(const std::string &name, const Bytes &data);
+
+#ifdef ALGEBRA_EC
+#include "AlgebraEC.h"
+#else
+
+#include <pbc/pbc.h>
+
+// a fixed-base table kept for the life of the process, see Algebra.cpp
+class FixedBase;
+
+// out = e-th power of the base of fb
+void fb_pow(const FixedBase *fb, element_s *out, element_s *e);
+
 class G_Base
 {
 	class Init
@@ -17,6 +34,7 @@ class G_Base
 		pairing_t 		          m_p;
 		element_t                 m_r;
 		element_pp_t           m_g_pp;
+		const FixedBase       *m_g_fb; // in place of m_g_pp when TABLE_DIR is set
 
 		Prng                   m_prng;
 	};
@@ -29,6 +47,10 @@ protected:
 public:
 	static const char *PARAMS_FILE;
 
+	// where the fixed-base tables of fixed_base() elements are cached across
+	// runs, from the BETTERYAO_TABLES environment variable; 0 for no caching
+	static const char *TABLE_DIR;
+
 	int length_in_bytes() const
 	{
 		return element_length_in_bytes(const_cast<element_s*>(&m_e[0]));
@@ -59,9 +81,12 @@ class G;
 
 class Z : public G_Base
 {
+	friend class G;
 	friend const G &operator ^(const G &lhs, const Z &rhs);
 	friend void    exp(G &out, const G &lhs, const Z &rhs);
 	friend void pp_exp(G &out, const G &lhs, const Z &rhs);
+	friend void fb_exp(G &out, const G &lhs, const Z &rhs);
+	friend void multi_exp(G &out, const G *const *bases, const Z *exps, size_t n);
 
 	void init()
 	{
@@ -147,22 +172,28 @@ inline Z operator*(const Z &lhs, const Z &rhs)
 
 extern void    exp(G &out, const G &lhs, const Z &rhs);
 extern void pp_exp(G &out, const G &lhs, const Z &rhs);
+extern void fb_exp(G &out, const G &lhs, const Z &rhs);
 
 // multiplicative group
 class G : public G_Base
 {
 	element_pp_t                        m_e_pp;
 	bool		                m_is_e_pp_init;
+	const FixedBase                    *m_fb;   // shared, never freed
 	void (*m_fptr_exp)(G&, const G&, const Z&); // use to call exp or pp_exp
 
 	friend const G &operator ^(const G &lhs, const Z &rhs);
 	friend void    exp(G &out, const G &lhs, const Z &rhs);
 	friend void pp_exp(G &out, const G &lhs, const Z &rhs);
+	friend void fb_exp(G &out, const G &lhs, const Z &rhs);
+	friend void  power(G &out, const G &lhs, const Z &rhs);
+	friend void multi_exp(G &out, const G *const *bases, const Z *exps, size_t n);
 
 	void init()
 	{
 		m_fptr_exp = &exp;
 		m_is_e_pp_init = false;
+		m_fb = 0;
 		element_init_G1(m_e, I.m_p);
 	}
 
@@ -204,6 +235,11 @@ public:
 		m_fptr_exp = &pp_exp;
 	}
 
+	// fast_exp() for an element that stays a base across runs, such as the
+	// OT CRS: its table is shared by every element of the same value in the
+	// process and, with TABLE_DIR set, mapped from disk rather than rebuilt
+	void fixed_base();
+
 	virtual void random() { random(I.m_prng); }
 
 	virtual void random(Prng &prng)
@@ -211,9 +247,10 @@ public:
 		m_fptr_exp = &exp; // preprocessing needs to be redone
 
 //		element_random(I.m_r);
-		Bytes rnd = prng.rand(element_length_in_bytes(I.m_r)*8);
-		element_from_bytes(I.m_r, &rnd[0]);
-		element_pp_pow_zn(m_e, I.m_r, I.m_g_pp);
+		Z r; // not I.m_r, so that threads can draw elements side by side
+		r.random(prng);
+		if (I.m_g_fb) fb_pow(I.m_g_fb, m_e, r.m_e);
+		else element_pp_pow_zn(m_e, r.m_e, I.m_g_pp);
 	}
 
 	G &operator=(const G &rhs)
@@ -265,4 +302,19 @@ inline const G &operator^(const G &lhs, const Z &rhs)
 	return G::ret;
 }
 
+// out = lhs^rhs, as operator^ but without its shared result, so that
+// threads can exponentiate side by side
+inline void power(G &out, const G &lhs, const Z &rhs)
+{
+	lhs.m_fptr_exp(out, lhs, rhs);
+	out.m_fptr_exp = &exp; // preprocessing needs to be redone
+}
+
+// out = *bases[0]^exps[0] * ... * *bases[n-1]^exps[n-1]. The bases with a
+// table of their own (fixed_base(), fast_exp()) go through it, and the
+// others share their squarings, up to three at a time.
+void multi_exp(G &out, const G *const *bases, const Z *exps, size_t n);
+
+#endif /* ALGEBRA_EC */
+
 #endif /* ALGEBRA_H_ */
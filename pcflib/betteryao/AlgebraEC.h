@@ -0,0 +1,232 @@
+#ifndef ALGEBRAEC_H_
+#define ALGEBRAEC_H_
+
+#include <openssl/bn.h>
+#include <openssl/ec.h>
+
+// Only to be included by Algebra.h, when built with ALGEBRA_EC.
+//
+// G and Z on the NIST P-256 curve of OpenSSL rather than on pbc's pairing
+// groups: the same interface in the same multiplicative notation, so that
+// G::operator*= adds points and operator^ multiplies a point by a scalar.
+// Elements go over the wire compressed, 33 bytes each, the point at
+// infinity as all zeros. OpenSSL multiplies by the curve generator with a
+// table of its own, which G::random() relies on.
+
+// a fixed-base table kept for the life of the process, see Algebra.cpp
+class FixedBase;
+
+// out = e-th power of the base of fb
+void fb_pow(const FixedBase *fb, EC_POINT *out, const BIGNUM *e);
+
+class G_Base
+{
+	class Init
+	{
+	public:
+		Init();
+		~Init();
+		EC_GROUP *m_group;
+		BIGNUM   *m_order;
+
+		Prng      m_prng;
+	};
+
+protected:
+	static Init I;
+
+public:
+	// where table files are kept across runs, from the BETTERYAO_TABLES
+	// environment variable; 0 for none
+	static const char *TABLE_DIR;
+
+	virtual int length_in_bytes() const = 0;
+	virtual Bytes to_bytes() const = 0;
+	virtual void from_bytes(const Bytes &b) = 0;
+
+	virtual void random() = 0;
+	virtual void random(Prng &prng) = 0;
+
+	virtual ~G_Base() {}
+};
+
+class G;
+
+// the integers modulo the order of the curve
+class Z : public G_Base
+{
+	friend class G;
+	friend const G &operator ^(const G &lhs, const Z &rhs);
+	friend void  power(G &out, const G &lhs, const Z &rhs);
+	friend void multi_exp(G &out, const G *const *bases, const Z *exps, size_t n);
+
+	BIGNUM *m_n; // in [0, order)
+
+public:
+	Z() : m_n(BN_new()) { BN_zero(m_n); }
+
+	Z(const Z &z) : m_n(BN_dup(z.m_n)) {}
+
+	Z(const Bytes &b) : m_n(BN_new()) { from_bytes(b); }
+
+	Z(signed long int i);
+
+	virtual int length_in_bytes() const { return BN_num_bytes(I.m_order); }
+
+	virtual Bytes to_bytes() const
+	{
+		Bytes ret(length_in_bytes());
+		BN_bn2binpad(m_n, &ret[0], ret.size());
+		return ret;
+	}
+
+	virtual void from_bytes(const Bytes &b); // reduced modulo the order
+
+	virtual void random() { random(I.m_prng); }
+
+	// 64 bits more than the order has, so that the bias is negligible
+	virtual void random(Prng &prng)
+	{
+		from_bytes(prng.rand(length_in_bytes()*8 + 64));
+	}
+
+	Z &operator=(const Z &rhs)
+	{
+		BN_copy(m_n, rhs.m_n);
+		return *this;
+	}
+
+	Z &operator+= (const Z &rhs)
+	{
+		BN_mod_add_quick(m_n, m_n, rhs.m_n, I.m_order);
+		return *this;
+	}
+
+	Z &operator-= (const Z &rhs)
+	{
+		BN_mod_sub_quick(m_n, m_n, rhs.m_n, I.m_order);
+		return *this;
+	}
+
+	Z &operator*= (const Z &rhs);
+
+	virtual ~Z() { BN_clear_free(m_n); }
+};
+
+inline Z operator+(const Z &lhs, const Z &rhs)
+{
+	Z ret(lhs);
+	ret += rhs;
+	return ret;
+}
+
+inline Z operator-(const Z &lhs, const Z &rhs)
+{
+	Z ret(lhs);
+	ret -= rhs;
+	return ret;
+}
+
+inline Z operator*(const Z &lhs, const Z &rhs)
+{
+	Z ret(lhs);
+	ret *= rhs;
+	return ret;
+}
+
+// the points of the curve, written multiplicatively
+class G : public G_Base
+{
+	friend const G &operator ^(const G &lhs, const Z &rhs);
+	friend void  power(G &out, const G &lhs, const Z &rhs);
+	friend void multi_exp(G &out, const G *const *bases, const Z *exps, size_t n);
+
+	EC_POINT        *m_p;
+	const FixedBase *m_fb; // shared, never freed
+
+	static G ret;
+
+public:
+	G() : m_p(EC_POINT_new(I.m_group)), m_fb(0) { EC_POINT_set_to_infinity(I.m_group, m_p); }
+
+	G(const G &g) : m_p(EC_POINT_dup(g.m_p, I.m_group)), m_fb(0) {}
+
+	G(const Bytes &b) : m_p(EC_POINT_new(I.m_group)), m_fb(0) { from_bytes(b); }
+
+	virtual int length_in_bytes() const { return 1 + BN_num_bytes(I.m_order); }
+
+	virtual Bytes to_bytes() const;
+
+	// anything that isn't a compressed point of the curve reads as infinity
+	virtual void from_bytes(const Bytes &b);
+
+	// a table of its own only pays off after hundreds of exps, unlike pbc's
+	void fast_exp() {}
+
+	// for an element that stays a base for long, such as the OT CRS: its
+	// table is shared by every element of the same value in the process
+	void fixed_base();
+
+	virtual void random() { random(I.m_prng); }
+
+	virtual void random(Prng &prng)
+	{
+		m_fb = 0;
+
+		Z r; // not shared, so that threads can draw elements side by side
+		r.random(prng);
+		EC_POINT_mul(I.m_group, m_p, r.m_n, 0, 0, 0);
+	}
+
+	G &operator=(const G &rhs)
+	{
+		m_fb = 0;
+		EC_POINT_copy(m_p, rhs.m_p);
+		return *this;
+	}
+
+	G &operator*= (const G &rhs)
+	{
+		m_fb = 0;
+		EC_POINT_add(I.m_group, m_p, m_p, rhs.m_p, 0);
+		return *this;
+	}
+
+	G &operator/= (const G &rhs);
+
+	bool operator==(const G &rhs) const
+	{
+		return EC_POINT_cmp(I.m_group, m_p, rhs.m_p, 0) == 0;
+	}
+
+	virtual ~G() { EC_POINT_free(m_p); }
+};
+
+inline G operator*(const G &lhs, const G &rhs)
+{
+	G ret(lhs);
+	ret *= rhs;
+	return ret;
+}
+
+// out = lhs^rhs, as operator^ but without its shared result, so that
+// threads can exponentiate side by side
+inline void power(G &out, const G &lhs, const Z &rhs)
+{
+	if (lhs.m_fb) fb_pow(lhs.m_fb, out.m_p, rhs.m_n);
+	else EC_POINT_mul(G::I.m_group, out.m_p, 0, lhs.m_p, rhs.m_n, 0);
+	out.m_fb = 0;
+}
+
+inline const G &operator^(const G &lhs, const Z &rhs)
+{
+	power(G::ret, lhs, rhs);
+	return G::ret;
+}
+
+// out = *bases[0]^exps[0] * ... * *bases[n-1]^exps[n-1]. The bases with a
+// fixed_base() table go through it, and OpenSSL multiplies the others by
+// their scalars in one interleaved pass.
+void multi_exp(G &out, const G *const *bases, const Z *exps, size_t n);
+
+#endif /* ALGEBRAEC_H_ */
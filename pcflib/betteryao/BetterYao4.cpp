@@ -1,13 +1,27 @@
 #include "BetterYao4.h"
 #include "garbled_circuit.h"
+#include "ot_batch.h"
+#include "ot_store.h"
 #include <algorithm>
 
 #include <log4cxx/logger.h>
 static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("BetterYao4.cpp"));
 
 
-BetterYao4::BetterYao4(EnvParams &params) : YaoBase(params), m_ot_bit_cnt(0)
+BetterYao4::BetterYao4(EnvParams &params) : YaoBase(params), m_ot_bit_cnt(0), m_copies(), m_mux(0), m_program(0)
 {
+	if (Env::worker_cnt() != 0)
+	{
+		LOG4CXX_FATAL(logger, "the service runs the honest-but-curious modes only");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	if (Env::capture_file() || Env::replay_file())
+	{
+		LOG4CXX_FATAL(logger, "captures are of the honest-but-curious modes only");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
 	// Init variables
 	m_rnds.resize(Env::node_load());
 	m_ccts.resize(Env::node_load());
@@ -34,6 +48,19 @@ BetterYao4::BetterYao4(EnvParams &params) : YaoBase(params), m_ot_bit_cnt(0)
 
 void BetterYao4::start()
 {
+	if (m_inp_recs.size() > 1)
+	{
+		LOG4CXX_FATAL(logger, "the cut-and-choose modes run one record, not a batch");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	if (Env::ot_offline())
+	{
+		ot_precompute();
+		final_report();
+		return;
+	}
+
 	oblivious_transfer();
 	cut_and_choose();
 	cut_and_choose2();
@@ -46,13 +73,28 @@ void BetterYao4::oblivious_transfer()
 {
 	step_init();
 
+	if (Env::ot_store())
+		ot_derandomize();
+	else
+		ot_transfer(m_evl_inp, m_evl_inp_cnt);
+
+	step_report("ob-transfer");
+}
+
+// m_ot_keys[ix] gets the keys of n OTs for circuit copy ix, on the choice
+// bits of the evaluator's root, which its slaves get in bits as well
+void BetterYao4::ot_transfer(Bytes &bits, size_t n)
+{
 	double start; // time marker
 
 	Bytes send, recv, bufr(Env::elm_size_in_bytes()*4);
 	std::vector<Bytes> bufr_chunks, recv_chunks;
 
-	G X[2], Y[2], gr, hr;
-	Z s[2], t[2],  y,  a,  r;
+	G X[2], Y[2], gr, hr, tmp;
+	Z st[2][2],  y,  a,  r; // st[b] = { s[b], t[b] }
+
+	const G *gh[2][2] = { { &m_ot_g[0], &m_ot_h[0] }, { &m_ot_g[1], &m_ot_h[1] } };
+	const G *r2[2] = { &gr, &hr };
 
 	// step 1: generating the CRS: g[0], h[0], g[1], h[1]
 	if (Env::is_root())
@@ -91,7 +133,7 @@ void BetterYao4::oblivious_transfer()
 
 	// send g[0], g[1], h[0], h[1] to slave processes
 	start = MPI_Wtime();
-		MPI_Bcast(&bufr[0], bufr.size(), MPI_BYTE, 0, m_mpi_comm);
+		cluster_bcast(&bufr[0], bufr.size());
 	m_timer_mpi += MPI_Wtime() - start;
 
 	start = MPI_Wtime();
@@ -103,16 +145,17 @@ void BetterYao4::oblivious_transfer()
 		m_ot_h[1].from_bytes(bufr_chunks[3]);
 
 		// pre-processing
-		m_ot_g[0].fast_exp();
-		m_ot_g[1].fast_exp();
-		m_ot_h[0].fast_exp();
-		m_ot_h[1].fast_exp();
+		m_ot_g[0].fixed_base();
+		m_ot_g[1].fixed_base();
+		m_ot_h[0].fixed_base();
+		m_ot_h[1].fixed_base();
 
 		// allocate memory for m_keys
 		m_ot_keys.resize(Env::node_load());
 		for (size_t ix = 0; ix < m_ot_keys.size(); ix++)
 		{
-			m_ot_keys[ix].reserve(m_evl_inp_cnt*2);
+			m_ot_keys[ix].clear();
+			m_ot_keys[ix].reserve(n*2);
 		}
 	m_timer_evl += MPI_Wtime() - start;
 	m_timer_gen += MPI_Wtime() - start;
@@ -125,14 +168,14 @@ void BetterYao4::oblivious_transfer()
 	{
 		EVL_BEGIN
 			start = MPI_Wtime();
-				bufr.clear(); bufr.reserve(Env::exp_size_in_bytes()*m_evl_inp_cnt);
-				send.clear(); send.reserve(Env::elm_size_in_bytes()*m_evl_inp_cnt*2);
-				for (size_t bix = 0; bix < m_evl_inp_cnt; bix++)
+				bufr.clear(); bufr.reserve(Env::exp_size_in_bytes()*n);
+				send.clear(); send.reserve(Env::elm_size_in_bytes()*n*2);
+				for (size_t bix = 0; bix < n; bix++)
 				{
 					r.random();
 					bufr += r.to_bytes();  // to be shared with slave evaluators
 
-					byte bit_value = m_evl_inp.get_ith_bit(bix);
+					byte bit_value = bits.get_ith_bit(bix);
 					send += (m_ot_g[bit_value]^r).to_bytes(); // gr
 					send += (m_ot_h[bit_value]^r).to_bytes(); // hr
 				}
@@ -154,13 +197,15 @@ void BetterYao4::oblivious_transfer()
 		GEN_END
 	}
 
-	EVL_BEGIN // forward rs to slave evaluators
+	EVL_BEGIN // forward rs and the choice bits to slave evaluators
 		start = MPI_Wtime();
-			bufr.resize(Env::exp_size_in_bytes()*m_evl_inp_cnt);
+			bufr.resize(Env::exp_size_in_bytes()*n);
+			bits.resize((n+7)/8);
 		m_timer_evl += MPI_Wtime() - start;
 
 		start = MPI_Wtime();
-			MPI_Bcast(&bufr[0], bufr.size(), MPI_BYTE, 0, m_mpi_comm); // now every evaluator has r's
+			cluster_bcast(&bufr[0], bufr.size()); // now every evaluator has r's
+			cluster_bcast(&bits[0], bits.size());
 		m_timer_mpi += MPI_Wtime() - start;
 
 		start = MPI_Wtime();
@@ -170,11 +215,11 @@ void BetterYao4::oblivious_transfer()
 
 	GEN_BEGIN // forward (gr, hr)s to slave generators
 		start = MPI_Wtime();
-			bufr.resize(Env::elm_size_in_bytes()*m_evl_inp_cnt*2);
+			bufr.resize(Env::elm_size_in_bytes()*n*2);
 		m_timer_gen += MPI_Wtime() - start;
 
 		start = MPI_Wtime();
-			MPI_Bcast(&bufr[0], bufr.size(), MPI_BYTE, 0, m_mpi_comm); // now every generator has (gr, hr)s
+			cluster_bcast(&bufr[0], bufr.size()); // now every generator has (gr, hr)s
 		m_timer_mpi += MPI_Wtime() - start;
 
 		start = MPI_Wtime();
@@ -184,7 +229,7 @@ void BetterYao4::oblivious_transfer()
 
 	// Step 4: the generator computes X[0], Y[0], X[1], Y[1]
 	GEN_BEGIN
-		for (size_t bix = 0; bix < m_evl_inp_cnt; bix++)
+		for (size_t bix = 0; bix < n; bix++)
 		{
 			start = MPI_Wtime();
 				gr.from_bytes(bufr_chunks[2*bix+0]);
@@ -206,16 +251,16 @@ void BetterYao4::oblivious_transfer()
 					m_ot_keys[cix].push_back(Y[0].to_bytes().hash(Env::k()));
 					m_ot_keys[cix].push_back(Y[1].to_bytes().hash(Env::k()));
 
-					s[0].random(); s[1].random();
-					t[0].random(); t[1].random();
+					st[0][0].random(); st[1][0].random();
+					st[0][1].random(); st[1][1].random();
 
 					// X[b] = ( g[b]^s[b] ) * ( h[b]^t[b] ), where b = 0, 1
-					X[0] = m_ot_g[0]^s[0]; X[0] *= m_ot_h[0]^t[0];
-					X[1] = m_ot_g[1]^s[1]; X[1] *= m_ot_h[1]^t[1];
+					multi_exp(X[0], gh[0], st[0], 2);
+					multi_exp(X[1], gh[1], st[1], 2);
 
 					// Y[b] = ( gr^s[b] ) * ( hr^t[b] ) * K[b], where b = 0, 1
-					Y[0] *= gr^s[0]; Y[0] *= hr^t[0];
-					Y[1] *= gr^s[1]; Y[1] *= hr^t[1];
+					multi_exp(tmp, r2, st[0], 2); Y[0] *= tmp;
+					multi_exp(tmp, r2, st[1], 2); Y[1] *= tmp;
 
 					send.clear();
 					send += X[0].to_bytes(); send += X[1].to_bytes();
@@ -232,16 +277,16 @@ void BetterYao4::oblivious_transfer()
 
 		for (size_t ix = 0; ix < m_ot_keys.size(); ix++)
 		{
-			assert(m_ot_keys[ix].size() == m_evl_inp_cnt*2);
+			assert(m_ot_keys[ix].size() == n*2);
 		}
 	GEN_END
 
 	// Step 5: the evaluator computes K = Y[b]/X[b]^r
 	EVL_BEGIN
-		for (size_t bix = 0; bix < m_evl_inp_cnt; bix++)
+		for (size_t bix = 0; bix < n; bix++)
 		{
 			start = MPI_Wtime();
-				int bit_value = m_evl_inp.get_ith_bit(bix);
+				int bit_value = bits.get_ith_bit(bix);
 				r.from_bytes(bufr_chunks[bix]);
 			m_timer_evl += MPI_Wtime() - start;
 
@@ -268,11 +313,145 @@ void BetterYao4::oblivious_transfer()
 
 		for (size_t ix = 0; ix < m_ot_keys.size(); ix++)
 		{
-			assert(m_ot_keys[ix].size() == m_evl_inp_cnt);
+			assert(m_ot_keys[ix].size() == n);
 		}
 	EVL_END
+}
 
-	step_report("ob-transfer");
+// The random OTs of session_cnt runs, on random choice bits, made before
+// the inputs are known and kept in Env::ot_store() for ot_derandomize()
+void BetterYao4::ot_precompute()
+{
+	step_init();
+
+	double start;
+
+	const size_t n = m_evl_inp_cnt*Env::session_cnt();
+
+	if (!Env::ot_store())
+	{
+		LOG4CXX_FATAL(logger, "BETTERYAO_OTS has to name the directory for the random OTs");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	ot_store_t store;
+	store.path = ot_store_path(Env::ot_store(), Env::world_rank());
+	store.copies = Env::node_load();
+	store.cnt = n;
+	store.used = 0;
+	store.id.resize(16);
+
+	Bytes choices;
+	EVL_BEGIN
+		choices = m_prng.rand(n);
+	EVL_END
+
+	ot_transfer(choices, n);
+
+	// the generator's root names the batch so that the stores can be matched up
+	if (Env::is_root())
+	{
+		GEN_BEGIN
+			store.id = m_prng.rand(128);
+
+			start = MPI_Wtime();
+				GEN_SEND(store.id);
+			m_timer_com += MPI_Wtime() - start;
+		GEN_END
+
+		EVL_BEGIN
+			start = MPI_Wtime();
+				store.id = EVL_RECV();
+			m_timer_com += MPI_Wtime() - start;
+		EVL_END
+
+		m_comm_sz += store.id.size();
+	}
+
+	start = MPI_Wtime();
+		cluster_bcast(&store.id[0], store.id.size());
+	m_timer_mpi += MPI_Wtime() - start;
+
+	start = MPI_Wtime();
+		EVL_BEGIN
+			store.choices.swap(choices); // the root's by now
+		EVL_END
+
+		for (size_t ix = 0; ix < m_ot_keys.size(); ix++)
+		{
+			store.keys.insert(store.keys.end(), m_ot_keys[ix].begin(), m_ot_keys[ix].end());
+			vector<Bytes>().swap(m_ot_keys[ix]);
+		}
+	m_timer_evl += MPI_Wtime() - start;
+	m_timer_gen += MPI_Wtime() - start;
+
+	if (!ot_store_save(store))
+	{
+		LOG4CXX_FATAL(logger, "can't write the random OTs to " << store.path);
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	step_report("ot-precomp");
+}
+
+// One message d = x ^ c from the evaluator's root turns the next
+// m_evl_inp_cnt random OTs of every copy into OTs on its inputs x. Every
+// process has its own store, all of them in step.
+void BetterYao4::ot_derandomize()
+{
+	double start;
+
+	Bytes msg;
+
+	ot_store_t store;
+	if (!ot_store_load(store, ot_store_path(Env::ot_store(), Env::world_rank())) || store.copies != size_t(Env::node_load()))
+	{
+		LOG4CXX_FATAL(logger, "no random OTs for this cluster in " << Env::ot_store() << ", run mode 5 first");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	EVL_BEGIN
+		start = MPI_Wtime();
+			if (!ot_store_recv(store, m_evl_inp, m_evl_inp_cnt, m_ot_keys, msg))
+			{
+				LOG4CXX_FATAL(logger, "out of random OTs in " << store.path);
+				MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+			}
+		m_timer_evl += MPI_Wtime() - start;
+
+		if (Env::is_root())
+		{
+			start = MPI_Wtime();
+				EVL_SEND(msg);
+			m_timer_com += MPI_Wtime() - start;
+
+			m_comm_sz += msg.size();
+		}
+	EVL_END
+
+	GEN_BEGIN
+		if (Env::is_root())
+		{
+			start = MPI_Wtime();
+				msg = GEN_RECV();
+			m_timer_com += MPI_Wtime() - start;
+
+			m_comm_sz += msg.size();
+		}
+
+		start = MPI_Wtime(); // forward d to slave generators
+			msg.resize(ot_store_msg_size(m_evl_inp_cnt));
+			cluster_bcast(&msg[0], msg.size());
+		m_timer_mpi += MPI_Wtime() - start;
+
+		start = MPI_Wtime();
+			if (!ot_store_send(store, msg, m_evl_inp_cnt, m_ot_keys))
+			{
+				LOG4CXX_FATAL(logger, "the random OTs in " << store.path << " are out or out of step with the evaluator's");
+				MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+			}
+		m_timer_gen += MPI_Wtime() - start;
+	GEN_END
 }
 
 Bytes BetterYao4::flip_coins(size_t len_in_bytes)
@@ -391,7 +570,7 @@ void BetterYao4::cut_and_choose()
 	m_timer_gen += MPI_Wtime() - start;
 
 	start = MPI_Wtime();
-		MPI_Scatter(&m_all_chks[0], m_chks.size(), MPI_BYTE, &m_chks[0], m_chks.size(), MPI_BYTE, 0, m_mpi_comm);
+		cluster_scatter(&m_all_chks[0], m_chks.size(), &m_chks[0]);
 	m_timer_mpi += MPI_Wtime() - start;
 
 	step_report("cut-&-check");
@@ -462,41 +641,30 @@ void BetterYao4::cut_and_choose2_ot()
 // Outputs: m_rnds[], m_gen_inp_masks[], m_gcs[].m_gen_inp_decom
 //
 
-extern "C" {
-void finalize(PCFState *st);
-}
-
 void BetterYao4::cut_and_choose2_precomputation()
 {
 	double start;
 
 	GEN_BEGIN
 		start = MPI_Wtime();
+			// gen_init() commits to both keys of every input of a copy in
+			// bulk, the copies side by side once m_prng has been drawn from
 			for (size_t ix = 0; ix < m_gcs.size(); ix++)
 			{
 				m_rnds[ix] = m_prng.rand(Env::k());
 				m_gen_inp_masks[ix] = m_prng.rand(m_gen_inp_cnt);
+			}
 
-				gen_init(m_gcs[ix], m_ot_keys[ix], m_gen_inp_masks[ix], m_rnds[ix]);
-
-				m_gcs[ix].m_st = 
-					load_pcf_file(Env::pcf_file(), m_gcs[ix].m_const_wire, m_gcs[ix].m_const_wire+1, copy_key);
-                                m_gcs[ix].m_st->alice_in_size = m_gen_inp_cnt;
-                                m_gcs[ix].m_st->bob_in_size = m_evl_inp_cnt;
-
-				set_external_state(m_gcs[ix].m_st, &m_gcs[ix]);
-				set_key_copy_function(m_gcs[ix].m_st, copy_key);
-				set_key_delete_function(m_gcs[ix].m_st, delete_key);
-				set_callback(m_gcs[ix].m_st, gen_next_gate_m);
+			ThreadPool pool(Env::thread_cnt());
+			pool.parallel_for(m_gcs.size(), 1, copy_init_task, this);
+		double lapse = MPI_Wtime() - start;
+		m_timer_gen += lapse;
 
-				while ((m_gcs[ix].m_gen_inp_decom.size()/2 < m_gen_inp_cnt) && get_next_gate(m_gcs[ix].m_st))
-				{
-					send(m_gcs[ix]); // discard the garbled gates for now
-				}
-
-finalize(m_gcs[ix].m_st);
-			}
-		m_timer_gen += MPI_Wtime() - start;
+		if (Env::is_root())
+		{
+			LOG4CXX_INFO(logger, "GEN commit: " << m_gcs.size()*m_gen_inp_cnt
+				<< " input bits at " << m_gcs.size()*m_gen_inp_cnt/lapse << " bits/s");
+		}
 	GEN_END
 }
 
@@ -566,11 +734,11 @@ void BetterYao4::cut_and_choose2_evl_circuit(size_t ix)
 
 	// send m_gcs[ix].m_gen_inp_decom
 	GEN_BEGIN
-		assert(m_gcs[ix].m_gen_inp_decom.size() == 2*m_gen_inp_cnt);
+		assert(m_gcs[ix].m_gen_inp_decom.size() == 2*m_gen_inp_cnt*decom_size());
 	GEN_END
 
 	EVL_BEGIN
-		if (!m_chks[ix]) { m_gcs[ix].m_gen_inp_decom.resize(m_gen_inp_cnt); }
+		if (!m_chks[ix]) { m_gcs[ix].m_gen_inp_decom.resize(m_gen_inp_cnt*decom_size()); }
 	EVL_END
 
 	for (size_t jx = 0; jx < m_gen_inp_cnt; jx++)
@@ -578,7 +746,7 @@ void BetterYao4::cut_and_choose2_evl_circuit(size_t ix)
 		GEN_BEGIN
 			start = MPI_Wtime();
 				byte bit = m_gen_inp.get_ith_bit(jx) ^ m_gen_inp_masks[ix].get_ith_bit(jx);
-				bufr = m_gcs[ix].m_gen_inp_decom[2*jx+bit];
+				bufr = get_gen_inp_decom(m_gcs[ix], 2*jx+bit);
 				bufr ^= m_prngs[2*ix+0].rand(bufr.size()*8); // encrypt message
 			m_timer_gen += MPI_Wtime() - start;
 
@@ -596,7 +764,7 @@ void BetterYao4::cut_and_choose2_evl_circuit(size_t ix)
 				if (!m_chks[ix]) // evaluation circuit
 				{
 					bufr ^= m_prngs[ix].rand(bufr.size()*8); // decrypt message
-					m_gcs[ix].m_gen_inp_decom[jx] = bufr;
+					set_gen_inp_decom(m_gcs[ix], jx, bufr);
 				}
 			m_timer_evl += MPI_Wtime() - start;
 		EVL_END
@@ -711,18 +879,18 @@ void BetterYao4::cut_and_choose2_chk_circuit(size_t ix)
 
 	// send m_gcs[ix].m_gen_inp_decom
 	GEN_BEGIN
-		assert(m_gcs[ix].m_gen_inp_decom.size() == 2*m_gen_inp_cnt);
+		assert(m_gcs[ix].m_gen_inp_decom.size() == 2*m_gen_inp_cnt*decom_size());
 	GEN_END
 
 	EVL_BEGIN
-		if (m_chks[ix]) { m_gen_inp_decom[ix].resize(2*m_gen_inp_cnt); }
+		if (m_chks[ix]) { m_gen_inp_decom[ix].resize(2*m_gen_inp_cnt*decom_size()); }
 	EVL_END
 
 	for (size_t jx = 0; jx < 2*m_gen_inp_cnt; jx++)
 	{
 		GEN_BEGIN
 			start = MPI_Wtime();
-				bufr = m_gcs[ix].m_gen_inp_decom[jx];
+				bufr = get_gen_inp_decom(m_gcs[ix], jx);
 				bufr ^= m_prngs[2*ix+1].rand(bufr.size()*8); // encrypt message
 			m_timer_gen += MPI_Wtime() - start;
 
@@ -740,7 +908,7 @@ void BetterYao4::cut_and_choose2_chk_circuit(size_t ix)
 				if (m_chks[ix]) // check circuit
 				{
 					bufr ^= m_prngs[ix].rand(bufr.size()*8); // decrypt message
-					m_gen_inp_decom[ix][jx] = bufr;
+					std::copy(bufr.begin(), bufr.end(), m_gen_inp_decom[ix].begin()+jx*decom_size());
 				}
 			m_timer_evl += MPI_Wtime() - start;
 		EVL_END
@@ -769,7 +937,7 @@ void BetterYao4::consistency_check()
 	m_timer_gen += MPI_Wtime() - start;
 
 	start = MPI_Wtime();
-		MPI_Bcast(&bufr[0], bufr.size(), MPI_BYTE, 0, m_mpi_comm);
+		cluster_bcast(&bufr[0], bufr.size());
 	m_timer_mpi += MPI_Wtime() - start;
 
 	start = MPI_Wtime();
@@ -777,39 +945,43 @@ void BetterYao4::consistency_check()
 	m_timer_evl += MPI_Wtime() - start;
 	m_timer_gen += MPI_Wtime() - start;
 
-	// now everyone agrees on the UHF given by m_matrix
+	// now everyone agrees on the UHF given by m_matrix; all k rows of a
+	// circuit go in one message, made or taken apart for all the copies
+	// side by side
+	ThreadPool pool(Env::thread_cnt());
+	m_copy_msgs.resize(m_gcs.size());
+
+	GEN_BEGIN
+		start = MPI_Wtime();
+			pool.parallel_for(m_gcs.size(), 1, copy_inp_hash_task, this);
+		m_timer_gen += MPI_Wtime() - start;
+	GEN_END
+
 	for (size_t ix = 0; ix < m_gcs.size(); ix++)
-		for (size_t kx = 0; kx < m_matrix.size(); kx++)
 	{
 		GEN_BEGIN
 			start = MPI_Wtime();
-				gen_next_gen_inp_com(m_gcs[ix], m_matrix[kx], kx);
-				bufr = send(m_gcs[ix]);
-			m_timer_gen += MPI_Wtime() - start;
-
-			start = MPI_Wtime();
-				GEN_SEND(bufr);
+				GEN_SEND(m_copy_msgs[ix]);
 			m_timer_com += MPI_Wtime() - start;
-
 		GEN_END
 
 		EVL_BEGIN
 			start = MPI_Wtime();
-				bufr = EVL_RECV();
+				m_copy_msgs[ix] = EVL_RECV();
 			m_timer_com += MPI_Wtime() - start;
-
-			if (!m_chks[ix]) // evaluation circuit
-			{
-				start = MPI_Wtime();
-					recv(m_gcs[ix], bufr);
-					evl_next_gen_inp_com(m_gcs[ix], m_matrix[kx], kx);
-				m_timer_evl += MPI_Wtime() - start;
-			}
 		EVL_END
 
-		m_comm_sz += bufr.size();
+		m_comm_sz += m_copy_msgs[ix].size();
 	}
 
+	EVL_BEGIN
+		start = MPI_Wtime();
+			pool.parallel_for(m_gcs.size(), 1, copy_inp_hash_task, this);
+		m_timer_evl += MPI_Wtime() - start;
+	EVL_END
+
+	m_copy_msgs.clear();
+
 	EVL_BEGIN
 		for (size_t ix = 0; ix < m_gcs.size(); ix++)
 			if (!m_chks[ix])
@@ -830,115 +1002,196 @@ void BetterYao4::circuit_evaluate()
 	int verify = 1;
 	Bytes bufr;
 
-	for (size_t ix = 0; ix < m_gcs.size(); ix++)
-	{
-		GEN_BEGIN
-			start = MPI_Wtime();
-				gen_init(m_gcs[ix], m_ot_keys[ix], m_gen_inp_masks[ix], m_rnds[ix]);
-//std::cout << ix << " gen const 0: " << get_const_key(m_gcs[ix], 0, 0).to_hex() << std::endl;
-//std::cout << ix << " gen const 1: " << get_const_key(m_gcs[ix], 1, 1).to_hex() << std::endl;
-			m_timer_gen += MPI_Wtime() - start;
-		GEN_END
+	ThreadPool pool(Env::thread_cnt());
 
-		EVL_BEGIN
-			start = MPI_Wtime();
-				if (m_chks[ix]) // check-circuits
-				{
-					gen_init(m_gcs[ix], m_ot_keys[ix], m_gen_inp_masks[ix], m_rnds[ix]);
-//std::cout << "check ";
-				}
-				else // evaluation-circuits
-				{
-					evl_init(m_gcs[ix], m_ot_keys[ix], m_gen_inp_masks[ix], m_evl_inp);
-//std::cout << "evl ";
-				}
-			m_timer_evl += MPI_Wtime() - start;
-//std::cout << ix << " evl const 0: " << get_const_key(m_gcs[ix], 0, 0).to_hex() << std::endl;
-//std::cout << ix << " evl const 1: " << get_const_key(m_gcs[ix], 1, 1).to_hex() << std::endl;
+	start = MPI_Wtime();
+		pool.parallel_for(m_gcs.size(), 1, copy_init_task, this);
+	m_timer_gen += MPI_Wtime() - start;
+	m_timer_evl += MPI_Wtime() - start;
+
+	mux_init();
+
+	// all copies share one PCF interpreter, every wire carrying one key per
+	// copy, unless they go side by side over m_mux with an interpreter each;
+	// with hashed check circuits the generator keeps the check copies off the wire
+	start = MPI_Wtime();
+		Bytes chks = Env::hash_chks()? m_chks : Bytes();
+		EVL_BEGIN // Env::is_evl() only tells the parties apart in the Simulation mode
+			chks = m_chks;
 		EVL_END
 
+		copies_init(m_copies, m_gcs, chks, Env::hash_chks());
+
+		PCFState *st = 0;
+		if (m_mux)
+		{
+			__m128i zero = _mm_setzero_si128();
+			m_program = load_pcf_file(Env::pcf_file(), &zero, &zero, copy_key);
+			set_key_delete_function(m_program, delete_key);
+		}
+		else
+		{
+			st = load_pcf_file
+				(Env::pcf_file(), m_copies.m_const_keys[0], m_copies.m_const_keys[1], copy_keys_m);
+			st->alice_in_size = m_gen_inp_cnt;
+			st->bob_in_size = m_evl_inp_cnt;
+
+			set_external_state(st, &m_copies);
+			set_key_copy_function(st, copy_keys_m);
+			set_key_delete_function(st, delete_keys_m);
+
+			for (size_t ix = 0; ix < m_gcs.size(); ix++) { m_gcs[ix].m_st = st; }
+		}
+	m_timer_gen += MPI_Wtime() - start;
+	m_timer_evl += MPI_Wtime() - start;
+
+	const bool silent = is_silent(m_copies); // nothing of this node goes on the wire
+
+	// correlate the evaluator's input keys with R: one key per input and copy,
+	// re-generated and compared for the check copies
+	GEN_BEGIN
 		start = MPI_Wtime();
-			m_gcs[ix].m_st = 
-				load_pcf_file(Env::pcf_file(), m_gcs[ix].m_const_wire, m_gcs[ix].m_const_wire+1, copy_key);
-                        m_gcs[ix].m_st->alice_in_size = m_gen_inp_cnt;
-                        m_gcs[ix].m_st->bob_in_size = m_evl_inp_cnt;
-	
-			set_external_state(m_gcs[ix].m_st, &m_gcs[ix]);
-			set_key_copy_function(m_gcs[ix].m_st, copy_key);
-			set_key_delete_function(m_gcs[ix].m_st, delete_key);
+			for (size_t ix = 0; ix < m_gcs.size(); ix++) { gen_cot_fix(m_gcs[ix]); }
+			send(m_copies, bufr);
 		m_timer_gen += MPI_Wtime() - start;
+
+		if (!silent)
+		{
+			start = MPI_Wtime();
+				GEN_SEND(bufr);
+			m_timer_com += MPI_Wtime() - start;
+
+			m_comm_sz += bufr.size();
+		}
+	GEN_END
+
+	EVL_BEGIN
+		if (!silent)
+		{
+			start = MPI_Wtime();
+				bufr = EVL_RECV();
+			m_timer_com += MPI_Wtime() - start;
+
+			m_comm_sz += bufr.size();
+		}
+
+		start = MPI_Wtime();
+			recv(m_copies, bufr);
+			for (size_t ix = 0; ix < m_gcs.size(); ix++)
+			{
+				if (m_chks[ix]) gen_cot_fix(m_gcs[ix]);
+				else evl_cot_fix(m_gcs[ix]);
+			}
+			verify &= pass_regen(m_copies);
 		m_timer_evl += MPI_Wtime() - start;
+	EVL_END
 
-		GEN_BEGIN // generate and send the circuit gate-by-gate
+	GEN_BEGIN // generate the circuits and send them a frame at a time, all copies per frame
+		if (m_mux) // or each copy over its channel, side by side
+		{
+			start = MPI_Wtime();
+				copies_evaluate(pool, verify);
+			m_timer_gen += MPI_Wtime() - start;
+		}
+		else
+		{
 			start = MPI_Wtime();
-				set_callback(m_gcs[ix].m_st, gen_next_gate_m);
-				while (get_next_gate(m_gcs[ix].m_st))
+				set_callback(st, gen_next_gate_mc);
+				for (bool more = true; more; )
 				{
-						bufr = send(m_gcs[ix]);
+					more = get_next_gate(st);
+					if (more && !frame_full(m_copies, Env::frame_size()))
+						continue;
+
+					send(m_copies, bufr); // and the rest after the last gate
 					m_timer_gen += MPI_Wtime() - start;
-	
-					start = MPI_Wtime();
-						GEN_SEND(bufr);
-					m_timer_com += MPI_Wtime() - start;
-	
-					m_comm_sz += bufr.size();
+
+					if (!silent && !bufr.empty())
+					{
+						start = MPI_Wtime();
+							GEN_SEND(bufr);
+						m_timer_com += MPI_Wtime() - start;
+
+						m_comm_sz += bufr.size();
+					}
 
 					start = MPI_Wtime(); // start m_timer_gen
 				}
 			m_timer_gen += MPI_Wtime() - start;
 
-			GEN_SEND(Bytes(0)); // a redundant value to prevent the evlauator from hanging
-		GEN_END
+			if (!silent) GEN_SEND(Bytes(0)); // the end of the circuits
+		}
 
-		EVL_BEGIN // receive and evaluate the circuit gate-by-gate
-			if (m_chks[ix]) // check circuit
-			{
-				start = MPI_Wtime();
-					set_callback(m_gcs[ix].m_st, gen_next_gate_m);
-					while (get_next_gate(m_gcs[ix].m_st))
+		if (Env::hash_chks()) // send the hashes of the check circuits
+		{
+			start = MPI_Wtime();
+				bufr = chk_hash(m_copies);
+			m_timer_gen += MPI_Wtime() - start;
+
+			start = MPI_Wtime();
+				GEN_SEND(bufr);
+			m_timer_com += MPI_Wtime() - start;
+
+			m_comm_sz += bufr.size();
+		}
+	GEN_END
+
+	EVL_BEGIN // evaluate the evaluation circuits and re-generate the check circuits
+		if (m_mux) // each copy over its channel, side by side
+		{
+			start = MPI_Wtime();
+				copies_evaluate(pool, verify);
+			m_timer_evl += MPI_Wtime() - start;
+		}
+		else
+		{
+			start = MPI_Wtime();
+				set_callback(st, evl_next_gate_mc);
+				for (bool more = true; more; )
+				{
+					m_timer_evl += MPI_Wtime() - start;
+
+					if (!silent)
 					{
-							bufr = send(m_gcs[ix]);
-						m_timer_evl += MPI_Wtime() - start;
-	
 						start = MPI_Wtime();
-							Bytes recv = EVL_RECV();
+							EVL_RECV_INTO(bufr);
 						m_timer_com += MPI_Wtime() - start;
-	
-						m_comm_sz += bufr.size();
 
-						start = MPI_Wtime(); // start m_timer_evl
-							verify &= (bufr == recv);
+						m_comm_sz += bufr.size();
 					}
-				m_timer_gen += MPI_Wtime() - start;
 
-				EVL_RECV(); // a redundant value to prevent the evlauator from hanging
-			}
-			else // evaluation circuit
-			{
-				start = MPI_Wtime();
-					set_callback(m_gcs[ix].m_st, evl_next_gate_m);
-					do {
-						m_timer_evl += MPI_Wtime() - start;
-	
-						start = MPI_Wtime();
-							bufr = EVL_RECV();
-						m_timer_com += MPI_Wtime() - start;
-	
-						m_comm_sz += bufr.size();
+					start = MPI_Wtime();
+						recv(m_copies, bufr);
 
-						start = MPI_Wtime();
-							recv(m_gcs[ix], bufr);
-					} while (get_next_gate(m_gcs[ix].m_st));
-				m_timer_evl += MPI_Wtime() - start;
-			}
-		EVL_END
-	}
+						// the gates of the frame, or all the rest after the empty one
+						const bool last = bufr.empty();
+						while ((last || frame_left(m_copies)) && (more = get_next_gate(st)))
+							;
+
+						verify &= pass_regen(m_copies);
+				}
+			m_timer_evl += MPI_Wtime() - start;
+		}
+
+		if (Env::hash_chks()) // compare with the hashes of the re-generated check circuits
+		{
+			start = MPI_Wtime();
+				bufr = EVL_RECV();
+			m_timer_com += MPI_Wtime() - start;
+
+			m_comm_sz += bufr.size();
+
+			start = MPI_Wtime();
+				verify &= (bufr == chk_hash(m_copies));
+			m_timer_evl += MPI_Wtime() - start;
+		}
+	EVL_END
 
 	EVL_BEGIN // check the hash of all the garbled circuits
 		int all_verify = 0;
 
 		start = MPI_Wtime();
-			MPI_Reduce(&verify, &all_verify, 1, MPI_INT, MPI_LAND, 0, m_mpi_comm);
+			all_verify = cluster_land(verify);
 		m_timer_mpi += MPI_Wtime() - start;
 
 		start = MPI_Wtime();
@@ -950,23 +1203,30 @@ void BetterYao4::circuit_evaluate()
 
 			Bytes gen_inp_hash;
 
+			// the commitments of the evaluation circuits, side by side
+			double check_lapse = MPI_Wtime();
+				m_copy_pass.assign(m_gcs.size(), 1);
+				pool.parallel_for(m_gcs.size(), 1, copy_check_task, this);
+			check_lapse = MPI_Wtime() - check_lapse;
+
+			size_t check_bits = 0;
+
 			for (size_t ix = 0; ix < m_gcs.size(); ix++)
 			{
 				// check the commitments associated with the generator's input wires
 				if (m_chks[ix]) // check circuit
 				{
-					for (size_t jx = 0; jx < m_gen_inp_cnt*2; jx++)
+					if (!(m_gen_inp_decom[ix] == m_gcs[ix].m_gen_inp_decom))
 					{
-						if (!(m_gen_inp_decom[ix][jx] == m_gcs[ix].m_gen_inp_decom[jx]))
-						{
-							LOG4CXX_FATAL(logger, "Commitment Verification Failure (check circuit)");
-							MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
-						}
+						LOG4CXX_FATAL(logger, "Commitment Verification Failure (check circuit)");
+						MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
 					}
 				}
 				else // evaluation circuit
 				{
-					if (!pass_check(m_gcs[ix]))
+					check_bits += m_gen_inp_cnt;
+
+					if (!m_copy_pass[ix])
 					{
 						LOG4CXX_FATAL(logger, "Commitment Verification Failure (evaluation circuit)");
 						MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
@@ -985,6 +1245,12 @@ void BetterYao4::circuit_evaluate()
 
 				trim_output(m_gcs[ix]);
 			}
+
+			if (Env::is_root() && check_lapse > 0)
+			{
+				LOG4CXX_INFO(logger, "EVL verify: " << check_bits
+					<< " input bits at " << check_bits/check_lapse << " bits/s");
+			}
 		m_timer_evl += MPI_Wtime() - start;
 	EVL_END
 
@@ -999,6 +1265,173 @@ void BetterYao4::circuit_evaluate()
 
 
 
+void BetterYao4::copy_init_task(void *self, size_t begin, size_t end)
+{
+	for (size_t ix = begin; ix < end; ix++)
+		reinterpret_cast<BetterYao4*>(self)->copy_init(ix);
+}
+
+void BetterYao4::copy_init(size_t ix)
+{
+	GEN_BEGIN
+		gen_init(m_gcs[ix], m_ot_keys[ix], m_gen_inp_masks[ix], m_gen_inp_cnt, m_rnds[ix]);
+	GEN_END
+
+	EVL_BEGIN
+		if (m_chks[ix]) // check-circuits
+		{
+			gen_init(m_gcs[ix], m_ot_keys[ix], m_gen_inp_masks[ix], m_gen_inp_cnt, m_rnds[ix]);
+		}
+		else // evaluation-circuits
+		{
+			evl_init(m_gcs[ix], m_ot_keys[ix], m_gen_inp_masks[ix], m_evl_inp);
+		}
+	EVL_END
+}
+
+// the message of a copy in m_copy_msgs[ix], made or taken apart
+void BetterYao4::copy_inp_hash_task(void *self, size_t begin, size_t end)
+{
+	BetterYao4 &yao = *reinterpret_cast<BetterYao4*>(self);
+
+	for (size_t ix = begin; ix < end; ix++)
+	{
+		garbled_circuit_m_t &cct = yao.m_gcs[ix];
+
+		GEN_BEGIN
+			gen_gen_inp_hash(cct, yao.m_matrix);
+			yao.m_copy_msgs[ix] = send(cct);
+		GEN_END
+
+		EVL_BEGIN
+			if (!yao.m_chks[ix]) // evaluation circuit
+			{
+				recv(cct, yao.m_copy_msgs[ix]);
+				evl_gen_inp_hash(cct, yao.m_matrix);
+			}
+		EVL_END
+	}
+}
+
+void BetterYao4::copy_check_task(void *self, size_t begin, size_t end)
+{
+	BetterYao4 &yao = *reinterpret_cast<BetterYao4*>(self);
+
+	for (size_t ix = begin; ix < end; ix++)
+		if (!yao.m_chks[ix])
+	{
+		yao.m_copy_pass[ix] = pass_check(yao.m_gcs[ix]);
+	}
+}
+
+// The generator asks for the copies to go side by side, each over a
+// channel of its own, when it has the threads for it; the evaluator goes
+// along whatever its own number of threads.
+void BetterYao4::mux_init()
+{
+	delete m_mux;
+	m_mux = 0;
+
+	if (!m_remote) return; // the Simulation mode
+
+	Bytes bufr(1, Env::thread_cnt() > 1);
+
+	GEN_BEGIN
+		GEN_SEND(bufr);
+	GEN_END
+
+	EVL_BEGIN
+		bufr = EVL_RECV();
+	EVL_END
+
+	m_comm_sz += bufr.size();
+
+	if (bufr.size() == 1 && bufr[0] == 1) { m_mux = new MuxSocket(m_remote, m_gcs.size()); }
+}
+
+void BetterYao4::copy_evaluate_task(void *self, size_t begin, size_t end)
+{
+	for (size_t ix = begin; ix < end; ix++)
+		reinterpret_cast<BetterYao4*>(self)->copy_evaluate(ix);
+}
+
+void BetterYao4::copies_evaluate(ThreadPool &pool, int &verify)
+{
+	m_copy_comm_sz.assign(m_gcs.size(), 0);
+	m_copy_pass.assign(m_gcs.size(), 1);
+
+	pool.parallel_for(m_gcs.size(), 1, copy_evaluate_task, this);
+
+	for (size_t ix = 0; ix < m_gcs.size(); ix++)
+	{
+		m_comm_sz += m_copy_comm_sz[ix];
+		verify &= m_copy_pass[ix];
+	}
+}
+
+// Copy ix from an interpreter of its own, over channel ix of m_mux: the
+// frames of the gates, and the empty one at the end, are the sections the
+// copy has in the frames of all copies otherwise.
+void BetterYao4::copy_evaluate(size_t ix)
+{
+	garbled_circuit_m_t &cct = m_gcs[ix];
+	const bool sent = is_sent(m_copies, ix);
+
+	PCFState *st = copy_pcf_state(m_program);
+	set_constant_keys(st, &cct.m_const_wire[0], &cct.m_const_wire[1]);
+	st->alice_in_size = m_gen_inp_cnt;
+	st->bob_in_size = m_evl_inp_cnt;
+	set_external_state(st, &cct);
+
+	Bytes bufr;
+
+	GEN_BEGIN
+		set_callback(st, gen_next_gate_m);
+		for (bool more = true; more; )
+		{
+			more = get_next_gate(st);
+			if (more && !frame_full(cct, Env::frame_size()))
+				continue;
+
+			if (!sent) { hash_o_bufr(cct); continue; }
+
+			send(cct, bufr);
+			if (bufr.empty()) continue;
+
+			m_mux->write_bytes(ix, bufr);
+			m_copy_comm_sz[ix] += bufr.size();
+		}
+
+		if (sent) m_mux->write_bytes(ix, Bytes(0));
+	GEN_END
+
+	EVL_BEGIN
+		set_callback(st, m_chks[ix]? gen_next_gate_m : evl_next_gate_m); // check circuits are re-generated
+		for (bool more = true; more; )
+		{
+			if (sent) m_mux->read_bytes(ix, bufr);
+			else bufr.clear();
+
+			m_copy_comm_sz[ix] += bufr.size();
+
+			recv(cct, bufr);
+
+			const bool last = bufr.empty();
+			while ((last || frame_left(m_copies, ix)) && (more = get_next_gate(st)))
+				;
+
+			if (!m_chks[ix]) continue;
+
+			if (m_copies.m_hash_chks) { hash_o_bufr(cct); continue; } // see pass_regen()
+
+			m_copy_pass[ix] &= (cct.m_o_bufr == cct.m_i_bufr);
+			cct.m_o_bufr.clear();
+		}
+	EVL_END
+
+	free_pcf_state(st);
+}
+
 void BetterYao4::proc_evl_out()
 {
 	EVL_BEGIN
@@ -1013,14 +1446,14 @@ void BetterYao4::proc_evl_out()
 				send += m_gcs[ix].m_evl_out;
 			}
 
-			if (Env::is_root() == 0)
+			if (Env::is_root())
 			{
 				recv.resize(send.size()*Env::node_amnt());
 			}
 		m_timer_evl += MPI_Wtime() - start;
 
 		start = MPI_Wtime();
-			MPI_Gather(&send[0], send.size(), MPI_BYTE, &recv[0], send.size(), MPI_BYTE, 0, m_mpi_comm);
+			cluster_gather(&send[0], send.size(), &recv[0]);
 		m_timer_mpi += MPI_Wtime() - start;
 
 		start = MPI_Wtime();
@@ -1031,7 +1464,7 @@ void BetterYao4::proc_evl_out()
 					chks_total += m_all_chks[ix];
 
 				// find majority by locating the median of output from evaluation-circuits
-				std::vector<Bytes> vec = recv.split((Env::circuit().evl_out_cnt()+7)/8);
+				std::vector<Bytes> vec = recv.split(send.size()/m_gcs.size()); // Env::circuit() isn't loaded with PCF
 				size_t median_ix = (chks_total+vec.size())/2;
 				std::nth_element(vec.begin(), vec.begin()+median_ix, vec.end());
 
@@ -1078,7 +1511,6 @@ void BetterYao4::ot_init()
 		std::vector<Bytes> bufr_chunks;
 		Bytes bufr(Env::elm_size_in_bytes()*4);
 
-		Z y, a;
 	m_timer_gen += MPI_Wtime() - start;
 	m_timer_evl += MPI_Wtime() - start;
 
@@ -1087,15 +1519,7 @@ void BetterYao4::ot_init()
 	{
 		EVL_BEGIN // evaluator (OT receiver)
 			start = MPI_Wtime();
-				y.random();
-
-				a.random();
-
-				m_ot_g[0].random();
-				m_ot_g[1] = m_ot_g[0]^y;          // g[1] = g[0]^y
-
-				m_ot_h[0] = m_ot_g[0]^a;          // h[0] = g[0]^a
-				m_ot_h[1] = m_ot_g[1]^(a + Z(1)); // h[1] = g[1]^(a+1)
+				ot_crs(m_ot_g, m_ot_h);
 
 				bufr.clear();
 				bufr += m_ot_g[0].to_bytes();
@@ -1120,7 +1544,7 @@ void BetterYao4::ot_init()
 
 	// send g[0], g[1], h[0], h[1] to slave processes
 	start = MPI_Wtime();
-		MPI_Bcast(&bufr[0], bufr.size(), MPI_BYTE, 0, m_mpi_comm);
+		cluster_bcast(&bufr[0], bufr.size());
 	m_timer_mpi += MPI_Wtime() - start;
 
 	start = MPI_Wtime();
@@ -1132,10 +1556,9 @@ void BetterYao4::ot_init()
 		m_ot_h[1].from_bytes(bufr_chunks[3]);
 
 		// group element pre-processing
-		m_ot_g[0].fast_exp();
-		m_ot_g[1].fast_exp();
-		m_ot_h[0].fast_exp();
-		m_ot_h[1].fast_exp();
+		ThreadPool pool(Env::thread_cnt());
+		fixed_base(m_ot_g, 2, pool);
+		fixed_base(m_ot_h, 2, pool);
 	m_timer_gen += MPI_Wtime() - start;
 	m_timer_evl += MPI_Wtime() - start;
 }
@@ -1147,108 +1570,57 @@ void BetterYao4::ot_random()
 
 	start = MPI_Wtime();
 		Bytes send, recv;
-		std::vector<Bytes> recv_chunks;
+		std::vector<Z> r;
 
-		Z r, s[2], t[2];
-		G gr, hr, X[2], Y[2];
+		ThreadPool pool(Env::thread_cnt());
 
 		m_ot_out.clear();
-		m_ot_out.reserve(2*m_ot_bit_cnt); // the receiver only uses half of it
 	m_timer_gen += MPI_Wtime() - start;
 	m_timer_evl += MPI_Wtime() - start;
 
+	// one message with a (gr, hr) per bit from the receiver and one with an
+	// (X, Y) per bit back, see ot_batch.h
 	EVL_BEGIN // evaluator (OT receiver)
-		assert(m_ot_recv_bits.size() >= ((m_ot_bit_cnt+7)/8));
-
-		for (size_t bix = 0; bix < m_ot_bit_cnt; bix++)
-		{
-			// Step 1: gr=g[b]^r, hr=h[b]^r, where b is the receiver's bit
-			start = MPI_Wtime();
-				int bit_value = m_ot_recv_bits.get_ith_bit(bix);
-
-				r.random();
-
-				gr = m_ot_g[bit_value]^r;
-				hr = m_ot_h[bit_value]^r;
-
-				send.clear();
-				send += gr.to_bytes();
-				send += hr.to_bytes();
-			m_timer_evl += MPI_Wtime() - start;
-
-			start = MPI_Wtime();
-				EVL_SEND(send);
-
-				// Step 2: the evaluator computes X[0], Y[0], X[1], Y[1]
-				recv.clear();
-				recv += EVL_RECV(); // receive X[0], Y[0], X[1], Y[1]
-			m_timer_com += MPI_Wtime() - start;
+		// Step 1: gr=g[b]^r, hr=h[b]^r, where b is the receiver's bit
+		start = MPI_Wtime();
+			send = ot_query(m_ot_g, m_ot_h, m_ot_recv_bits, m_ot_bit_cnt, r, m_prng, pool);
+		m_timer_evl += MPI_Wtime() - start;
 
-			m_comm_sz += send.size() + recv.size();
+		start = MPI_Wtime();
+			EVL_SEND(send); // all the (gr, hr)'s
 
-			// Step 3: the evaluator computes K = Y[b]/X[b]^r
-			start = MPI_Wtime();
-				recv_chunks = recv.split(Env::elm_size_in_bytes());
+			// Step 2: the generator computes X[0], Y[0], X[1], Y[1]
+			recv = EVL_RECV(); // all the X[0], X[1], Y[0], Y[1]'s
+		m_timer_com += MPI_Wtime() - start;
 
-				X[bit_value].from_bytes(recv_chunks[    bit_value]); // X[b]
-				Y[bit_value].from_bytes(recv_chunks[2 + bit_value]); // Y[b]
+		m_comm_sz += send.size() + recv.size();
 
-				// K = Y[b]/(X[b]^r)
-				Y[bit_value] /= X[bit_value]^r;
-				m_ot_out.push_back(Y[bit_value].to_bytes().hash(Env::k()));
-			m_timer_evl += MPI_Wtime() - start;
-		}
+		// Step 3: the evaluator computes K = Y[b]/X[b]^r
+		start = MPI_Wtime();
+			ot_keys(m_ot_recv_bits, r, recv, m_ot_bit_cnt, m_ot_out, pool);
+		m_timer_evl += MPI_Wtime() - start;
 
 		assert(m_ot_out.size() == m_ot_bit_cnt);
 	EVL_END
 
 	GEN_BEGIN // generator (OT sender)
-		for (size_t bix = 0; bix < m_ot_bit_cnt; bix++)
-		{
-			// Step 1: gr=g[b]^r, hr=h[b]^r, where b is the receiver's bit
-			start = MPI_Wtime();
-				recv.clear();
-				recv += GEN_RECV(); // receive gr, hr
-			m_timer_com += MPI_Wtime() - start;
-
-			m_comm_sz += recv.size();
-
-			// Step 2: the evaluator computes X[0], Y[0], X[1], Y[1]
-			start = MPI_Wtime();
-				recv_chunks = recv.split(Env::elm_size_in_bytes());
-
-				gr.from_bytes(recv_chunks[0]);
-				hr.from_bytes(recv_chunks[1]);
-
-				Y[0].random(); Y[1].random(); // K[0], K[1] sampled at random
-
-				m_ot_out.push_back(Y[0].to_bytes().hash(Env::k()));
-				m_ot_out.push_back(Y[1].to_bytes().hash(Env::k()));
-
-				s[0].random(); s[1].random();
-				t[0].random(); t[1].random();
-
-				// X[b] = ( g[b]^s[b] ) * ( h[b]^t[b] ) for b = 0, 1
-				X[0] = m_ot_g[0]^s[0]; X[0] *= m_ot_h[0]^t[0];
-				X[1] = m_ot_g[1]^s[1]; X[1] *= m_ot_h[1]^t[1];
+		// Step 1: gr=g[b]^r, hr=h[b]^r, where b is the receiver's bit
+		start = MPI_Wtime();
+			recv = GEN_RECV(); // all the (gr, hr)'s
+		m_timer_com += MPI_Wtime() - start;
 
-				// Y[b] = ( gr^s[b] ) * ( hr^t[b] ) * K[b] for b = 0, 1
-				Y[0] *= gr^s[0]; Y[0] *= hr^t[0];
-				Y[1] *= gr^s[1]; Y[1] *= hr^t[1];
+		m_comm_sz += recv.size();
 
-				send.clear();
-				send += X[0].to_bytes();
-				send += X[1].to_bytes();
-				send += Y[0].to_bytes();
-				send += Y[1].to_bytes();
-			m_timer_gen += MPI_Wtime() - start;
+		// Step 2: the generator computes X[0], Y[0], X[1], Y[1]
+		start = MPI_Wtime();
+			send = ot_reply(m_ot_g, m_ot_h, recv, m_ot_bit_cnt, m_ot_out, m_prng, pool);
+		m_timer_gen += MPI_Wtime() - start;
 
-			start = MPI_Wtime();
-				GEN_SEND(send);
-			m_timer_com += MPI_Wtime() - start;
+		start = MPI_Wtime();
+			GEN_SEND(send); // all the X[0], X[1], Y[0], Y[1]'s
+		m_timer_com += MPI_Wtime() - start;
 
-			m_comm_sz += send.size();
-		}
+		m_comm_sz += send.size();
 
 		assert(m_ot_out.size() == 2*m_ot_bit_cnt);
 	GEN_END
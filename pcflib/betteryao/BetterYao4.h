@@ -3,13 +3,14 @@
 
 #include "YaoBase.h"
 #include "GarbledCct3.h"
+#include "ThreadPool.h"
 #include "garbled_circuit_m.h"
 
 class BetterYao4 : public YaoBase
 {
 public:
 	BetterYao4(EnvParams &params);
-	virtual ~BetterYao4() {}
+	virtual ~BetterYao4() { delete m_mux; copies_free(m_copies); }
 
 	virtual void start();
 
@@ -20,6 +21,10 @@ public:
 	void circuit_evaluate();
 
 private:
+	void ot_transfer(Bytes &bits, size_t n);
+	void ot_precompute();
+	void ot_derandomize();
+
 	void ot_init();
 	void ot_random(); // sender has m pairs of l-bit strings, and receiver has m bits
 	void cut_and_choose2_ot();
@@ -29,6 +34,16 @@ private:
 
 	Bytes flip_coins(size_t len);
 
+	// the copies side by side on a ThreadPool, one copy per task
+	static void copy_init_task(void *self, size_t begin, size_t end);
+	static void copy_inp_hash_task(void *self, size_t begin, size_t end);
+	static void copy_check_task(void *self, size_t begin, size_t end);
+	static void copy_evaluate_task(void *self, size_t begin, size_t end);
+	void copy_init(size_t ix);
+	void mux_init();
+	void copies_evaluate(ThreadPool &pool, int &verify);
+	void copy_evaluate(size_t ix);
+
 	void proc_gen_out();
 	void proc_evl_out();
 
@@ -53,12 +68,20 @@ private:
 	vector<Bytes>                   m_rnds;
     vector<GarbledCct3>              m_ccts;
 	vector<garbled_circuit_m_t>     m_gcs; 
+	garbled_copies_m_t              m_copies;
 
     // variables for Gen's input check
     vector<Bytes>                   m_gen_inp_hash;
-	vector<vector<Bytes> >          m_gen_inp_decom;
+	vector<Bytes>                   m_gen_inp_decom; // decom_size() bytes each, back to back
 	vector<Bytes>                   m_matrix;
 
+	// variables for the copies side by side
+	MuxSocket                      *m_mux;     // a channel per copy, if the generator runs them side by side
+	PCFState                       *m_program; // parsed once, for an interpreter per copy over m_mux
+	vector<Bytes>                   m_copy_msgs;    // a message per copy
+	vector<uint64_t>                m_copy_comm_sz; // bytes per copy
+	Bytes                           m_copy_pass;    // 1 for copies that have passed a check
+
 	vector<Prng>					m_prngs;
 	uint32_t                        m_gen_inp_cnt;
 	uint32_t                        m_evl_inp_cnt;
@@ -487,6 +487,8 @@ Circuit::~Circuit()
 {
     m_circuit_fs.close();
 
+	if (m_circuit_fd < 0) return; // no binary circuit was loaded
+
 	struct stat statbuf;
 
 	if (fstat(m_circuit_fd, &statbuf) < 0)
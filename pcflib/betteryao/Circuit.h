@@ -64,7 +64,7 @@ public:
 		m_gate_idx(0),
 		m_ptr(0), m_ptr_begin(0), m_ptr_end(0),
 		m_gate_cnt(0), m_gen_inp_cnt(0), m_gen_out_cnt(0), m_evl_inp_cnt(0), m_evl_out_cnt(0),
-		m_cnt_size(0), m_cnt(0), m_circuit_fd(0) {}
+		m_cnt_size(0), m_cnt(0), m_circuit_fd(-1) {}
 
 	~Circuit();
 
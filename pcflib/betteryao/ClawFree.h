@@ -20,11 +20,17 @@ class ClawFree
 public:
 	ClawFree() {}
 
+	// the same collection as the last run when G_Base::TABLE_DIR is set
 	void init()
 	{
+		Bytes b = read_table_file("claw-free");
+		if (b.size() == size_in_bytes()) { from_bytes(b); return; }
+
 		m_g.random();
 		m_h.random();
-		m_h.fast_exp();
+		m_h.fixed_base();
+
+		write_table_file("claw-free", to_bytes());
 	}
 
 	Bytes to_bytes() const
@@ -37,7 +43,7 @@ public:
 		std::vector<Bytes> chunks = b.split(b.size()/2);
 		m_g.from_bytes(chunks[0]);
 		m_h.from_bytes(chunks[1]);
-		m_h.fast_exp();
+		m_h.fixed_base();
 	}
 
 	size_t size_in_bytes() const
@@ -62,7 +68,9 @@ public:
 	// R(m) = h^m
 	G R(const Z &m)
 	{
-		return m_h^m;
+		G g;
+		power(g, m_h, m);
+		return g;
 	}
 
 	// F(b,m) = g^b h^m
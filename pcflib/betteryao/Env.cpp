@@ -3,3 +3,5 @@
 const int Env::IP_SERVER_PORT = 4096;
 
 Env *Env::instance = 0;
+
+__thread EnvParams *Env::rank_params = 0;
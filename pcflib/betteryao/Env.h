@@ -8,6 +8,7 @@
 #include "ClawFree.h"
 #include "Circuit.h"
 #include "NetIO.h"
+#include "thread_cluster.h"
 
 
 struct EnvParams
@@ -16,14 +17,46 @@ struct EnvParams
 		secu_param(0), stat_param(0),
 		wrld_rank(0),
 		node_rank(0), node_load(0), node_amnt(0),
-		port_base(0), remote(0), server(0),
+		port_base(0), rank_cnt(1), thread_cnt(1), session_cnt(1), worker_cnt(0), frame_size(256*1024), hash_chks(false), privacy_free(false), ot_offline(false), gc_offline(false), remote(0), server(0), cluster(0),
 		//circuit_file(0),
 		private_file(0),
 		pcf_file(0),
-		ipserve_addr(0) {}
+		input_file(0),
+		ipserve_addr(0),
+		ot_store(0),
+		gc_store(0),
+		capture_file(0),
+		replay_file(0) {}
 
 	~EnvParams() { delete remote; delete server; }
 
+	// the settings of params, for a rank that runs as a thread, see
+	// YaoBase::run_ranks(); its rank, connection and claw-free collection
+	// are its own
+	void copy_settings(const EnvParams &params)
+	{
+		secu_param   = params.secu_param;
+		stat_param   = params.stat_param;
+		port_base    = params.port_base;
+		rank_cnt     = params.rank_cnt;
+		thread_cnt   = params.thread_cnt;
+		session_cnt  = params.session_cnt;
+		worker_cnt   = params.worker_cnt;
+		frame_size   = params.frame_size;
+		hash_chks    = params.hash_chks;
+		privacy_free = params.privacy_free;
+		ot_offline   = params.ot_offline;
+		gc_offline   = params.gc_offline;
+		private_file = params.private_file;
+		ipserve_addr = params.ipserve_addr;
+		pcf_file     = params.pcf_file;
+		input_file   = params.input_file;
+		ot_store     = params.ot_store;
+		gc_store     = params.gc_store;
+		capture_file = params.capture_file;
+		replay_file  = params.replay_file;
+	}
+
 	size_t        secu_param;    // security parameter
 	size_t        stat_param;    // statistical security parameter
 
@@ -35,9 +68,23 @@ struct EnvParams
 
 	int           port_base;
 
+	int           rank_cnt;      // ranks of the cluster run as threads of this process, 1 for MPI's
+
+	int           thread_cnt;    // threads garbling/evaluating a circuit or its copies and running OTs
+	int           session_cnt;   // protocol runs over one connection and one OT CRS
+	int           worker_cnt;    // connections the service takes at once, 0 for no service
+	size_t        frame_size;    // bytes of garbled gates the generator sends at a time
+
+	bool          hash_chks;     // check circuits travel as a hash only
+	bool          privacy_free;  // the evaluator may learn every wire value
+	bool          ot_offline;    // only make random OTs for ot_store
+	bool          gc_offline;    // only garble circuits for gc_store
+
 	Socket       *remote;
 	ServerSocket *server;
 
+	thread_cluster_t *cluster;   // shared by the ranks run as threads, if any
+
 	Circuit       circuit;
 	ClawFree      claw_free;
 
@@ -49,6 +96,12 @@ struct EnvParams
 	const char   *pcf_file;
 
   const char *input_file;
+
+	const char   *ot_store;      // dir of the random OTs made offline, if any
+	const char   *gc_store;      // dir of the circuits garbled offline, if any
+
+	const char   *capture_file;  // where the generator writes what it sends, if anywhere
+	const char   *replay_file;   // a capture the evaluator runs on rather than a generator
 };
 
 class Env
@@ -72,6 +125,15 @@ class Env
 
 	static Env *instance;  // singleton instance
 
+	// the params of the rank this thread runs, if the ranks are threads, for
+	// the accessors to go by; other threads go by the instance's
+	static __thread EnvParams *rank_params;
+
+	static EnvParams &params()
+	{
+		return rank_params? *rank_params : instance->m_params;
+	}
+
 
 public:
 	enum { GEN, EVL }; // for ipserver
@@ -89,18 +151,25 @@ public:
 	static void destroy()
 	{
 		delete instance;
+		instance = 0;
+	}
+
+	// for the calling thread, which runs a rank with params of its own
+	static void init_rank(EnvParams &params)
+	{
+		rank_params = &params;
 	}
 
 	static size_t k()
 	{
 		assert(instance != 0);
-		return instance->m_params.secu_param;
+		return params().secu_param;
 	}
 
 	static uint32_t s()
 	{
 		assert(instance != 0);
-		return instance->m_params.stat_param;
+		return params().stat_param;
 	}
 
 	static size_t key_size_in_bytes()
@@ -124,73 +193,163 @@ public:
 	static Circuit &circuit()
 	{
 		assert(instance != 0);
-		return instance->m_params.circuit;
+		return params().circuit;
 	}
 
 	static const char *pcf_file()
 	{
 		assert(instance != 0);
-		return instance->m_params.pcf_file;
+		return params().pcf_file;
 	}
 
 	static const char * private_file()
 	{
 		assert(instance != 0);
-		return instance->m_params.private_file;
+		return params().private_file;
 	}
 
 	static ClawFree &clawfree()
 	{
 		assert(instance != 0);
-		return instance->m_params.claw_free;
+		return params().claw_free;
 	}
 
 	static void claw_free_from_bytes(const Bytes b)
 	{
 		assert(instance != 0);
-		instance->m_params.claw_free.from_bytes(b);
+		params().claw_free.from_bytes(b);
 	}
 
 	static int world_rank()
 	{
 		assert(instance != 0);
-		return instance->m_params.wrld_rank;
+		return params().wrld_rank;
 	}
 
 	static bool is_evl()
 	{
 		assert(instance != 0);
-		return instance->m_params.wrld_rank % 2;
+		return params().wrld_rank % 2;
 	}
 
 	static bool is_root()
 	{
 		assert(instance != 0);
-		return instance->m_params.node_rank == 0;
+		return params().node_rank == 0;
 	}
 
 	static int group_rank()
 	{
 		assert(instance != 0);
-		return instance->m_params.node_rank;
+		return params().node_rank;
 	}
 
 	static int node_load()
 	{
 		assert(instance != 0);
-		return instance->m_params.node_load;
+		return params().node_load;
 	}
 
 	static int node_amnt()
 	{
 		assert(instance != 0);
-		return instance->m_params.node_amnt;
+		return params().node_amnt;
+	}
+
+	static int thread_cnt()
+	{
+		assert(instance != 0);
+		return params().thread_cnt;
+	}
+
+	static int session_cnt()
+	{
+		assert(instance != 0);
+		return params().session_cnt;
+	}
+
+	static int worker_cnt()
+	{
+		assert(instance != 0);
+		return params().worker_cnt;
+	}
+
+	static size_t frame_size()
+	{
+		assert(instance != 0);
+		return params().frame_size;
+	}
+
+	static bool hash_chks()
+	{
+		assert(instance != 0);
+		return params().hash_chks;
+	}
+
+	static bool privacy_free()
+	{
+		assert(instance != 0);
+		return params().privacy_free;
+	}
+
+	static bool ot_offline()
+	{
+		assert(instance != 0);
+		return params().ot_offline;
+	}
+
+	static const char *ot_store()
+	{
+		assert(instance != 0);
+		return params().ot_store;
+	}
+
+	static bool gc_offline()
+	{
+		assert(instance != 0);
+		return params().gc_offline;
+	}
+
+	static const char *gc_store()
+	{
+		assert(instance != 0);
+		return params().gc_store;
+	}
+
+	static const char *capture_file()
+	{
+		assert(instance != 0);
+		return params().capture_file;
+	}
+
+	static const char *replay_file()
+	{
+		assert(instance != 0);
+		return params().replay_file;
 	}
 
 	static Socket *remote()
 	{
 		assert(instance != 0);
-		return instance->m_params.remote;
+		return params().remote;
+	}
+
+	static ServerSocket *server()
+	{
+		assert(instance != 0);
+		return params().server;
+	}
+
+	static const char *ipserve_addr()
+	{
+		assert(instance != 0);
+		return params().ipserve_addr;
+	}
+
+	static int port_base()
+	{
+		assert(instance != 0);
+		return params().port_base;
 	}
 
 	virtual ~Env() {}
@@ -2,6 +2,9 @@
 #define HASH_H_
 
 #include <openssl/sha.h>
+#include <algorithm>
+#include <cstring>
+
 #include "Bytes.h"
 
 class Hash
@@ -27,7 +30,12 @@ public:
 
 	void update(const Bytes &msg)
 	{
-		SHA256_Update(&m_sha256, &msg.at(0), msg.size());
+		update(msg.empty()? 0 : &msg[0], msg.size());
+	}
+
+	void update(const byte *msg, size_t len)
+	{
+		SHA256_Update(&m_sha256, msg, len);
 	}
 
 	Bytes sig(size_t bits)
@@ -49,4 +57,102 @@ public:
 	}
 };
 
+// the compression function of AesHash, see Aes.cpp
+void AES256_compress(uint8_t *chain, const uint8_t *block);
+
+//
+// Hirose's double-block-length hash over AES-256: the 256-bit chaining value
+// absorbs 16 bytes per key schedule, with MD-strengthening at the end. Only
+// worth it with AES-NI; OpenSSL already runs SHA-256 on the SHA extensions
+// where the CPU has them.
+//
+class AesHash
+{
+	uint8_t  m_chain[32];
+	uint8_t  m_block[16];
+	size_t   m_fill;    // bytes waiting in m_block
+	uint64_t m_len;     // bytes absorbed so far
+
+public:
+	AesHash()
+	{
+		init();
+	}
+
+	void init()
+	{
+		memset(m_chain, 0, sizeof(m_chain));
+		m_fill = 0;
+		m_len = 0;
+	}
+
+	void update(const Bytes &msg)
+	{
+		update(msg.empty()? 0 : &msg[0], msg.size());
+	}
+
+	void update(const byte *msg, size_t len)
+	{
+		m_len += len;
+
+		if (m_fill > 0)
+		{
+			size_t cnt = std::min(len, sizeof(m_block)-m_fill);
+			memcpy(m_block+m_fill, msg, cnt);
+			m_fill += cnt; msg += cnt; len -= cnt;
+
+			if (m_fill < sizeof(m_block)) return;
+
+			AES256_compress(m_chain, m_block);
+			m_fill = 0;
+		}
+
+		for (; len >= sizeof(m_block); msg += sizeof(m_block), len -= sizeof(m_block))
+		{
+			AES256_compress(m_chain, msg);
+		}
+
+		memcpy(m_block, msg, len);
+		m_fill = len;
+	}
+
+	Bytes sig(size_t bits)
+	{
+		const byte MASK[8] =
+		{
+			0xFF, 0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F
+		};
+
+		assert((0 < bits) && (bits <= 256));
+
+		// 0x80, zeros, then the length in bits in the last 8 bytes of a block
+		uint64_t len = m_len*8;
+
+		m_block[m_fill++] = 0x80;
+		if (m_fill > sizeof(m_block)-8)
+		{
+			memset(m_block+m_fill, 0, sizeof(m_block)-m_fill);
+			AES256_compress(m_chain, m_block);
+			m_fill = 0;
+		}
+		memset(m_block+m_fill, 0, sizeof(m_block)-8-m_fill);
+		for (size_t ix = 0; ix < 8; ix++) { m_block[sizeof(m_block)-1-ix] = len >> (8*ix); }
+		AES256_compress(m_chain, m_block);
+
+		Bytes hash(m_chain, m_chain+sizeof(m_chain));
+
+		hash.resize((bits+7)/8);
+		hash.back() &= MASK[bits % 8]; // clear the extra bits
+
+		return hash;
+	}
+};
+
+// the hash over garbled circuits; -DAES_HASH picks the AES-based one
+#ifdef AES_HASH
+typedef AesHash CircuitHash;
+#else
+typedef Hash    CircuitHash;
+#endif
+
 #endif /* HASH_H_ */
@@ -6,6 +6,7 @@
 #include <netdb.h>
 #include <errno.h>
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -13,7 +14,22 @@
 
 #include "NetIO.h"
 
-const int CHUNK_SIZE = 1024;
+inline void my_read(int socket, void *data, size_t n)
+{
+	for (size_t ix = 0; ix != n; )
+		ix += recv(socket, reinterpret_cast<char*>(data)+ix, n-ix, 0);
+}
+
+inline void my_write(int socket, const void *data, size_t n, int flags)
+{
+	for (size_t ix = 0; ix != n; )
+	{
+		ssize_t sent = send(socket, reinterpret_cast<const char*>(data)+ix, n-ix, flags);
+		if (sent < 0 && errno == EINTR) continue;
+		if (sent < 0) return; // the connection is gone, and so is the other party
+		ix += sent;
+	}
+}
 
 Socket::Socket() : m_socket(socket(AF_INET, SOCK_STREAM, IPPROTO_TCP))
 {}
@@ -24,41 +40,37 @@ Socket::~Socket()
     close(m_socket);
 }
 
+// the length, then the message in as few system calls as the kernel takes
 void Socket::write_bytes(const Bytes &bytes)
 {
-  //  assert(bytes.size() > 0);
 	uint32_t sz = htonl(bytes.size());
 
-	send(m_socket, &sz, sizeof(sz), 0);
-	sz = bytes.size();
-
-	size_t ix = 0;
-	for (; sz > CHUNK_SIZE; sz -= CHUNK_SIZE, ix += CHUNK_SIZE)
-			send(m_socket, &bytes[ix], CHUNK_SIZE, 0);
-	send(m_socket, &bytes[ix], bytes.size()-ix, 0);
+#ifdef MSG_MORE
+	my_write(m_socket, &sz, sizeof(sz), MSG_MORE); // goes out with the message
+#else
+	my_write(m_socket, &sz, sizeof(sz), 0);
+#endif
+	if (!bytes.empty())
+		my_write(m_socket, &bytes[0], bytes.size(), 0);
 }
 
-inline void my_read(int socket, void *data, size_t n)
+Bytes Socket::read_bytes()
 {
-	for (size_t ix = 0; ix != n; )
-		ix += recv(socket, reinterpret_cast<char*>(data)+ix, n-ix, 0);
+	Bytes bytes;
+	read_bytes(bytes);
+	return bytes;
 }
 
-Bytes Socket::read_bytes()
+// into bytes, which keeps its storage when it is large enough already
+void Socket::read_bytes(Bytes &bytes)
 {
-        uint32_t sz, ix;
-        my_read(m_socket, &sz, 4);
-        sz = ntohl(sz);
-
-        Bytes bytes(sz);
-        for (ix = 0; sz > CHUNK_SIZE; sz -= CHUNK_SIZE, ix += CHUNK_SIZE)
-        	my_read(m_socket, &bytes[0]+ix, CHUNK_SIZE);
-
-        my_read(m_socket, &bytes[0]+ix, bytes.size()-ix);
+	uint32_t sz;
+	my_read(m_socket, &sz, sizeof(sz));
+	sz = ntohl(sz);
 
-        //        assert(bytes.size() > 0);
-
-        return bytes;
+	bytes.resize(sz);
+	if (sz > 0)
+		my_read(m_socket, &bytes[0], sz);
 }
 
 void Socket::write_string(const std::string &str)
@@ -192,3 +204,173 @@ Socket *ServerSocket::accept()
 }
 
 ServerSocket::~ServerSocket() {}
+
+
+// no socket of its own, so -1 for the base to close
+CaptureSocket::CaptureSocket(Socket *remote, const char *path) : Socket(-1), m_remote(remote), m_file(fopen(path, "wb"))
+{
+	if (!m_file)
+	{
+		perror("cannot create the capture");
+		exit(EXIT_FAILURE);
+	}
+}
+
+CaptureSocket::~CaptureSocket()
+{
+	if (fclose(m_file) != 0)
+		perror("cannot write the capture");
+	delete m_remote;
+}
+
+void CaptureSocket::write_frame(const Bytes &bytes)
+{
+	uint32_t sz = htonl(bytes.size());
+
+	fwrite(&sz, sizeof(sz), 1, m_file);
+	if (!bytes.empty())
+		fwrite(&bytes[0], 1, bytes.size(), m_file);
+}
+
+void CaptureSocket::write_bytes(const Bytes &bytes)
+{
+	m_remote->write_bytes(bytes);
+	write_frame(bytes);
+}
+
+void CaptureSocket::read_bytes(Bytes &bytes)
+{
+	m_remote->read_bytes(bytes);
+}
+
+void CaptureSocket::write_note(const Bytes &bytes)
+{
+	write_frame(bytes);
+}
+
+// the whole capture at once, so that reading it costs no system calls
+ReplaySocket::ReplaySocket(const char *path) : Socket(-1), m_ofs(0)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f)
+	{
+		perror("cannot open the capture");
+		exit(EXIT_FAILURE);
+	}
+
+	byte bufr[1 << 16];
+	for (size_t n; (n = fread(bufr, 1, sizeof(bufr), f)) != 0; )
+		m_data.insert(m_data.end(), bufr, bufr+n);
+	fclose(f);
+}
+
+void ReplaySocket::read_bytes(Bytes &bytes)
+{
+	uint32_t sz;
+
+	if (m_data.size() - m_ofs < sizeof(sz))
+	{
+		fprintf(stderr, "the capture has no more messages\n");
+		exit(EXIT_FAILURE);
+	}
+
+	memcpy(&sz, &m_data[m_ofs], sizeof(sz));
+	sz = ntohl(sz);
+	m_ofs += sizeof(sz);
+
+	if (m_data.size() - m_ofs < sz)
+	{
+		fprintf(stderr, "the capture ends in the middle of a message\n");
+		exit(EXIT_FAILURE);
+	}
+
+	Bytes::const_iterator it = m_data.begin() + m_ofs;
+	m_ofs += sz;
+	bytes.assign(it, it+sz);
+}
+
+MuxSocket::MuxSocket(Socket *remote, size_t channel_cnt) : m_remote(remote), m_reading(false), m_queues(channel_cnt)
+{
+	pthread_mutex_init(&m_write_mutex, 0);
+	pthread_mutex_init(&m_read_mutex, 0);
+	pthread_cond_init(&m_read_cond, 0);
+}
+
+MuxSocket::~MuxSocket()
+{
+	pthread_cond_destroy(&m_read_cond);
+	pthread_mutex_destroy(&m_read_mutex);
+	pthread_mutex_destroy(&m_write_mutex);
+}
+
+// the channel in a message of four bytes of its own, so that neither end
+// has to copy the message itself
+void MuxSocket::write_bytes(size_t channel, const Bytes &bytes)
+{
+	uint32_t ch = htonl(channel);
+	Bytes tag(sizeof(ch));
+	memcpy(&tag[0], &ch, sizeof(ch));
+
+	pthread_mutex_lock(&m_write_mutex);
+		m_remote->write_bytes(tag);
+		m_remote->write_bytes(bytes);
+	pthread_mutex_unlock(&m_write_mutex);
+}
+
+void MuxSocket::read_bytes(size_t channel, Bytes &bytes)
+{
+	assert(channel < m_queues.size());
+
+	pthread_mutex_lock(&m_read_mutex);
+		while (m_queues[channel].empty())
+		{
+			if (m_reading) // another thread reads for everyone
+			{
+				pthread_cond_wait(&m_read_cond, &m_read_mutex);
+				continue;
+			}
+
+			m_reading = true;
+
+			Bytes frame;
+			if (!m_free.empty())
+			{
+				frame.swap(m_free.back());
+				m_free.pop_back();
+			}
+			pthread_mutex_unlock(&m_read_mutex);
+
+			Bytes tag = m_remote->read_bytes();
+			m_remote->read_bytes(frame);
+
+			uint32_t ch = m_queues.size(); // no channel
+			if (tag.size() == sizeof(ch))
+			{
+				memcpy(&ch, &tag[0], sizeof(ch));
+				ch = ntohl(ch);
+			}
+			if (ch >= m_queues.size())
+			{
+				fprintf(stderr, "a message for no channel\n");
+				exit(EXIT_FAILURE);
+			}
+
+			pthread_mutex_lock(&m_read_mutex);
+			m_queues[ch].push_back(Bytes());
+			m_queues[ch].back().swap(frame);
+			m_reading = false;
+			pthread_cond_broadcast(&m_read_cond);
+		}
+
+		std::deque<Bytes> &queue = m_queues[channel];
+		bytes.swap(queue.front());
+
+		// a buffer for each channel is plenty
+		if (m_free.size() < m_queues.size() && queue.front().capacity() > 0)
+		{
+			m_free.push_back(Bytes());
+			m_free.back().swap(queue.front());
+		}
+		queue.pop_front();
+	pthread_mutex_unlock(&m_read_mutex);
+}
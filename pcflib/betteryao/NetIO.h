@@ -1,6 +1,10 @@
 #ifndef NETIO_H_
 #define NETIO_H_
 
+#include <cstdio>
+#include <deque>
+#include <pthread.h>
+
 #include "Bytes.h"
 
 class Socket
@@ -13,7 +17,8 @@ public:
 	Socket(int socket) : m_socket(socket) {}
 	virtual ~Socket();
 
-	void write_bytes(const Bytes &bytes);
+	virtual void write_bytes(const Bytes &bytes);
+	virtual void read_bytes(Bytes &bytes);
 	Bytes read_bytes();
 
 	void write_string(const std::string &str);
@@ -37,4 +42,71 @@ public:
 	virtual ~ServerSocket();
 };
 
+// A connection that also writes what goes out to a file, each message just
+// as it goes on the wire, along with notes that go to the file only
+class CaptureSocket : public Socket
+{
+	Socket *m_remote;
+	FILE   *m_file;
+
+	void write_frame(const Bytes &bytes);
+
+public:
+	CaptureSocket(Socket *remote, const char *path);
+	virtual ~CaptureSocket();
+
+	using Socket::read_bytes;
+
+	virtual void write_bytes(const Bytes &bytes);
+	virtual void read_bytes(Bytes &bytes);
+
+	void write_note(const Bytes &bytes);
+};
+
+// The messages and notes of a capture, read from memory in the order they
+// were written; what is written to it goes nowhere
+class ReplaySocket : public Socket
+{
+	Bytes  m_data;
+	size_t m_ofs;
+
+public:
+	ReplaySocket(const char *path);
+	virtual ~ReplaySocket() {}
+
+	using Socket::read_bytes;
+
+	virtual void write_bytes(const Bytes &bytes) {}
+	virtual void read_bytes(Bytes &bytes);
+};
+
+// Channels over one connection, each message preceded by one with its
+// channel, that threads can use side by side. A thread waiting on a channel
+// reads from the connection unless another thread already does, and keeps
+// what comes for the other channels until they ask for it. The buffers that
+// readers hand back are reused for the messages to come.
+class MuxSocket
+{
+	Socket                        *m_remote;
+
+	pthread_mutex_t                m_write_mutex;
+	pthread_mutex_t                m_read_mutex;
+	pthread_cond_t                 m_read_cond;
+	bool                           m_reading;   // a thread is in m_remote->read_bytes()
+
+	std::vector<std::deque<Bytes> > m_queues;   // what has come for each channel
+	std::vector<Bytes>             m_free;     // storage for the messages to come
+
+	// prohibited member functions
+	MuxSocket(const MuxSocket &);
+	MuxSocket &operator=(const MuxSocket &);
+
+public:
+	MuxSocket(Socket *remote, size_t channel_cnt); // remote is left open
+	~MuxSocket();
+
+	void write_bytes(size_t channel, const Bytes &bytes);
+	void read_bytes(size_t channel, Bytes &bytes); // in exchange for the storage of bytes
+};
+
 #endif /* NETIO_H_ */
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -7,6 +8,14 @@
 
 #include "Prng.h"
 
+#ifdef AESNI
+extern "C"
+{
+void AES_128_Key_Expansion(const uint8_t *userkey, uint8_t *key_schedule);
+void AES_ECB_encrypt(const uint8_t *in, uint8_t *out, unsigned long length, const uint8_t *KS, int nr);
+};
+#endif
+
 const char *Prng::RANDOM_FILE = "/dev/urandom";
 
 static Bytes shen_sha256(const Bytes &data, const size_t bits)
@@ -43,26 +52,30 @@ void Prng::srand()
 void Prng::srand(const Bytes &seed)
 {
 	Bytes hashed_seed = shen_sha256(seed, AES_BLOCK_SIZE_IN_BITS);
+#ifdef AESNI
+	AES_128_Key_Expansion(&hashed_seed[0], reinterpret_cast<byte*>(m_ks));
+#else
 	memset(&m_key, 0, sizeof(AES_KEY));
 	AES_set_encrypt_key(&hashed_seed[0], AES_BLOCK_SIZE_IN_BITS, &m_key);
+#endif
 	m_state = shen_sha256(seed, AES_BLOCK_SIZE_IN_BITS);
 }
 
 
 uint64_t Prng::rand_range(uint64_t n) // sample a number from { 0, 1, ..., n-1 }
 {
-	int bit_length = 0;
-	while ((1<<bit_length)<n) { bit_length++; }
+	size_t bit_length = 0;
+	while (bit_length < 64 && (uint64_t(1)<<bit_length) < n) { bit_length++; }
 
-	Bytes rnd;
-	std::string hex_rnd;
-	char *endptr;
+	uint8_t rnd[8];
 	uint64_t ret = 0;
 	do
 	{ // repeat if the sampled number is >= n
-		rnd = rand(bit_length);
-		hex_rnd = "0x" + rnd.to_hex();
-		ret = strtoll(hex_rnd.c_str(), &endptr, 16);
+		rand(rnd, bit_length);
+
+		ret = 0; // little-endian, so that the cleared bits are the top ones
+		for (size_t ix = 0; ix < (bit_length+7)/8; ix++)
+			ret |= uint64_t(rnd[ix]) << (8*ix);
 
 	} while (ret >= n);
 
@@ -70,39 +83,78 @@ uint64_t Prng::rand_range(uint64_t n) // sample a number from { 0, 1, ..., n-1 }
 }
 
 Bytes Prng::rand(size_t bits)
+{
+	Bytes rnd((bits+7)/8);
+	rand(rnd.empty()? 0 : &rnd[0], bits);
+	return rnd;
+}
+
+void Prng::rand(uint8_t *out, size_t bits)
 {
 	static const byte MASK[8] =
 		{ 0xFF, 0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F };
 
-	Bytes rnd;
+	const size_t BATCH = 8;
+	__m128i blocks[BATCH];
+
+	size_t len = (bits+7)/8;
+	size_t left = bits > 128? (bits+127)/128 : 1; // at least one block is drawn
 
-	while (bits > 128)
+	while (left > 0)
 	{
-		rnd += rand();
-		bits -= 128;
-	}
+		size_t n = std::min(left, BATCH);
+		fill(blocks, n);
 
-	Bytes last = rand();
+		size_t m = std::min(len, n*AES_BLOCK_SIZE);
+		memcpy(out, blocks, m);
 
-	last.resize((bits+7)/8);
-	last.back() &= MASK[bits%8]; // clear the extra bits
+		out += m;
+		len -= m;
+		left -= n;
+	}
 
-	return rnd + last;
+	if (bits%8) out[-1] &= MASK[bits%8]; // clear the extra bits
 }
 
 int Prng::cnt = 0;
 
 Bytes Prng::rand()
 {
-	Bytes rnd(AES_BLOCK_SIZE);
-	AES_ecb_encrypt(&m_state[0], &rnd[0], &m_key, AES_ENCRYPT);
+	__m128i block;
+	fill(&block, 1);
+
+	const byte *p = reinterpret_cast<byte*>(&block);
+	return Bytes(p, p+AES_BLOCK_SIZE);
+}
+
+void Prng::fill(__m128i *out, size_t n)
+{
+	// the counter sits in bytes 7..14 of the state
+	const size_t CTR_OFS = AES_BLOCK_SIZE-1-sizeof(long long);
 
-	cnt++;
+	byte *state = &m_state[0];
+	byte *block = reinterpret_cast<byte*>(out);
 
-	// update state
-	long long cnt = *(long long*)(&m_state[m_state.size()-1-sizeof(cnt)]);
-	cnt++;
-	*(long long*)(&m_state[m_state.size()-1-sizeof(cnt)]) = cnt;
+	long long ctr;
+	memcpy(&ctr, state+CTR_OFS, sizeof(ctr));
 
-	return rnd;
+	for (size_t ix = 0; ix < n; ix++, ctr++)
+	{
+		memcpy(block+ix*AES_BLOCK_SIZE, state, AES_BLOCK_SIZE);
+		memcpy(block+ix*AES_BLOCK_SIZE+CTR_OFS, &ctr, sizeof(ctr));
+	}
+
+	memcpy(state+CTR_OFS, &ctr, sizeof(ctr)); // update state
+
+#ifdef AESNI
+	// encrypted in place, four blocks in flight at a time
+	AES_ECB_encrypt(block, block, n*AES_BLOCK_SIZE, reinterpret_cast<byte*>(m_ks), 10);
+#else
+	for (size_t ix = 0; ix < n; ix++)
+	{
+		AES_encrypt(block+ix*AES_BLOCK_SIZE, block+ix*AES_BLOCK_SIZE, &m_key);
+	}
+#endif
+
+	__sync_fetch_and_add(&cnt, n); // PRNGs of different threads meet here
 }
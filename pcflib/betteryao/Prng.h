@@ -1,14 +1,24 @@
 #ifndef PRNG_H_
 #define PRNG_H_
 
+#include <emmintrin.h>
 #include <openssl/aes.h>
 
 #include "Bytes.h"
 
+//
+// AES in counter mode: the i-th block of the stream is the encryption of the
+// seeded state with i added to its 64-bit counter. rand() and rand(bits) cut
+// the same stream as fill(), so a circuit regenerated from its seed draws the
+// same keys whichever call the regenerating code uses.
+//
 class Prng {
 
 	Bytes   m_state;
 	AES_KEY m_key;
+#ifdef AESNI
+	__m128i m_ks[11]; // AES-128 key schedule for the AES-NI routines
+#endif
 
 public:
 	static int cnt;
@@ -23,6 +33,9 @@ public:
 	Bytes rand();
 	Bytes rand(size_t bits);
 	uint64_t rand_range(uint64_t n);  // sample a number from { 0, 1, ..., n-1 }
+
+	void fill(__m128i *out, size_t n);        // the next n blocks
+	void rand(uint8_t *out, size_t bits);     // (bits+7)/8 bytes, as rand(bits)
 };
 
 #endif /* PRNG_H_ */
@@ -0,0 +1,104 @@
+#include <cassert>
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(size_t thread_cnt) :
+	m_task(0), m_arg(0), m_size(0), m_grain(1), m_next(0),
+	m_round(0), m_busy(0), m_quit(false)
+{
+	pthread_mutex_init(&m_mutex, 0);
+	pthread_cond_init(&m_work_cond, 0);
+	pthread_cond_init(&m_done_cond, 0);
+
+	for (size_t ix = 1; ix < thread_cnt; ix++)
+	{
+		pthread_t thread;
+		int ret = pthread_create(&thread, 0, worker, this);
+		assert(ret == 0);
+		m_workers.push_back(thread);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	pthread_mutex_lock(&m_mutex);
+		m_quit = true;
+		pthread_cond_broadcast(&m_work_cond);
+	pthread_mutex_unlock(&m_mutex);
+
+	for (size_t ix = 0; ix < m_workers.size(); ix++)
+	{
+		pthread_join(m_workers[ix], 0);
+	}
+
+	pthread_cond_destroy(&m_done_cond);
+	pthread_cond_destroy(&m_work_cond);
+	pthread_mutex_destroy(&m_mutex);
+}
+
+void ThreadPool::parallel_for(size_t n, size_t grain, task_t task, void *arg)
+{
+	if (grain == 0) grain = 1;
+
+	if (m_workers.empty() || n <= grain) // not worth waking anyone up
+	{
+		if (n > 0) task(arg, 0, n);
+		return;
+	}
+
+	pthread_mutex_lock(&m_mutex);
+		m_task  = task;
+		m_arg   = arg;
+		m_size  = n;
+		m_grain = grain;
+		m_next  = 0;
+		m_busy  = m_workers.size();
+		m_round++;
+		pthread_cond_broadcast(&m_work_cond);
+	pthread_mutex_unlock(&m_mutex);
+
+	run_chunks();
+
+	pthread_mutex_lock(&m_mutex);
+		while (m_busy > 0)
+			pthread_cond_wait(&m_done_cond, &m_mutex);
+	pthread_mutex_unlock(&m_mutex);
+}
+
+void ThreadPool::run_chunks()
+{
+	size_t begin;
+	while ((begin = __sync_fetch_and_add(&m_next, m_grain)) < m_size)
+	{
+		size_t end = begin + m_grain < m_size? begin + m_grain : m_size;
+		m_task(m_arg, begin, end);
+	}
+}
+
+void *ThreadPool::worker(void *pool)
+{
+	ThreadPool &self = *reinterpret_cast<ThreadPool*>(pool);
+	size_t round = 0;
+
+	pthread_mutex_lock(&self.m_mutex);
+	for (;;)
+	{
+		while (self.m_round == round && !self.m_quit)
+			pthread_cond_wait(&self.m_work_cond, &self.m_mutex);
+
+		if (self.m_quit)
+			break;
+
+		round = self.m_round;
+		pthread_mutex_unlock(&self.m_mutex);
+
+		self.run_chunks();
+
+		pthread_mutex_lock(&self.m_mutex);
+		if (--self.m_busy == 0)
+			pthread_cond_signal(&self.m_done_cond);
+	}
+	pthread_mutex_unlock(&self.m_mutex);
+
+	return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <vector>
+
+//
+// A fixed set of worker threads that run parallel_for() loops together
+// with the calling thread. The iteration space is cut into chunks of
+// `grain' iterations, and every thread keeps claiming the next unclaimed
+// chunk from a shared counter until none is left, so that threads that
+// finish early take over the work of the slower ones.
+//
+class ThreadPool
+{
+public:
+	typedef void (*task_t)(void *arg, size_t begin, size_t end);
+
+	ThreadPool(size_t thread_cnt); // including the calling thread
+	~ThreadPool();
+
+	size_t size() const { return m_workers.size()+1; }
+
+	// run task(arg, begin, end) over [0, n) and return when all chunks are done
+	void parallel_for(size_t n, size_t grain, task_t task, void *arg);
+
+private:
+	// prohibited member functions
+	ThreadPool(const ThreadPool &);
+	ThreadPool &operator=(const ThreadPool &);
+
+	static void *worker(void *pool);
+	void run_chunks();
+
+	std::vector<pthread_t> m_workers;
+
+	pthread_mutex_t        m_mutex;
+	pthread_cond_t         m_work_cond;
+	pthread_cond_t         m_done_cond;
+
+	task_t                 m_task;
+	void                  *m_arg;
+	size_t                 m_size;
+	size_t                 m_grain;
+	volatile size_t        m_next;   // first unclaimed iteration
+
+	size_t                 m_round;  // bumped for every parallel_for()
+	size_t                 m_busy;   // workers still in the current round
+	bool                   m_quit;
+};
+
+#endif /* THREADPOOL_H_ */
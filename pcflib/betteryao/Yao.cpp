@@ -1,10 +1,56 @@
 #include "Yao.h"
+#include "ot_batch.h"
+#include "ot_extension.h"
+#include "ot_store.h"
 
 #include <log4cxx/logger.h>
 static log4cxx::LoggerPtr logger(log4cxx::Logger::getLogger("Yao.cpp"));
 
+namespace
+{
+
+const size_t GC_CHUNK = 1 << 20; // bytes of a stored circuit per message
+
+const size_t HELLO_LEN = 13; // what a connection to the service or a capture runs, see Yao::serve_sessions()
+
+void put_u32(Bytes &b, size_t ix, uint32_t v)
+{
+	for (size_t jx = 0; jx < 4; jx++) b[ix+jx] = v >> (24-8*jx);
+}
 
-Yao::Yao(EnvParams &params) : YaoBase(params), m_gcs(0)
+uint32_t get_u32(const Bytes &b, size_t ix)
+{
+	uint32_t v = 0;
+	for (size_t jx = 0; jx < 4; jx++) v = (v << 8) | b[ix+jx];
+	return v;
+}
+
+// cuts an input from the private file to the bits the circuit takes
+void fit_input(Bytes &inp, size_t bits)
+{
+	static const byte MASK[8] = { 0xFF, 0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F};
+
+	inp.resize((bits+7)/8);
+	inp.back() &= MASK[bits%8];
+}
+
+// whether the OTs can run on a thread next to the circuit: the socket of
+// the two-party builds takes a reader and a writer at once, and MPI does in
+// the simulation only if it has been initialized for threads
+bool ot_overlap()
+{
+#if defined GEN_CODE || defined EVL_CODE
+	return true;
+#else
+	int level;
+	MPI_Query_thread(&level);
+	return level == MPI_THREAD_MULTIPLE;
+#endif
+}
+
+}
+
+Yao::Yao(EnvParams &params) : YaoBase(params), m_ot_crs_ready(false), m_ot_crs_made(false), m_ot_running(false), m_gcs(0), m_program(0)
 {
 	if (Env::s() != 1)
 	{
@@ -18,405 +64,1250 @@ Yao::Yao(EnvParams &params) : YaoBase(params), m_gcs(0)
 	m_gen_inp_cnt = read_alice_length(Env::private_file());
 	m_evl_inp_cnt = read_bob_length(Env::private_file());
 
-	static byte MASK[8] = { 0xFF, 0x01, 0x03, 0x07, 0x0F, 0x1F, 0x3F, 0x7F};
+	fit_input(m_evl_inp, m_evl_inp_cnt);
+	fit_input(m_gen_inp, m_gen_inp_cnt);
+
+	for (size_t ix = 0; ix < m_inp_recs.size(); ix++)
+	{
+		GEN_BEGIN
+			fit_input(m_inp_recs[ix], m_gen_inp_cnt);
+		GEN_END
+
+		EVL_BEGIN
+			fit_input(m_inp_recs[ix], m_evl_inp_cnt);
+		EVL_END
+	}
+}
+
+Yao::Yao(const Yao &service, Socket *remote) : YaoBase(service, remote),
+	m_ot_crs_ready(false), m_ot_crs_made(service.m_ot_crs_made), m_ot_running(false), m_gcs(1),
+	m_gen_inp_cnt(service.m_gen_inp_cnt), m_evl_inp_cnt(service.m_evl_inp_cnt), m_program(service.m_program)
+{
+	m_ot_g[0] = service.m_ot_g[0];
+	m_ot_g[1] = service.m_ot_g[1];
+	m_ot_h[0] = service.m_ot_h[0];
+	m_ot_h[1] = service.m_ot_h[1];
+
+	m_rnds.resize(1);
+	m_gen_inp_masks.resize(1);
+}
+
+
+void Yao::start()
+{
+	if (Env::worker_cnt() != 0)
+	{
+		serve();
+		return;
+	}
+
+	if (Env::ot_offline())
+	{
+		ot_precompute();
+		final_report();
+		return;
+	}
+
+	if (Env::gc_offline())
+	{
+		gc_precompute();
+		final_report();
+		return;
+	}
+
+	uint32_t session_cnt = Env::session_cnt();
+
+	if (Env::capture_file() || Env::replay_file())
+		session_cnt = capture_init();
+
+	for (size_t ix = 0; ix < session_cnt; ix++)
+	{
+		if (m_inp_recs.size() > 1)
+		{
+			batch_evaluate();
+			final_report();
+			continue;
+		}
+
+		oblivious_transfer();
+
+		if (Env::gc_store())
+			circuit_replay();
+		else
+			circuit_evaluate();
+
+		final_report();
+	}
+}
+
+// The service: the evaluator keeps the circuit and its input in memory and
+// serves Env::worker_cnt() connections at once on its listener, each with a
+// Yao of its own, until it is killed. The generator is a load generator: it
+// opens that many connections and runs Env::session_cnt() sessions over each.
+void Yao::serve()
+{
+#if !(defined GEN_CODE || defined EVL_CODE)
+	LOG4CXX_FATAL(logger, "the service needs the two-party builds");
+	MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+#endif
+
+	if (Env::ot_offline() || Env::gc_offline() || Env::ot_store() || Env::gc_store() || Env::capture_file() || Env::replay_file())
+	{
+		LOG4CXX_FATAL(logger, "the service runs without offline OTs or circuits, or captures");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	pcf_parse();
+
+	// one CRS for every connection, so that the evaluator builds its
+	// fixed-base tables for it once
+	GEN_BEGIN
+		ThreadPool pool(Env::thread_cnt());
+
+		ot_crs(m_ot_g, m_ot_h);
+		fixed_base(m_ot_g, 2, pool);
+		fixed_base(m_ot_h, 2, pool);
+		m_ot_crs_made = true;
+	GEN_END
+
+	pthread_mutex_init(&m_serve_mutex, 0);
+	m_serve_cnt = 0;
+
+	double start = MPI_Wtime();
+		ThreadPool workers(Env::worker_cnt());
+		workers.parallel_for(Env::worker_cnt(), 1, serve_task, this);
+	double wall = MPI_Wtime() - start;
+
+	pthread_mutex_destroy(&m_serve_mutex);
+
+	GEN_BEGIN
+		LOG4CXX_INFO(logger, "GEN ran " << m_serve_cnt << " sessions over " << Env::worker_cnt() <<
+			" connections in " << wall << " s: " << m_serve_cnt/wall << " sessions/s");
+	GEN_END
+}
+
+void Yao::serve_task(void *self, size_t begin, size_t end)
+{
+	for (size_t ix = begin; ix < end; ix++)
+		reinterpret_cast<Yao*>(self)->serve_worker();
+}
+
+// one connection of the generator, or every connection that comes to this
+// worker of the evaluator
+void Yao::serve_worker()
+{
+	GEN_BEGIN
+		Yao session(*this, new ClientSocket(Env::ipserve_addr(), Env::port_base()+1));
+		session.serve_sessions();
+
+		pthread_mutex_lock(&m_serve_mutex);
+			m_serve_cnt += Env::session_cnt();
+		pthread_mutex_unlock(&m_serve_mutex);
+	GEN_END
+
+	EVL_BEGIN
+		for (;;)
+		{
+			pthread_mutex_lock(&m_serve_mutex); // one worker waits on the listener at a time
+				Socket *remote = Env::server()->accept();
+			pthread_mutex_unlock(&m_serve_mutex);
+
+			Yao session(*this, remote);
+			session.serve_sessions();
+		}
+	EVL_END
+}
+
+// The generator opens a connection with the circuit and mode it expects and
+// the number of sessions to come, so that the evaluator can turn it away
+// rather than run another circuit with it.
+void Yao::serve_sessions()
+{
+	Bytes hello(HELLO_LEN), ack(1);
+	uint32_t session_cnt = 0;
+
+	GEN_BEGIN
+		session_cnt = Env::session_cnt();
+
+		hello[0] = Env::privacy_free();
+		put_u32(hello, 1, m_gen_inp_cnt);
+		put_u32(hello, 5, m_evl_inp_cnt);
+		put_u32(hello, 9, session_cnt);
+		GEN_SEND(hello);
+
+		ack = GEN_RECV();
+		if (ack.size() != 1 || ack[0] != 1)
+		{
+			LOG4CXX_FATAL(logger, "the service runs another circuit or mode");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+	GEN_END
+
+	EVL_BEGIN
+		hello = EVL_RECV();
+
+		ack[0] = hello.size() == HELLO_LEN && hello[0] == Env::privacy_free() &&
+			get_u32(hello, 1) == m_gen_inp_cnt && get_u32(hello, 5) == m_evl_inp_cnt;
+		EVL_SEND(ack);
+
+		if (ack[0] != 1)
+		{
+			LOG4CXX_ERROR(logger, "EVL turned away a connection for another circuit or mode");
+			return;
+		}
+
+		session_cnt = get_u32(hello, 9);
+	EVL_END
+
+	for (size_t ix = 0; ix < session_cnt; ix++)
+	{
+		oblivious_transfer();
+		circuit_evaluate();
+		final_report();
+	}
+}
+
+// A capture starts with a note of the circuit and mode, the number of
+// sessions and the seed of the generator's PRNG, which draws everything the
+// generator keeps secret but the CRS. The evaluator replaying it runs as many
+// sessions as there are in it.
+uint32_t Yao::capture_init()
+{
+#if !(defined GEN_CODE || defined EVL_CODE)
+	LOG4CXX_FATAL(logger, "captures need the two-party builds");
+	MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+#endif
+
+	if (Env::ot_offline() || Env::gc_offline() || Env::ot_store() || Env::gc_store() || m_inp_recs.size() > 1)
+	{
+		LOG4CXX_FATAL(logger, "a capture runs one record online, without offline OTs or circuits");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	Bytes note(HELLO_LEN), seed;
+	uint32_t session_cnt = Env::session_cnt();
+
+	GEN_BEGIN
+		seed = Prng().rand(Env::k());
+		m_prng.srand(seed);
+
+		note[0] = Env::privacy_free();
+		put_u32(note, 1, m_gen_inp_cnt);
+		put_u32(note, 5, m_evl_inp_cnt);
+		put_u32(note, 9, session_cnt);
+		note += seed;
+
+		static_cast<CaptureSocket*>(m_remote)->write_note(note);
+
+		LOG4CXX_INFO(logger, "GEN captures " << session_cnt << " sessions, seed " << seed.to_hex());
+	GEN_END
+
+	EVL_BEGIN
+		if (!Env::replay_file())
+		{
+			LOG4CXX_FATAL(logger, "only the generator captures");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+
+		note = EVL_RECV();
+
+		if (note.size() != HELLO_LEN + Env::key_size_in_bytes() || note[0] != Env::privacy_free() ||
+			get_u32(note, 1) != m_gen_inp_cnt || get_u32(note, 5) != m_evl_inp_cnt)
+		{
+			LOG4CXX_FATAL(logger, "the capture is of another circuit, mode or security parameter");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+
+		session_cnt = get_u32(note, 9);
+		seed.assign(note.begin()+HELLO_LEN, note.end());
+
+		LOG4CXX_INFO(logger, "EVL replays " << session_cnt << " sessions, generator seed " << seed.to_hex());
+	EVL_END
+
+	return session_cnt;
+}
+
+void Yao::oblivious_transfer()
+{
+	step_init();
+
+	if (Env::replay_file())
+	{
+		ot_replay();
+	}
+	else if (Env::ot_store())
+	{
+		ot_derandomize();
+	}
+	else if (Env::gc_store()) // R is the stored circuit's, see circuit_replay()
+	{
+		ot_extend(m_evl_inp, m_evl_inp_cnt, false);
+	}
+	else if (ot_overlap() && !Env::capture_file()) // a capture has the keys noted right after the OTs
+	{
+		// the circuit goes ahead while the OTs finish next to it, up to the
+		// first input gate of the evaluator, see circuit_evaluate()
+		ot_extend_begin(m_evl_inp, m_evl_inp_cnt, true);
+
+		m_ot_running = pthread_create(&m_ot_thread, 0, ot_extend_thread, this) == 0;
+		if (!m_ot_running)
+		{
+			ot_extend_end();
+			ot_extend_report();
+		}
+	}
+	else
+	{
+		ot_extend(m_evl_inp, m_evl_inp_cnt, true);
+	}
+
+	GEN_BEGIN // R and the zero-keys of the evaluator's inputs, see ot_replay()
+		if (Env::capture_file())
+		{
+			Bytes note = m_ot_delta;
+			for (size_t ix = 0; ix < m_ot_keys[0].size(); ix++)
+				note += m_ot_keys[0][ix];
+
+			static_cast<CaptureSocket*>(m_remote)->write_note(note);
+		}
+	GEN_END
+
+	step_report("ob-transfer");
+}
+
+// The OTs of a captured session: the generator's query has no one to answer
+// it, and the keys are the zero-keys noted after it, with R added for the
+// 1-bits, so that a capture replays on any input of the evaluator.
+void Yao::ot_replay()
+{
+	double start;
+
+	Bytes query, note;
+	vector<Bytes> note_chunks;
+
+	start = MPI_Wtime();
+		query = EVL_RECV();
+		note = EVL_RECV();
+	m_timer_com += MPI_Wtime() - start;
+
+	m_comm_sz += query.size(); // the note never was on the wire
+
+	if (note.size() != Env::key_size_in_bytes()*(m_evl_inp_cnt+1))
+	{
+		LOG4CXX_FATAL(logger, "the capture has no keys for the evaluator's inputs");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	start = MPI_Wtime();
+		note_chunks = note.split(Env::key_size_in_bytes());
+
+		m_ot_keys.resize(1);
+		m_ot_keys[0].resize(m_evl_inp_cnt);
+
+		for (size_t ix = 0; ix < m_evl_inp_cnt; ix++)
+			m_ot_keys[0][ix] = m_evl_inp.get_ith_bit(ix)? note_chunks[ix+1] ^ note_chunks[0] : note_chunks[ix+1];
+
+		m_ot_cot = true;
+	m_timer_evl += MPI_Wtime() - start;
+}
+
+// m_ot_keys[0] gets the keys of n OTs, on the evaluator's choice bits in bits;
+// with cot, those of correlated OTs whose correlation m_ot_delta is to be R
+void Yao::ot_extend(const Bytes &bits, size_t n, bool cot)
+{
+	ot_extend_begin(bits, n, cot);
+	ot_extend_end();
+	ot_extend_report();
+}
+
+// The k base OTs run backwards, the generator choosing with its IKNP secret,
+// and are extended to the n OTs the evaluator needs. The generator knows
+// m_ot_delta once this has returned, the keys only after ot_extend_end(),
+// which leaves bits alone until then.
+void Yao::ot_extend_begin(const Bytes &bits, size_t n, bool cot)
+{
+	double start; // time marker
+
+	Bytes send;
+
+	m_ot_bits = &bits;
+	m_ot_n = n;
+	m_ot_cot = cot;
+
+	m_ot_timer_cmp = m_ot_timer_com = 0;
+	m_ot_comm_sz = 0;
+
+	m_ot_keys.resize(1);
+	m_ot_keys[0].clear();
+
+	// Step 1: the generator makes the CRS g[0], h[0], g[1], h[1] and sends
+	// it along with gr=g[b]^r, hr=h[b]^r for every bit b of its secret
+	GEN_BEGIN
+		start = MPI_Wtime();
+			ThreadPool pool(Env::thread_cnt());
+
+			if (!m_ot_crs_ready)
+			{
+				if (!m_ot_crs_made)
+					ot_crs(m_ot_g, m_ot_h);
+
+				fixed_base(m_ot_g, 2, pool);
+				fixed_base(m_ot_h, 2, pool);
+
+				send += m_ot_g[0].to_bytes();
+				send += m_ot_g[1].to_bytes();
+				send += m_ot_h[0].to_bytes();
+				send += m_ot_h[1].to_bytes();
+			}
+
+			m_ot_s = m_prng.rand(Env::k());
+			if (cot) m_ot_s.set_ith_bit(0, 1); // as R needs, at the cost of one bit of s
+			m_ot_delta = cot? m_ot_s : Bytes();
+
+			send += ot_query(m_ot_g, m_ot_h, m_ot_s, Env::k(), m_ot_rs, m_prng, pool);
+		m_timer_gen += MPI_Wtime() - start;
+
+		start = MPI_Wtime();
+			GEN_SEND(send);
+		m_timer_com += MPI_Wtime() - start;
+
+		m_comm_sz += send.size();
+	GEN_END
+
+	EVL_BEGIN
+		start = MPI_Wtime();
+			m_ot_query = EVL_RECV(); // receive the CRS and the (gr, hr)'s
+		m_timer_com += MPI_Wtime() - start;
+
+		m_comm_sz += m_ot_query.size();
+
+		m_ot_prng.srand(m_prng.rand(Env::k())); // ot_extend_end() may run next to m_prng's users
+	EVL_END
+}
+
+// the rest of the OTs, with timings of its own so that it can run on
+// m_ot_thread; ot_extend_report() adds them to the current step
+void Yao::ot_extend_end()
+{
+	double start; // time marker
+
+	Bytes send, recv;
+	std::vector<Bytes> recv_chunks, base_keys;
+
+	const size_t k = Env::k(), n = m_ot_n, ot_sz = Env::elm_size_in_bytes()*4*k;
+
+	// the CRS goes over the wire in the first session only
+	const size_t crs_sz = m_ot_crs_ready? 0 : Env::elm_size_in_bytes()*4;
+
+	ThreadPool pool(Env::thread_cnt());
+
+	// Step 2: the evaluator computes X[0], Y[0], X[1], Y[1] for every base
+	// OT, expands their keys K[0], K[1] and sends it all in one message
+	EVL_BEGIN
+		start = MPI_Wtime();
+			if (!m_ot_crs_ready)
+			{
+				recv_chunks = Bytes(m_ot_query.begin(), m_ot_query.begin()+crs_sz).split(Env::elm_size_in_bytes());
+
+				m_ot_g[0].from_bytes(recv_chunks[0]);
+				m_ot_g[1].from_bytes(recv_chunks[1]);
+				m_ot_h[0].from_bytes(recv_chunks[2]);
+				m_ot_h[1].from_bytes(recv_chunks[3]);
+
+				fixed_base(m_ot_g, 2, pool);
+				fixed_base(m_ot_h, 2, pool);
+			}
+
+			send = ot_reply(m_ot_g, m_ot_h, Bytes(m_ot_query.begin()+crs_sz, m_ot_query.end()), k, base_keys, m_ot_prng, pool);
+
+			m_ot_keys[0].reserve(n);
+			send += m_ot_cot? cot_ext_recv(base_keys, *m_ot_bits, n, m_ot_keys[0]) : ot_ext_recv(base_keys, *m_ot_bits, n, m_ot_keys[0]);
+		m_ot_timer_cmp += MPI_Wtime() - start;
+
+		start = MPI_Wtime();
+			EVL_SEND(send);
+		m_ot_timer_com += MPI_Wtime() - start;
+
+		m_ot_comm_sz += send.size();
+
+		assert(m_ot_keys[0].size() == n);
+	EVL_END
+
+	// Step 3: the generator computes K = Y[b]/X[b]^r for every base OT
+	// and extends them to the key pairs of the evaluator's inputs
+	GEN_BEGIN
+		start = MPI_Wtime();
+			recv = GEN_RECV(); // receive the X[0], X[1], Y[0], Y[1]'s and the extension
+		m_ot_timer_com += MPI_Wtime() - start;
+
+		m_ot_comm_sz += recv.size();
+
+		start = MPI_Wtime();
+			ot_keys(m_ot_s, m_ot_rs, Bytes(recv.begin(), recv.begin()+ot_sz), k, base_keys, pool);
+
+			if (m_ot_cot)
+			{
+				m_ot_keys[0].reserve(n);
+				cot_ext_send(base_keys, m_ot_s, Bytes(recv.begin()+ot_sz, recv.end()), n, m_ot_keys[0]);
+			}
+			else
+			{
+				m_ot_keys[0].reserve(n*2);
+				ot_ext_send(base_keys, m_ot_s, Bytes(recv.begin()+ot_sz, recv.end()), n, m_ot_keys[0]);
+			}
+		m_ot_timer_cmp += MPI_Wtime() - start;
+
+		assert(m_ot_keys[0].size() == (m_ot_cot? n : n*2));
+	GEN_END
+
+	m_ot_crs_ready = true;
+}
+
+void *Yao::ot_extend_thread(void *self)
+{
+	reinterpret_cast<Yao*>(self)->ot_extend_end();
+	return 0;
+}
+
+void Yao::ot_extend_report()
+{
+	GEN_BEGIN
+		m_timer_gen += m_ot_timer_cmp;
+	GEN_END
+
+	EVL_BEGIN
+		m_timer_evl += m_ot_timer_cmp;
+	EVL_END
+
+	m_timer_com += m_ot_timer_com;
+	m_comm_sz += m_ot_comm_sz;
+}
+
+// The random OTs of every session, on random choice bits, made before the
+// inputs are known and kept in Env::ot_store() for ot_derandomize()
+void Yao::ot_precompute()
+{
+	step_init();
+
+	double start;
+
+	const size_t n = m_evl_inp_cnt*Env::session_cnt();
+
+	if (!Env::ot_store())
+	{
+		LOG4CXX_FATAL(logger, "BETTERYAO_OTS has to name the directory for the random OTs");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	ot_store_t store;
+	store.path = ot_store_path(Env::ot_store(), Env::world_rank());
+	store.copies = 1;
+	store.cnt = n;
+	store.used = 0;
+
+	EVL_BEGIN
+		store.choices = m_prng.rand(n);
+	EVL_END
+
+	ot_extend(store.choices, n, false);
+	store.keys.swap(m_ot_keys[0]);
+
+	// the generator names the batch so that the two stores can be matched up
+	GEN_BEGIN
+		store.id = m_prng.rand(128);
+
+		start = MPI_Wtime();
+			GEN_SEND(store.id);
+		m_timer_com += MPI_Wtime() - start;
+	GEN_END
+
+	EVL_BEGIN
+		start = MPI_Wtime();
+			store.id = EVL_RECV();
+		m_timer_com += MPI_Wtime() - start;
+	EVL_END
+
+	m_comm_sz += store.id.size();
+
+	if (!ot_store_save(store))
+	{
+		LOG4CXX_FATAL(logger, "can't write the random OTs to " << store.path);
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	step_report("ot-precomp");
+}
+
+// one message d = x ^ c from the evaluator turns the next m_evl_inp_cnt
+// random OTs into OTs on its inputs x
+void Yao::ot_derandomize()
+{
+	double start;
+
+	Bytes msg;
+
+	if (m_ot_store.path.empty() && !ot_store_load(m_ot_store, ot_store_path(Env::ot_store(), Env::world_rank())))
+	{
+		LOG4CXX_FATAL(logger, "no random OTs in " << Env::ot_store() << ", run mode 4 first");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	m_ot_cot = false;
+
+	EVL_BEGIN
+		start = MPI_Wtime();
+			if (!ot_store_recv(m_ot_store, m_evl_inp, m_evl_inp_cnt, m_ot_keys, msg))
+			{
+				LOG4CXX_FATAL(logger, "out of random OTs in " << m_ot_store.path);
+				MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+			}
+		m_timer_evl += MPI_Wtime() - start;
+
+		start = MPI_Wtime();
+			EVL_SEND(msg);
+		m_timer_com += MPI_Wtime() - start;
+	EVL_END
+
+	GEN_BEGIN
+		start = MPI_Wtime();
+			msg = GEN_RECV();
+		m_timer_com += MPI_Wtime() - start;
+
+		start = MPI_Wtime();
+			if (!ot_store_send(m_ot_store, msg, m_evl_inp_cnt, m_ot_keys))
+			{
+				LOG4CXX_FATAL(logger, "the random OTs in " << m_ot_store.path << " are out or out of step with the evaluator's");
+				MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+			}
+		m_timer_gen += MPI_Wtime() - start;
+	GEN_END
+
+	m_comm_sz += msg.size();
+}
+
+void Yao::circuit_evaluate()
+{
+	step_init();
+
+	double start;
+
+	Bytes bufr;
+	vector<Bytes> bufr_chunks;
+
+	G M;
+
+	GEN_BEGIN
+		start = MPI_Wtime();
+			m_rnds[0] = m_prng.rand(Env::k());
+			m_gen_inp_masks[0] = m_prng.rand(m_gen_inp_cnt);
+		m_timer_gen += MPI_Wtime() - start;
+
+		start = MPI_Wtime();
+			GEN_SEND(m_gen_inp_masks[0] ^ m_gen_inp); // send the masked gen_inp
+		m_timer_com += MPI_Wtime() - start;
+
+		start = MPI_Wtime();
+			gen_init(m_gcs[0], m_ot_keys[0], m_gen_inp_masks[0], m_rnds[0], m_ot_delta, Env::privacy_free());
+			m_gcs[0].m_gen_inp = m_gen_inp;
+		m_timer_gen += MPI_Wtime() - start;
+
+		if (!m_ot_cot) // random OTs, to be correlated with R
+		{
+			start = MPI_Wtime();
+				bufr = gen_cot_fix(m_gcs[0], m_ot_keys[0]);
+			m_timer_gen += MPI_Wtime() - start;
+
+			start = MPI_Wtime();
+				GEN_SEND(bufr);
+			m_timer_com += MPI_Wtime() - start;
+
+			m_comm_sz += bufr.size();
+		}
+	GEN_END
+
+	EVL_BEGIN
+		start = MPI_Wtime();
+			m_gen_inp_masks[0] = EVL_RECV(); // receive the masked gen_inp
+		m_timer_com += MPI_Wtime() - start;
+
+		start = MPI_Wtime();
+			evl_init(m_gcs[0], m_ot_keys[0], m_gen_inp_masks[0], m_evl_inp, Env::privacy_free());
+		m_timer_evl += MPI_Wtime() - start;
+
+		if (!m_ot_cot)
+		{
+			start = MPI_Wtime();
+				bufr = EVL_RECV();
+			m_timer_com += MPI_Wtime() - start;
+
+			m_comm_sz += bufr.size();
+
+			start = MPI_Wtime();
+				evl_cot_fix(m_gcs[0], bufr, m_ot_keys[0]);
+			m_timer_evl += MPI_Wtime() - start;
+		}
+	EVL_END
+
+	m_comm_sz += m_gen_inp_masks[0].size();
+
+	if (m_ot_running) m_gcs[0].m_ot_thread = &m_ot_thread; // see oblivious_transfer()
+
+	GEN_BEGIN
+		for (size_t ix = 0; ix < 2; ix++)
+		{
+			start = MPI_Wtime();
+				bufr = get_const_key(m_gcs[0], ix, ix);
+			m_timer_gen += MPI_Wtime() - start;
+
+			start = MPI_Wtime();
+				GEN_SEND(bufr);	
+			m_timer_com += MPI_Wtime() - start;
+		
+			m_comm_sz += bufr.size();
+		}
+	GEN_END
+
+	EVL_BEGIN
+		for (size_t ix = 0; ix < 2; ix++)
+		{
+			start = MPI_Wtime();
+				bufr = EVL_RECV();	
+			m_timer_com += MPI_Wtime() - start;
+		
+			start = MPI_Wtime();
+				set_const_key(m_gcs[0], ix, bufr);
+			m_timer_gen += MPI_Wtime() - start;
+
+			m_comm_sz += bufr.size();
+		}
+	EVL_END
+
+	ThreadPool *pool = pcf_init();
+
+	step_report("pre-cir-evl");
+	step_init();
+
+	GEN_BEGIN // generate a segment of gates at a time, and send them a frame at a time
+		m_gcs[0].m_o_flush = frame_flush;
+		m_gcs[0].m_o_flush_arg = this;
+
+		if (pool)
+		{
+			set_callback(m_gcs[0].m_st, gen_defer_gate);
+			start = MPI_Wtime();
+				for (bool more = true; more; )
+				{
+					more = get_next_gate(m_gcs[0].m_st);
+					if (more && !defer_full(m_gcs[0]))
+						continue;
+
+					gen_flush(m_gcs[0]);
+					for (size_t ix = 0; defer_frame(m_gcs[0], ix, Env::frame_size()); )
+					{
+						m_timer_gen += MPI_Wtime() - start;
+						send_frame();
+						start = MPI_Wtime();
+					}
+
+					if (more) defer_compact(m_gcs[0]);
+				}
+			m_timer_gen += MPI_Wtime() - start;
+		}
+		else
+		{
+			set_callback(m_gcs[0].m_st, gen_next_gate);
+			start = MPI_Wtime();
+				while (get_next_gate(m_gcs[0].m_st))
+				{
+					if (!frame_full(m_gcs[0], Env::frame_size()))
+						continue;
+
+					m_timer_gen += MPI_Wtime() - start;
+					send_frame();
+					start = MPI_Wtime(); // start m_timer_gen
+				}
+			m_timer_gen += MPI_Wtime() - start;
+		}
+
+		if (!m_gcs[0].m_o_bufr.empty()) send_frame(); // the outputs are out before proc_evl_out()
+
+		GEN_SEND(Bytes(0)); // the end of the circuit
+	GEN_END
+
+	EVL_BEGIN // receive the circuit a frame at a time and evaluate a segment at a time
+		set_callback(m_gcs[0].m_st, pool? evl_defer_gate : evl_next_gate);
+		start = MPI_Wtime();
+			for (bool more = true; more; )
+			{
+				m_timer_evl += MPI_Wtime() - start;
+
+				start = MPI_Wtime();
+					EVL_RECV_INTO(m_frame);
+				m_timer_com += MPI_Wtime() - start;
+
+				m_comm_sz += m_frame.size();
+
+				start = MPI_Wtime();
+					recv(m_gcs[0], m_frame);
+
+					// the gates of the frame, or all the rest after the empty one
+					const bool last = m_gcs[0].m_i_bufr.empty();
+					while ((last || frame_left(m_gcs[0])) && (more = get_next_gate(m_gcs[0].m_st)))
+					{
+						if (pool && defer_full(m_gcs[0]))
+						{
+							evl_flush(m_gcs[0]);
+							defer_compact(m_gcs[0]);
+						}
+					}
+			}
+			if (pool) evl_flush(m_gcs[0]);
+		m_timer_evl += MPI_Wtime() - start;
+	EVL_END
+
+	delete pool;
+
+	if (m_program) // a copy, see pcf_init()
+		free_pcf_state(m_gcs[0].m_st);
+
+	if (m_ot_running) // also when no input of the evaluator has waited for it
+	{
+		ot_wait(m_gcs[0]);
+		ot_extend_report();
+		m_ot_running = false;
+	}
+
+	step_report("circuit-evl");
+
+	trim_output(m_gcs[0]);
 
-	m_evl_inp.resize((m_evl_inp_cnt+7)/8);
-	m_evl_inp.back() &= MASK[m_evl_inp_cnt%8];
+	if (m_gcs[0].m_evl_out_ix != 0)
+		proc_evl_out();
 
-	m_gen_inp.resize((m_gen_inp_cnt+7)/8);
-	m_gen_inp.back() &= MASK[m_gen_inp_cnt%8];
+	if (m_gcs[0].m_gen_out_ix != 0)
+		proc_gen_out();
 }
 
 
-void Yao::start()
+// the frame of gates m_gcs[0] has built up on the generator's side
+void Yao::send_frame()
 {
-	oblivious_transfer();
-	circuit_evaluate();
-	final_report();
+	double start = MPI_Wtime();
+		send(m_gcs[0], m_frame);
+		GEN_SEND(m_frame);
+	m_timer_com += MPI_Wtime() - start;
+
+	m_comm_sz += m_frame.size();
 }
 
-void Yao::oblivious_transfer()
+// m_o_flush of m_gcs[0], see gen_inp_b()
+void Yao::frame_flush(void *self)
 {
-	step_init();
+	reinterpret_cast<Yao*>(self)->send_frame();
+}
 
-	double start; // time marker
+// Circuits garbled before the inputs are known, one for each of the
+// Env::session_cnt() runs to come. The generator keeps the seed and the
+// input zero-keys of each in Env::gc_store(), the evaluator its gates.
+void Yao::gc_precompute()
+{
+	step_init();
 
-	Bytes send, recv, bufr(Env::elm_size_in_bytes()*4);
-	std::vector<Bytes> bufr_chunks, recv_chunks;
+	double start;
 
-	G X[2], Y[2], gr, hr;
-	Z s[2], t[2],  y,  a,  r;
+	Bytes bufr;
+	uint64_t first, seq;
 
-	// step 1: generating the CRS: g[0], h[0], g[1], h[1]
-	if (Env::is_root())
+	if (!Env::gc_store())
 	{
-		EVL_BEGIN
-			start = MPI_Wtime();
-				y.random();
-				a.random();
-
-				m_ot_g[0].random();
-				m_ot_g[1] = m_ot_g[0]^y;          // g[1] = g[0]^y
-
-				m_ot_h[0] = m_ot_g[0]^a;          // h[0] = g[0]^a
-				m_ot_h[1] = m_ot_g[1]^(a + Z(1)); // h[1] = g[1]^(a+1)
+		LOG4CXX_FATAL(logger, "BETTERYAO_GCS has to name the directory for the garbled circuits");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
 
-				bufr.clear();
-				bufr += m_ot_g[0].to_bytes();
-				bufr += m_ot_g[1].to_bytes();
-				bufr += m_ot_h[0].to_bytes();
-				bufr += m_ot_h[1].to_bytes();
-			m_timer_evl += MPI_Wtime() - start;
+	gc_store_seqs(Env::gc_store(), Env::world_rank(), first, seq); // after the ones there
 
-			start = MPI_Wtime(); // send to Gen's root process
-				EVL_SEND(bufr);
-			m_timer_com += MPI_Wtime() - start;
-		EVL_END
+	for (int ix = 0; ix < Env::session_cnt(); ix++, seq++)
+	{
+		gc_store_t store;
+		store.path = gc_store_path(Env::gc_store(), Env::world_rank(), seq);
+		store.privacy_free = Env::privacy_free();
+		store.gen_inp_cnt = m_gen_inp_cnt;
+		store.evl_inp_cnt = m_evl_inp_cnt;
+		store.gen_out_cnt = store.evl_out_cnt = 0;
 
 		GEN_BEGIN
 			start = MPI_Wtime();
-				bufr = GEN_RECV();
-			m_timer_com += MPI_Wtime() - start;
-		GEN_END
+				store.id = m_prng.rand(128);
+				store.seed = m_prng.rand(Env::k());
 
-		m_comm_sz += bufr.size();
-	}
+				// zero-keys for every input, with the lsb cleared when privacy-free
+				store.gen_keys.resize(m_gen_inp_cnt);
+				store.evl_keys.resize(m_evl_inp_cnt);
+				for (size_t jx = 0; jx < m_gen_inp_cnt + m_evl_inp_cnt; jx++)
+				{
+					Bytes &key = jx < m_gen_inp_cnt? store.gen_keys[jx] : store.evl_keys[jx-m_gen_inp_cnt];
+					key = m_prng.rand(Env::k());
+					if (Env::privacy_free()) key.set_ith_bit(0, 0);
+				}
 
-	// send g[0], g[1], h[0], h[1] to slave processes
-	start = MPI_Wtime();
-		MPI_Bcast(&bufr[0], bufr.size(), MPI_BYTE, 0, m_mpi_comm);
-	m_timer_mpi += MPI_Wtime() - start;
+				gen_init(m_gcs[0], store.evl_keys, Bytes(), store.seed, Bytes(), Env::privacy_free());
+				m_gcs[0].m_gen_inp_keys = &store.gen_keys;
 
-	start = MPI_Wtime();
-		bufr_chunks = bufr.split(Env::elm_size_in_bytes());
+				// the messages of circuit_evaluate(), from the constant keys on
+				for (size_t jx = 0; jx < 2; jx++)
+					gc_store_push(store, get_const_key(m_gcs[0], jx, jx));
 
-		m_ot_g[0].from_bytes(bufr_chunks[0]);
-		m_ot_g[1].from_bytes(bufr_chunks[1]);
-		m_ot_h[0].from_bytes(bufr_chunks[2]);
-		m_ot_h[1].from_bytes(bufr_chunks[3]);
+				ThreadPool *pool = pcf_init();
 
-		// pre-processing
-		m_ot_g[0].fast_exp();
-		m_ot_g[1].fast_exp();
-		m_ot_h[0].fast_exp();
-		m_ot_h[1].fast_exp();
+				if (pool)
+				{
+					set_callback(m_gcs[0].m_st, gen_defer_gate);
+					for (bool more = true; more; )
+					{
+						more = get_next_gate(m_gcs[0].m_st);
+						if (more && !defer_full(m_gcs[0]))
+							continue;
+
+						gen_flush(m_gcs[0]);
+						for (size_t jx = 0; defer_frame(m_gcs[0], jx, Env::frame_size()); )
+						{
+							send(m_gcs[0], bufr);
+							gc_store_push(store, bufr);
+						}
+
+						if (more) defer_compact(m_gcs[0]);
+					}
+				}
+				else
+				{
+					set_callback(m_gcs[0].m_st, gen_next_gate);
+					while (get_next_gate(m_gcs[0].m_st))
+						if (frame_full(m_gcs[0], Env::frame_size()))
+					{
+						send(m_gcs[0], bufr);
+						gc_store_push(store, bufr);
+					}
+				}
 
-		// allocate memory for m_keys
-		//m_ot_keys.resize(Env::node_load());
-		m_ot_keys.resize(1);
-		//for (size_t ix = 0; ix < m_ot_keys.size(); ix++)
-		//{
-		//	m_ot_keys[ix].reserve(Env::circuit().evl_inp_cnt()*2);
-		//}
-		m_ot_keys[0].reserve(m_evl_inp_cnt*2);
-	m_timer_evl += MPI_Wtime() - start;
-	m_timer_gen += MPI_Wtime() - start;
+				send(m_gcs[0], bufr);
+				if (!bufr.empty()) gc_store_push(store, bufr);
+				gc_store_push(store, Bytes(0));
 
-	// Step 2: ZKPoK of (g[0], g[1], h[0], h[1])
-	// TODO
+				delete pool;
 
-	// Step 3: gr=g[b]^r, hr=h[b]^r, where b is the evaluator's bit
-	if (Env::is_root())
-	{
-		EVL_BEGIN
+				store.gen_out_cnt = m_gcs[0].m_gen_out_ix;
+				store.evl_out_cnt = m_gcs[0].m_evl_out_ix;
+			m_timer_gen += MPI_Wtime() - start;
+
+			// the evaluator's copy, GC_CHUNK bytes at a time up to an empty message
 			start = MPI_Wtime();
-				//bufr.clear(); bufr.reserve(Env::exp_size_in_bytes()*Env::circuit().evl_inp_cnt());
-				bufr.clear();
-				bufr.reserve(Env::exp_size_in_bytes()*m_evl_inp_cnt);
-				//send.clear(); send.reserve(Env::elm_size_in_bytes()*Env::circuit().evl_inp_cnt()*2);
-				send.clear();
-				send.reserve(Env::elm_size_in_bytes()*m_evl_inp_cnt*2);
-				//for (size_t bix = 0; bix < Env::circuit().evl_inp_cnt(); bix++)
-				for (size_t bix = 0; bix < m_evl_inp_cnt; bix++)
+				GEN_SEND(store.id);
+				for (size_t ofs = 0; ofs < store.msgs.size(); ofs += GC_CHUNK)
 				{
-					r.random();
-					bufr += r.to_bytes();  // to be shared with slave evaluators
-
-					byte bit_value = m_evl_inp.get_ith_bit(bix);
-					send += (m_ot_g[bit_value]^r).to_bytes(); // gr
-					send += (m_ot_h[bit_value]^r).to_bytes(); // hr
+					Bytes::const_iterator it = store.msgs.begin() + ofs;
+					GEN_SEND(Bytes(it, it + std::min(GC_CHUNK, store.msgs.size()-ofs)));
 				}
-			m_timer_evl += MPI_Wtime() - start;
-
-			start = MPI_Wtime();
-				EVL_SEND(send); // send (gr, hr)'s
+				GEN_SEND(Bytes(0));
 			m_timer_com += MPI_Wtime() - start;
 
-			m_comm_sz += send.size();
-		EVL_END
+			m_comm_sz += store.id.size() + store.msgs.size();
+			store.msgs.clear();
+		GEN_END
 
-		GEN_BEGIN
+		EVL_BEGIN
 			start = MPI_Wtime();
-				bufr = GEN_RECV(); // receive (gr, hr)'s
+				store.id = EVL_RECV();
+				for (bufr = EVL_RECV(); !bufr.empty(); bufr = EVL_RECV())
+					store.msgs += bufr;
 			m_timer_com += MPI_Wtime() - start;
 
-			m_comm_sz += bufr.size();
-		GEN_END
+			m_comm_sz += store.id.size() + store.msgs.size();
+		EVL_END
+
+		if (!gc_store_save(store))
+		{
+			LOG4CXX_FATAL(logger, "can't write the garbled circuit to " << store.path);
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
 	}
 
-	EVL_BEGIN // forward rs to slave evaluators
-		start = MPI_Wtime();
-			//bufr.resize(Env::exp_size_in_bytes()*Env::circuit().evl_inp_cnt());
-			bufr.resize(Env::exp_size_in_bytes()*m_evl_inp_cnt);
-		m_timer_evl += MPI_Wtime() - start;
+	step_report("gc-precomp");
+}
 
-		start = MPI_Wtime();
-			MPI_Bcast(&bufr[0], bufr.size(), MPI_BYTE, 0, m_mpi_comm); // now every evaluator has r's
-		m_timer_mpi += MPI_Wtime() - start;
+// circuit_evaluate() with the oldest circuit of Env::gc_store(): only the
+// keys of the inputs go over the wire, and the evaluator reads the gates
+// from its copy of the circuit
+void Yao::circuit_replay()
+{
+	step_init();
 
-		start = MPI_Wtime();
-			bufr_chunks = bufr.split(Env::exp_size_in_bytes());
+	double start;
+
+	Bytes bufr;
+	vector<Bytes> inp_keys;
+	gc_store_t store;
+	uint64_t seq, next;
+	size_t ofs = 0;
+
+	const size_t key_len = Env::key_size_in_bytes();
+
+	ThreadPool *pool = 0;
+
+	start = MPI_Wtime();
+		bool ok = gc_store_seqs(Env::gc_store(), Env::world_rank(), seq, next);
+		ok = ok && gc_store_load(store, gc_store_path(Env::gc_store(), Env::world_rank(), seq));
+
+		if (!ok)
+		{
+			LOG4CXX_FATAL(logger, "no garbled circuit in " << Env::gc_store() << ", run mode 6 or 7 first");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+
+		if (store.privacy_free != Env::privacy_free() || store.gen_inp_cnt != m_gen_inp_cnt || store.evl_inp_cnt != m_evl_inp_cnt)
+		{
+			LOG4CXX_FATAL(logger, "the garbled circuit in " << store.path << " is for another circuit or mode");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+
+		// never evaluated twice, with keys of other inputs
+		if (!gc_store_drop(store))
+		{
+			LOG4CXX_FATAL(logger, "can't remove " << store.path);
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+	GEN_BEGIN
+		m_timer_gen += MPI_Wtime() - start;
+	GEN_END
+	EVL_BEGIN
 		m_timer_evl += MPI_Wtime() - start;
 	EVL_END
 
-	GEN_BEGIN // forward (gr, hr)s to slave generators
+	// the keys of the generator's inputs, the fixes that correlate the OTs
+	// with R, and what turns the OTs' zero-keys into the circuit's
+	GEN_BEGIN
 		start = MPI_Wtime();
-			//bufr.resize(Env::elm_size_in_bytes()*Env::circuit().evl_inp_cnt()*2);
-			bufr.resize(Env::elm_size_in_bytes()*m_evl_inp_cnt*2);
+			gen_init(m_gcs[0], m_ot_keys[0], Bytes(), store.seed, Bytes(), Env::privacy_free());
+			m_gcs[0].m_gen_out_ix = store.gen_out_cnt;
+			m_gcs[0].m_evl_out_ix = store.evl_out_cnt;
+
+			bufr = store.id;
+			bufr += gen_inp_keys(m_gcs[0], store.gen_keys, m_gen_inp);
+			bufr += gen_cot_fix(m_gcs[0], m_ot_keys[0]);
+			for (size_t ix = 0; ix < m_evl_inp_cnt; ix++) bufr += store.evl_keys[ix] ^ m_ot_keys[0][ix];
 		m_timer_gen += MPI_Wtime() - start;
 
 		start = MPI_Wtime();
-			MPI_Bcast(&bufr[0], bufr.size(), MPI_BYTE, 0, m_mpi_comm); // now every Bob has bufr
-		m_timer_mpi += MPI_Wtime() - start;
+			GEN_SEND(bufr);
+		m_timer_com += MPI_Wtime() - start;
 
-		start = MPI_Wtime();
-			bufr_chunks = bufr.split(Env::elm_size_in_bytes());
-		m_timer_gen += MPI_Wtime() - start;
+		m_comm_sz += bufr.size();
 	GEN_END
 
-	// Step 4: the generator computes X[0], Y[0], X[1], Y[1]
-	GEN_BEGIN
-		//for (size_t bix = 0; bix < Env::circuit().evl_inp_cnt(); bix++)
-		for (size_t bix = 0; bix < m_evl_inp_cnt; bix++)
-		{
-			start = MPI_Wtime();
-				gr.from_bytes(bufr_chunks[2*bix+0]);
-				hr.from_bytes(bufr_chunks[2*bix+1]);
+	EVL_BEGIN
+		start = MPI_Wtime();
+			bufr = EVL_RECV();
+		m_timer_com += MPI_Wtime() - start;
 
-				if (m_ot_keys.size() > 2)
-				{
-					gr.fast_exp();
-					hr.fast_exp();
-				}
-			m_timer_gen += MPI_Wtime() - start;
+		m_comm_sz += bufr.size();
 
-			for (size_t cix = 0; cix < m_ot_keys.size(); cix++)
-			{
-				start = MPI_Wtime();
-					Y[0].random(); // K[0]
-					Y[1].random(); // K[1]
+		const size_t id_len = store.id.size();
 
-					m_ot_keys[cix].push_back(Y[0].to_bytes().hash(Env::k()));
-					m_ot_keys[cix].push_back(Y[1].to_bytes().hash(Env::k()));
+		if (bufr.size() != id_len + (m_gen_inp_cnt + 2*m_evl_inp_cnt)*key_len || Bytes(bufr.begin(), bufr.begin()+id_len) != store.id)
+		{
+			LOG4CXX_FATAL(logger, "the garbled circuit in " << store.path << " is out of step with the generator's");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
 
-					s[0].random(); s[1].random();
-					t[0].random(); t[1].random();
+		start = MPI_Wtime();
+			Bytes::const_iterator it = bufr.begin() + id_len;
 
-					// X[b] = ( g[b]^s[b] ) * ( h[b]^t[b] ), where b = 0, 1
-					X[0] = m_ot_g[0]^s[0]; X[0] *= m_ot_h[0]^t[0];
-					X[1] = m_ot_g[1]^s[1]; X[1] *= m_ot_h[1]^t[1];
+			inp_keys = Bytes(it, it + m_gen_inp_cnt*key_len).split(key_len);
+			it += m_gen_inp_cnt*key_len;
 
-					// Y[b] = ( gr^s[b] ) * ( hr^t[b] ) * K[b], where b = 0, 1
-					Y[0] *= gr^s[0]; Y[0] *= hr^t[0];
-					Y[1] *= gr^s[1]; Y[1] *= hr^t[1];
+			evl_init(m_gcs[0], m_ot_keys[0], Bytes(), m_evl_inp, Env::privacy_free());
+			m_gcs[0].m_gen_inp_keys = &inp_keys;
 
-					send.clear();
-					send += X[0].to_bytes(); send += X[1].to_bytes();
-					send += Y[0].to_bytes(); send += Y[1].to_bytes();
-				m_timer_gen += MPI_Wtime() - start;
+			evl_cot_fix(m_gcs[0], Bytes(it, it + m_evl_inp_cnt*key_len), m_ot_keys[0]);
+			it += m_evl_inp_cnt*key_len;
 
-				start = MPI_Wtime();
-					GEN_SEND(send);
-				m_timer_com += MPI_Wtime() - start;
+			for (size_t ix = 0; ix < m_evl_inp_cnt; ix++, it += key_len)
+				m_ot_keys[0][ix] ^= Bytes(it, it + key_len);
 
-				m_comm_sz += send.size();
-			}
-		}
+			for (size_t ix = 0; ix < 2; ix++)
+				set_const_key(m_gcs[0], ix, gc_store_pop(store, ofs));
 
-		for (size_t ix = 0; ix < m_ot_keys.size(); ix++)
-		{
-			//assert(m_ot_keys[ix].size() == Env::circuit().evl_inp_cnt()*2);
-			assert(m_ot_keys[ix].size() == m_evl_inp_cnt*2);
-		}
-	GEN_END
+			pool = pcf_init();
+		m_timer_evl += MPI_Wtime() - start;
+	EVL_END
 
-	// Step 5: the evaluator computes K = Y[b]/X[b]^r
-	EVL_BEGIN
-		//for (size_t bix = 0; bix < Env::circuit().evl_inp_cnt(); bix++)
-		for (size_t bix = 0; bix < m_evl_inp_cnt; bix++)
-		{
-			start = MPI_Wtime();
-				int bit_value = m_evl_inp.get_ith_bit(bix);
-				r.from_bytes(bufr_chunks[bix]);
-			m_timer_evl += MPI_Wtime() - start;
+	step_report("pre-cir-evl");
+	step_init();
 
-			for (size_t cix = 0; cix < m_ot_keys.size(); cix++)
+	EVL_BEGIN // as circuit_evaluate() does, with the frames off the store
+		start = MPI_Wtime();
+			set_callback(m_gcs[0].m_st, pool? evl_defer_gate : evl_next_gate);
+			for (bool more = true; more; )
 			{
-				start = MPI_Wtime();
-					recv = EVL_RECV(); // receive X[0], X[1], Y[0], Y[1]
-				m_timer_com += MPI_Wtime() - start;
+				bufr = gc_store_pop(store, ofs);
+				recv(m_gcs[0], bufr);
 
-				m_comm_sz += recv.size();
+				const bool last = m_gcs[0].m_i_bufr.empty();
+				while ((last || frame_left(m_gcs[0])) && (more = get_next_gate(m_gcs[0].m_st)))
+				{
+					if (pool && defer_full(m_gcs[0]))
+					{
+						evl_flush(m_gcs[0]);
+						defer_compact(m_gcs[0]);
+					}
+				}
+			}
+			if (pool) evl_flush(m_gcs[0]);
+		m_timer_evl += MPI_Wtime() - start;
+	EVL_END
 
-				start = MPI_Wtime();
-					recv_chunks = recv.split(Env::elm_size_in_bytes());
+	delete pool;
 
-					X[bit_value].from_bytes(recv_chunks[    bit_value]); // X[b]
-					Y[bit_value].from_bytes(recv_chunks[2 + bit_value]); // Y[b]
+	step_report("circuit-evl");
 
-					// K = Y[b]/(X[b]^r)
-					Y[bit_value] /= X[bit_value]^r;
-					m_ot_keys[cix].push_back(Y[bit_value].to_bytes().hash(Env::k()));
-				m_timer_evl += MPI_Wtime() - start;
-			}
-		}
+	trim_output(m_gcs[0]);
 
-		for (size_t ix = 0; ix < m_ot_keys.size(); ix++)
-		{
-			//assert(m_ot_keys[ix].size() == Env::circuit().evl_inp_cnt());
-			assert(m_ot_keys[ix].size() == m_evl_inp_cnt);
-		}
-	EVL_END
+	if (m_gcs[0].m_evl_out_ix != 0)
+		proc_evl_out();
 
-	step_report("ob-transfer");
+	if (m_gcs[0].m_gen_out_ix != 0)
+		proc_gen_out();
 }
 
-void Yao::circuit_evaluate()
+// Every record of the private file in one session: one OT extension for
+// the evaluator's inputs of them all, then a circuit for each record on the
+// program parsed once, with its outputs logged as soon as they are out.
+// The OTs are plain ones, so that every circuit gets an R of its own.
+void Yao::batch_evaluate()
 {
-	step_init();
-
 	double start;
 
-	Bytes bufr;
-	vector<Bytes> bufr_chunks;
+	Bytes bufr(4), bits;
+	vector<Bytes> keys;
 
-	G M;
+	const size_t rec_cnt = m_inp_recs.size();
+
+	if (Env::ot_store() || Env::gc_store())
+	{
+		LOG4CXX_FATAL(logger, "a batch runs its own OTs and circuits");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	step_init();
 
+	// the records have to pair up one for one
 	GEN_BEGIN
-		start = MPI_Wtime();
-			m_rnds[0] = m_prng.rand(Env::k());
-			m_gen_inp_masks[0] = m_prng.rand(m_gen_inp_cnt);
-		m_timer_gen += MPI_Wtime() - start;
+		put_u32(bufr, 0, rec_cnt);
 
 		start = MPI_Wtime();
-			GEN_SEND(m_gen_inp_masks[0] ^ m_gen_inp); // send the masked gen_inp
+			GEN_SEND(bufr);
 		m_timer_com += MPI_Wtime() - start;
-
-		start = MPI_Wtime();
-			gen_init(m_gcs[0], m_ot_keys[0], m_gen_inp_masks[0], m_rnds[0]);
-			m_gcs[0].m_gen_inp = m_gen_inp;
-		m_timer_gen += MPI_Wtime() - start;
 	GEN_END
 
 	EVL_BEGIN
 		start = MPI_Wtime();
-			m_gen_inp_masks[0] = EVL_RECV(); // receive the masked gen_inp
+			bufr = EVL_RECV();
 		m_timer_com += MPI_Wtime() - start;
 
-		start = MPI_Wtime();
-			evl_init(m_gcs[0], m_ot_keys[0], m_gen_inp_masks[0], m_evl_inp);
-		m_timer_evl += MPI_Wtime() - start;
-	EVL_END
-
-	m_comm_sz += m_gen_inp_masks[0].size();
-
-	GEN_BEGIN
-		for (size_t ix = 0; ix < 2; ix++)
+		if (bufr.size() != 4 || get_u32(bufr, 0) != rec_cnt)
 		{
-			start = MPI_Wtime();
-				bufr = get_const_key(m_gcs[0], ix, ix);
-			m_timer_gen += MPI_Wtime() - start;
-
-			start = MPI_Wtime();
-				GEN_SEND(bufr);	
-			m_timer_com += MPI_Wtime() - start;
-		
-			m_comm_sz += bufr.size();
+			LOG4CXX_FATAL(logger, "the generator has another number of records");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
 		}
-	GEN_END
-
-	EVL_BEGIN
-		for (size_t ix = 0; ix < 2; ix++)
-		{
-			start = MPI_Wtime();
-				bufr = EVL_RECV();	
-			m_timer_com += MPI_Wtime() - start;
-		
-			start = MPI_Wtime();
-				set_const_key(m_gcs[0], ix, bufr);
-			m_timer_gen += MPI_Wtime() - start;
 
-			m_comm_sz += bufr.size();
-		}
+		start = MPI_Wtime();
+			bits.resize((rec_cnt*m_evl_inp_cnt+7)/8);
+			for (size_t ix = 0; ix < rec_cnt; ix++)
+				for (size_t jx = 0; jx < m_evl_inp_cnt; jx++)
+					bits.set_ith_bit(ix*m_evl_inp_cnt+jx, m_inp_recs[ix].get_ith_bit(jx));
+		m_timer_evl += MPI_Wtime() - start;
 	EVL_END
 
-	m_gcs[0].m_st = load_pcf_file(Env::pcf_file(), m_gcs[0].m_const_wire, m_gcs[0].m_const_wire+1, copy_key);
-        m_gcs[0].m_st->alice_in_size = m_gen_inp_cnt;
-        m_gcs[0].m_st->bob_in_size = m_evl_inp_cnt;
+	m_comm_sz += bufr.size();
 
-	set_external_state(m_gcs[0].m_st, &m_gcs[0]);
-	set_key_copy_function(m_gcs[0].m_st, copy_key);
-	set_key_delete_function(m_gcs[0].m_st, delete_key);
-#ifdef USE_THREADS
-        make_internal_thread(m_gcs[0].m_st);
-#endif
+	ot_extend(bits, rec_cnt*m_evl_inp_cnt, false);
 
-	step_report("pre-cir-evl");
-	step_init();
+	step_report("ob-transfer");
 
-	GEN_BEGIN // generate and send the circuit gate-by-gate
-		set_callback(m_gcs[0].m_st, gen_next_gate);
-		start = MPI_Wtime();
-			while (get_next_gate(m_gcs[0].m_st))
-			{
-                          bufr = send(m_gcs[0]);
-                          m_timer_gen += MPI_Wtime() - start;
+	if (!m_program)
+		pcf_parse();
 
-                          start = MPI_Wtime();
-                          //assert(bufr.size() > 0);
-                          GEN_SEND(bufr);
-                          m_timer_com += MPI_Wtime() - start;
+	keys.swap(m_ot_keys[0]);
+	const size_t key_cnt = keys.size()/rec_cnt; // two for each input on the generator's side
 
-                          m_comm_sz += bufr.size();
+	for (size_t ix = 0; ix < rec_cnt; ix++)
+	{
+		m_ot_keys[0].assign(keys.begin()+ix*key_cnt, keys.begin()+(ix+1)*key_cnt);
 
-                          start = MPI_Wtime(); // start m_timer_gen
-			}
-		m_timer_gen += MPI_Wtime() - start;
+		GEN_BEGIN
+			m_gen_inp = m_inp_recs[ix];
+		GEN_END
 
-		GEN_SEND(Bytes(0)); // a redundant value to prevent the evlauator from hanging
-	GEN_END
+		EVL_BEGIN
+			m_evl_inp = m_inp_recs[ix];
+		EVL_END
 
-	EVL_BEGIN // receive and evaluate the circuit gate-by-gate
-		set_callback(m_gcs[0].m_st, evl_next_gate);
-		start = MPI_Wtime();
-			do {
-				m_timer_evl += MPI_Wtime() - start;
+		circuit_evaluate();
 
-				start = MPI_Wtime();
-					bufr = EVL_RECV();
-				m_timer_com += MPI_Wtime() - start;
+		EVL_BEGIN
+			LOG4CXX_INFO(logger, "EVL record " << ix << " output: " << m_evl_out.to_hex());
+		EVL_END
 
-				m_comm_sz += bufr.size();
+		GEN_BEGIN
+			LOG4CXX_INFO(logger, "GEN record " << ix << " output: " << m_gen_out.to_hex());
+		GEN_END
+	}
+}
 
-				start = MPI_Wtime();
-					recv(m_gcs[0], bufr);
-			} while (get_next_gate(m_gcs[0].m_st));
-		m_timer_evl += MPI_Wtime() - start;
-	EVL_END
+// the program that the circuits of serve() and batch_evaluate() copy, each
+// with constant keys of its own, see pcf_init()
+void Yao::pcf_parse()
+{
+	__m128i zero = _mm_setzero_si128();
+	m_program = load_pcf_file(Env::pcf_file(), &zero, &zero, copy_key);
+}
 
+// the PCF interpreter for m_gcs[0], after gen_init()/evl_init() and the
+// constant keys; with more than one thread, the pool the gates are to be
+// garbled/evaluated on, level by level
+ThreadPool *Yao::pcf_init()
+{
+	ThreadPool *pool = 0;
+	__m128i *const_keys = m_gcs[0].m_const_wire;
 
-	step_report("circuit-evl");
+	if (Env::thread_cnt() > 1)
+	{
+		pool = new ThreadPool(Env::thread_cnt());
+		defer_init(m_gcs[0], pool);
+		const_keys = m_gcs[0].m_const_handle;
+	}
 
-	trim_output(m_gcs[0]);
+	if (m_program) // a session of the service or a record of a batch
+	{
+		m_gcs[0].m_st = copy_pcf_state(m_program);
+		set_constant_keys(m_gcs[0].m_st, const_keys, const_keys+1);
+	}
+	else
+	{
+		m_gcs[0].m_st = load_pcf_file(Env::pcf_file(), const_keys, const_keys+1, copy_key);
+	}
+        m_gcs[0].m_st->alice_in_size = m_gen_inp_cnt;
+        m_gcs[0].m_st->bob_in_size = m_evl_inp_cnt;
 
-	if (m_gcs[0].m_evl_out_ix != 0)
-		proc_evl_out();
+	set_external_state(m_gcs[0].m_st, &m_gcs[0]);
+	set_key_copy_function(m_gcs[0].m_st, copy_key);
+	set_key_delete_function(m_gcs[0].m_st, delete_key);
+#ifdef USE_THREADS
+        make_internal_thread(m_gcs[0].m_st);
+#endif
 
-	if (m_gcs[0].m_gen_out_ix != 0)
-		proc_gen_out();
+	return pool;
 }
 
-
 void Yao::proc_evl_out()
 {
 	step_init();
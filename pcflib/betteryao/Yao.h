@@ -3,35 +3,83 @@
 
 #include "YaoBase.h"
 #include "garbled_circuit.h"
+#include "ot_store.h"
+#include "gc_store.h"
 
 class Yao : public YaoBase
 {
 
 public:
 	Yao(EnvParams &params);
+	Yao(const Yao &service, Socket *remote); // a session of serve()
 	virtual ~Yao() { }
 
 	virtual void start();
 
 private:
+	void serve();
+	static void serve_task(void *self, size_t begin, size_t end);
+	void serve_worker();
+	void serve_sessions();
+	uint32_t capture_init();
 	void oblivious_transfer();
+	void ot_replay();
+	void ot_extend(const Bytes &bits, size_t n, bool cot);
+	void ot_extend_begin(const Bytes &bits, size_t n, bool cot);
+	void ot_extend_end();
+	void ot_extend_report();
+	static void *ot_extend_thread(void *self);
+	void ot_precompute();
+	void ot_derandomize();
+	void gc_precompute();
 	void circuit_evaluate();
+	void send_frame();
+	static void frame_flush(void *self);
+	void batch_evaluate();
+	void pcf_parse();
+	void circuit_replay();
+	ThreadPool *pcf_init();
 	void proc_gen_out();
 	void proc_evl_out();
 
-	// variables for SS11 committing OT implementation
+	// variables for the SS11 base OTs, extended with IKNP
 	G                      m_ot_g[2];
 	G                      m_ot_h[2];
 	vector<vector<Bytes> > m_ot_keys; // ot output
+	Bytes                  m_ot_delta; // the correlation of correlated OTs, generator only
+	bool                   m_ot_crs_ready; // from an earlier session
+	bool                   m_ot_crs_made;  // by the service, not sent yet
+	ot_store_t             m_ot_store;     // random OTs made offline
+
+	// the OT extension between ot_extend_begin() and ot_extend_end(), which
+	// may run on m_ot_thread while the circuit goes through the interpreter
+	const Bytes           *m_ot_bits;
+	size_t                 m_ot_n;
+	bool                   m_ot_cot;       // else m_ot_keys are to be correlated in circuit_evaluate()
+	Bytes                  m_ot_s;         // the generator's IKNP secret
+	vector<Z>              m_ot_rs;        // and the exponents of its base OTs
+	Bytes                  m_ot_query;     // the evaluator's first message
+	Prng                   m_ot_prng;
+	double                 m_ot_timer_cmp;
+	double                 m_ot_timer_com;
+	uint64_t               m_ot_comm_sz;
+	pthread_t              m_ot_thread;
+	bool                   m_ot_running;
 
 	// variables for Yao protocol
 	vector<Bytes>          m_gen_inp_masks;
 	vector<Bytes>          m_rnds;
 	//vector<GarbledCct>     m_ccts;
 	vector<garbled_circuit_t> m_gcs;
+	Bytes                  m_frame;        // the gates on the wire, in storage reused frame after frame
 
 	uint32_t               m_gen_inp_cnt;
 	uint32_t               m_evl_inp_cnt;
+
+	// variables for the service, see serve(), and batches
+	PCFState              *m_program;      // parsed once, copied for each circuit
+	pthread_mutex_t        m_serve_mutex;
+	uint64_t               m_serve_cnt;    // sessions run by the load generator
 };
 
 #endif
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <iomanip>
+#include <sstream>
 
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -22,11 +24,12 @@ inline std::string get_IP()
 }
 
 
-YaoBase::YaoBase(EnvParams &params)
+YaoBase::YaoBase(EnvParams &params) : m_cluster(0), m_remote(0), m_session(false)
 {
 	init_cluster(params);
 #if defined EVL_CODE || defined GEN_CODE
 	init_network(params); // no need in simulation mode
+	m_remote = params.remote;
 #endif
 	init_environ(params);
 	init_private(params);
@@ -50,8 +53,25 @@ YaoBase::YaoBase(EnvParams &params)
 	LOG4CXX_INFO(logger, "========================================================");
 }
 
+// The inputs and the communicator are the service's; the connection and
+// everything else the session has are its own.
+YaoBase::YaoBase(const YaoBase &service, Socket *remote) :
+	m_mpi_comm(service.m_mpi_comm), m_cluster(service.m_cluster), m_remote(remote), m_session(true),
+	m_evl_inp(service.m_evl_inp), m_gen_inp(service.m_gen_inp)
+{
+}
+
 void YaoBase::init_cluster(EnvParams &params)
 {
+	m_cluster = params.cluster;
+
+	if (m_cluster != 0) // a thread of run_ranks(), which has set the ranks
+	{
+		params.node_amnt = m_cluster->size;
+		m_mpi_comm = MPI_COMM_WORLD;
+		return;
+	}
+
 	// inquire world info
 	MPI_Comm_rank(MPI_COMM_WORLD, &params.wrld_rank);
 	MPI_Comm_size(MPI_COMM_WORLD, &params.node_amnt);
@@ -86,6 +106,40 @@ void YaoBase::init_network(EnvParams &params)
 	const int PORT = params.port_base + params.node_rank+1;
 	Bytes send, recv;
 
+	if (params.worker_cnt != 0) // the generators connect with each session, see Yao::serve()
+	{
+		if (params.node_amnt != 1)
+		{
+			LOG4CXX_FATAL(logger, "the service runs on one node");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+
+		EVL_BEGIN
+			params.server = new ServerSocket(PORT);
+			LOG4CXX_INFO(logger, "EVL is serving at port " << PORT);
+		EVL_END
+
+		return;
+	}
+
+	if (params.replay_file != 0) // the capture stands in for the generator, see Yao::capture_init()
+	{
+		GEN_BEGIN
+			LOG4CXX_FATAL(logger, "only the evaluator replays a capture");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		GEN_END
+
+		if (params.node_amnt != 1)
+		{
+			LOG4CXX_FATAL(logger, "a capture replays on one node");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+
+		params.remote = new ReplaySocket(params.replay_file);
+		LOG4CXX_INFO(logger, "EVL is replaying " << params.replay_file);
+		return;
+	}
+
 	// get local IP
 	char hostname[1024];
 	gethostname(hostname, 1024);
@@ -98,7 +152,7 @@ void YaoBase::init_network(EnvParams &params)
 		memcpy(&send[0], host->h_addr_list[0], send.size());
 
 		recv.resize(sizeof(struct in_addr)*params.node_amnt); // only used by node 0
-		MPI_Gather(&send[0], send.size(), MPI_BYTE, &recv[0], send.size(), MPI_BYTE, 0, m_mpi_comm);
+		cluster_gather(&send[0], send.size(), &recv[0]);
 
 		if (params.node_rank == 0)
 		{
@@ -124,12 +178,24 @@ void YaoBase::init_network(EnvParams &params)
 		}
 
 		recv.resize(sizeof(struct in_addr));
-		MPI_Scatter(&send[0], recv.size(), MPI_BYTE, &recv[0], recv.size(), MPI_BYTE, 0, m_mpi_comm);
+		cluster_scatter(&send[0], recv.size(), &recv[0]);
 
 		std::string remote_ip = inet_ntoa(*((struct in_addr *)&recv[0]));
 		LOG4CXX_INFO(logger, "GEN (" << params.node_rank << ":" << local_ip << ") is connecting (" <<  remote_ip << ") at port " << PORT);
 		params.remote = new ClientSocket(remote_ip.c_str(), PORT);
 		LOG4CXX_INFO(logger, "GEN (" << params.node_rank << ":" << local_ip << ") succeeded connecting");
+
+		if (params.capture_file != 0)
+		{
+			if (params.node_amnt != 1)
+			{
+				LOG4CXX_FATAL(logger, "a capture is made on one node");
+				MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+			}
+
+			params.remote = new CaptureSocket(params.remote, params.capture_file);
+			LOG4CXX_INFO(logger, "GEN is capturing to " << params.capture_file);
+		}
 	GEN_END
 }
 
@@ -159,6 +225,9 @@ void YaoBase::init_environ(EnvParams &params)
 
 	Env::init(params);
 
+	if (params.worker_cnt != 0) // no one to synchronize with yet, and no use for them
+		return;
+
 	// synchronize claw-free collections
 	ClawFree claw_free;
 	claw_free.init();
@@ -177,7 +246,7 @@ void YaoBase::init_environ(EnvParams &params)
 	}
 
 	// synchronize claw-free collections to the root evaluator's
-	MPI_Bcast(&bufr[0], bufr.size(), MPI_BYTE, 0, m_mpi_comm);
+	cluster_bcast(&bufr[0], bufr.size());
 	Env::claw_free_from_bytes(bufr);
 }
 
@@ -195,16 +264,35 @@ void YaoBase::init_private(EnvParams &params)
 		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
 	}
 
-	EVL_BEGIN // evaluator
-		private_file >> input;          // 1st line is the evaluator's input
-		m_evl_inp.from_hex(input);
+	// a record for every pair of lines, as many as there are
+	for (size_t ix = 0; private_file >> input; ix++)
+	{
+		EVL_BEGIN // evaluator
+			if (ix % 2 != 0) continue;  // 1st line is the evaluator's input
+		EVL_END
+
+		GEN_BEGIN // generator
+			if (ix % 2 != 1) continue;  // 2nd line is the generator's input
+		GEN_END
+
+		m_inp_recs.push_back(Bytes());
+		m_inp_recs.back().from_hex(input);
+	}
+
+	if (m_inp_recs.empty())
+	{
+		LOG4CXX_FATAL(logger, "no input in " << params.private_file);
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	EVL_BEGIN
+		m_evl_inp = m_inp_recs[0];
 		//m_evl_inp.resize((Env::circuit().evl_inp_cnt()+7)/8);
 		//m_evl_inp.back() &= MASK[Env::circuit().evl_inp_cnt()%8];
 	EVL_END
 
-	GEN_BEGIN // generator
-		private_file >> input >> input; // 2nd line is the generator's input
-		m_gen_inp.from_hex(input);
+	GEN_BEGIN
+		m_gen_inp = m_inp_recs[0];
 		//m_gen_inp.resize((Env::circuit().gen_inp_cnt()+7)/8);
 		//m_gen_inp.back() &= MASK[Env::circuit().gen_inp_cnt()%8];
 	GEN_END
@@ -215,6 +303,15 @@ void YaoBase::init_private(EnvParams &params)
 
 YaoBase::~YaoBase()
 {
+	if (m_session)
+	{
+		delete m_remote;
+		return;
+	}
+
+	if (m_cluster != 0) // Env goes after the last rank, see run_ranks()
+		return;
+
 	Env::destroy();
 
 	int res;
@@ -224,16 +321,22 @@ YaoBase::~YaoBase()
 
 
 Bytes YaoBase::recv_data(int src_node)
+{
+	Bytes recv;
+	recv_data(src_node, recv);
+	return recv;
+}
+
+
+void YaoBase::recv_data(int src_node, Bytes &data)
 {
 	MPI_Status status;
 
 	uint32_t comm_sz;
 	MPI_Recv(&comm_sz, 1, MPI_INT, src_node, 0, MPI_COMM_WORLD, &status);
 
-	Bytes recv(comm_sz);
-	MPI_Recv(&recv[0], recv.size(), MPI_BYTE, src_node, 0, MPI_COMM_WORLD, &status);
-
-	return recv;
+	data.resize(comm_sz);
+	MPI_Recv(&data[0], data.size(), MPI_BYTE, src_node, 0, MPI_COMM_WORLD, &status);
 }
 
 
@@ -249,6 +352,154 @@ void YaoBase::send_data(int dst_node, const Bytes &data)
 
 
 
+void YaoBase::cluster_bcast(void *buf, size_t n)
+{
+	if (m_cluster != 0)
+		thread_cluster_bcast(*m_cluster, Env::group_rank(), buf, n);
+	else
+		MPI_Bcast(buf, n, MPI_BYTE, 0, m_mpi_comm);
+}
+
+
+void YaoBase::cluster_gather(const void *send, size_t n, void *recv)
+{
+	if (m_cluster != 0)
+		thread_cluster_gather(*m_cluster, Env::group_rank(), send, n, recv);
+	else
+		MPI_Gather(const_cast<void*>(send), n, MPI_BYTE, recv, n, MPI_BYTE, 0, m_mpi_comm);
+}
+
+
+void YaoBase::cluster_scatter(const void *send, size_t n, void *recv)
+{
+	if (m_cluster != 0)
+		thread_cluster_scatter(*m_cluster, Env::group_rank(), send, n, recv);
+	else
+		MPI_Scatter(const_cast<void*>(send), n, MPI_BYTE, recv, n, MPI_BYTE, 0, m_mpi_comm);
+}
+
+
+uint64_t YaoBase::cluster_sum(uint64_t v)
+{
+	uint64_t sum = v;
+
+	if (m_cluster != 0)
+	{
+		vector<uint64_t> all(m_cluster->size);
+		thread_cluster_gather(*m_cluster, Env::group_rank(), &v, sizeof(v), &all[0]);
+
+		sum = 0;
+		for (size_t ix = 0; ix < all.size(); ix++) sum += all[ix];
+	}
+	else
+	{
+		MPI_Reduce(&v, &sum, 1, MPI_LONG_LONG_INT, MPI_SUM, 0, m_mpi_comm);
+	}
+
+	return sum;
+}
+
+
+int YaoBase::cluster_land(int v)
+{
+	int land = v;
+
+	if (m_cluster != 0)
+	{
+		vector<int> all(m_cluster->size);
+		thread_cluster_gather(*m_cluster, Env::group_rank(), &v, sizeof(v), &all[0]);
+
+		land = 1;
+		for (size_t ix = 0; ix < all.size(); ix++) land = land && all[ix];
+	}
+	else
+	{
+		MPI_Reduce(&v, &land, 1, MPI_INT, MPI_LAND, 0, m_mpi_comm);
+	}
+
+	return land;
+}
+
+
+namespace
+{
+
+struct rank_t
+{
+	EnvParams    params;
+	YaoBase   *(*make)(EnvParams &);
+	pthread_t    thread;
+};
+
+void *run_rank(void *arg)
+{
+	rank_t *rank = reinterpret_cast<rank_t*>(arg);
+
+	Env::init_rank(rank->params);
+
+	YaoBase *sys = rank->make(rank->params);
+	sys->start();
+	delete sys;
+
+	return 0;
+}
+
+}
+
+// One process of MPI whose ranks are threads, each with params and a
+// connection of its own, and with the collectives in shared memory; a
+// two-party build connects rank r of one party to rank r of the other as
+// it does with MPI.
+void YaoBase::run_ranks(EnvParams &params, YaoBase *(*make)(EnvParams &))
+{
+#if !(defined GEN_CODE || defined EVL_CODE)
+	LOG4CXX_FATAL(logger, "ranks run as threads in the two-party builds only");
+	MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+#endif
+
+	int wrld_size;
+	MPI_Comm_size(MPI_COMM_WORLD, &wrld_size);
+
+	if (wrld_size != 1 || params.rank_cnt < 1)
+	{
+		LOG4CXX_FATAL(logger, "ranks run as threads of one process of MPI");
+		MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+	}
+
+	thread_cluster_t cluster;
+	thread_cluster_init(cluster, params.rank_cnt);
+
+	rank_t *ranks = new rank_t[params.rank_cnt];
+
+	for (int ix = 0; ix < params.rank_cnt; ix++)
+	{
+		ranks[ix].params.copy_settings(params);
+		ranks[ix].params.wrld_rank = ranks[ix].params.node_rank = ix;
+		ranks[ix].params.cluster = &cluster;
+		ranks[ix].make = make;
+	}
+
+	Env::init(ranks[0].params); // for the threads of no rank to go by
+
+	for (int ix = 0; ix < params.rank_cnt; ix++)
+	{
+		if (pthread_create(&ranks[ix].thread, 0, run_rank, &ranks[ix]) != 0)
+		{
+			LOG4CXX_FATAL(logger, "rank " << ix << " failed to start");
+			MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
+		}
+	}
+
+	for (int ix = 0; ix < params.rank_cnt; ix++)
+		pthread_join(ranks[ix].thread, 0);
+
+	Env::destroy();
+
+	delete [] ranks;
+	thread_cluster_destroy(cluster);
+}
+
+
 inline std::string print_longlong(uint64_t l)
 {
 	char buf[8];
@@ -279,7 +530,10 @@ void YaoBase::step_init()
 void YaoBase::step_report(std::string step_name)
 {
 	double start = MPI_Wtime();
-		MPI_Barrier(MPI_COMM_WORLD);
+		if (m_cluster != 0)
+			thread_cluster_barrier(*m_cluster);
+		else if (!m_session) // sessions run side by side, with a node to a party
+			MPI_Barrier(MPI_COMM_WORLD);
 	m_timer_mpi += MPI_Wtime() - start;
 
 	step_report_no_sync(step_name);
@@ -288,25 +542,38 @@ void YaoBase::step_report(std::string step_name)
 
 void YaoBase::step_report_no_sync(std::string step_name)
 {
-	uint64_t all_comm_sz = 0LL;
+	uint64_t all_comm_sz = m_comm_sz;
 
-	MPI_Reduce(&m_comm_sz, &all_comm_sz, 1, MPI_LONG_LONG_INT, MPI_SUM, 0, m_mpi_comm);
+	if (!m_session)
+		all_comm_sz = cluster_sum(m_comm_sz);
 
 	if (!Env::is_root())
 		return;
 
-	m_timer_mpi_vec.push_back(m_timer_mpi);
-	m_timer_cmm_vec.push_back(m_timer_com);
-	m_step_name_vec.push_back(step_name);
-	m_comm_sz_vec.push_back(all_comm_sz);
+	// a step that comes again, once for every record of a batch, adds up
+	size_t ix = std::find(m_step_name_vec.begin(), m_step_name_vec.end(), step_name) - m_step_name_vec.begin();
+	if (ix == m_step_name_vec.size())
+	{
+		m_timer_cmp_vec.push_back(0);
+		m_timer_mpi_vec.push_back(0);
+		m_timer_cmm_vec.push_back(0);
+		m_step_name_vec.push_back(step_name);
+		m_step_cnt_vec.push_back(0);
+		m_comm_sz_vec.push_back(0);
+	}
+
+	m_timer_mpi_vec[ix] += m_timer_mpi;
+	m_timer_cmm_vec[ix] += m_timer_com;
+	m_step_cnt_vec[ix]++;
+	m_comm_sz_vec[ix] += all_comm_sz;
 
 	EVL_BEGIN
-		m_timer_cmp_vec.push_back(m_timer_evl);
+		m_timer_cmp_vec[ix] += m_timer_evl;
 		LOG4CXX_INFO(logger, "EVL finish " << step_name << "");
 	EVL_END
 
 	GEN_BEGIN
-		m_timer_cmp_vec.push_back(m_timer_gen);
+		m_timer_cmp_vec[ix] += m_timer_gen;
 		LOG4CXX_INFO(logger, "GEN finish " << step_name << "");
 	GEN_END
 }
@@ -337,16 +604,29 @@ void YaoBase::final_report()
 
 	for (size_t i = 0; i < m_comm_sz_vec.size(); i++)
 	{
+		std::ostringstream step;
+		step << m_step_name_vec[i];
+		if (m_step_cnt_vec[i] > 1)
+			step << " x" << m_step_cnt_vec[i];
+
 		LOG4CXX_INFO
 		(
 			logger,
-			name << " in " << m_step_name_vec[i] << "> " << std::fixed <<
+			name << " in " << step.str() << "> " << std::fixed <<
 			"  cmp:"  << std::setw(12) << std::setprecision(4) << m_timer_cmp_vec[i] <<
 			", cmm:"  << std::setw(12) << std::setprecision(4) << m_timer_cmm_vec[i] <<
 			", mpi:"  << std::setw(12) << std::setprecision(4) << m_timer_mpi_vec[i] <<
 			", size:" << std::setw(16) << std::setprecision(4) << print_longlong(m_comm_sz_vec[i])
 		);
 	}
+
+	// the next session, if any, reports its own steps
+	m_timer_cmp_vec.clear();
+	m_timer_mpi_vec.clear();
+	m_timer_cmm_vec.clear();
+	m_step_name_vec.clear();
+	m_step_cnt_vec.clear();
+	m_comm_sz_vec.clear();
 }
 
 
@@ -17,10 +17,11 @@
 	#define GEN_END
 	#define EVL_BEGIN     if (0) {
 	#define EVL_END       }
-	#define GEN_SEND(d)   Env::remote()->write_bytes(d)
-	#define EVL_RECV()    Env::remote()->read_bytes()
-	#define EVL_SEND(d)   Env::remote()->write_bytes(d)
-	#define GEN_RECV()    Env::remote()->read_bytes()
+	#define GEN_SEND(d)   m_remote->write_bytes(d)
+	#define EVL_RECV()    m_remote->read_bytes()
+	#define EVL_RECV_INTO(d) m_remote->read_bytes(d)
+	#define EVL_SEND(d)   m_remote->write_bytes(d)
+	#define GEN_RECV()    m_remote->read_bytes()
 
 #elif defined EVL_CODE
 
@@ -29,10 +30,11 @@
 	#define GEN_END       }
 	#define EVL_BEGIN
 	#define EVL_END
-	#define GEN_SEND(d)   Env::remote()->write_bytes(d)
-	#define EVL_RECV()    Env::remote()->read_bytes()
-	#define EVL_SEND(d)   Env::remote()->write_bytes(d)
-	#define GEN_RECV()    Env::remote()->read_bytes()
+	#define GEN_SEND(d)   m_remote->write_bytes(d)
+	#define EVL_RECV()    m_remote->read_bytes()
+	#define EVL_RECV_INTO(d) m_remote->read_bytes(d)
+	#define EVL_SEND(d)   m_remote->write_bytes(d)
+	#define GEN_RECV()    m_remote->read_bytes()
 
 #else
 
@@ -45,6 +47,7 @@
 	#define EVL_END       }
 	#define EVL_SEND(d)   send_data(Env::world_rank()-1, (d))
 	#define EVL_RECV()    recv_data(Env::world_rank()-1)
+	#define EVL_RECV_INTO(d) recv_data(Env::world_rank()-1, (d))
 
 #endif
 
@@ -52,10 +55,15 @@
 class YaoBase {
 public:
 	YaoBase(EnvParams &params);
+	YaoBase(const YaoBase &service, Socket *remote); // a session of a service
 	virtual ~YaoBase();
 
 	virtual void start() = 0;
 
+	// the cluster as params.rank_cnt threads of this process, each running
+	// a party of its own that make makes from params
+	static void run_ranks(EnvParams &params, YaoBase *(*make)(EnvParams &));
+
 private:
 	void init_cluster(EnvParams &params);
 	void init_network(EnvParams &params);
@@ -65,8 +73,17 @@ private:
 protected:
 	// subroutines for the communication in the Simulation mode
 	Bytes recv_data(int src_node);
+	void recv_data(int src_node, Bytes &data); // into the storage data has
 	void send_data(int dst_node, const Bytes &data);
 
+	// collectives of the cluster, with rank 0 as the root, over MPI or over
+	// m_cluster when the ranks are threads
+	void cluster_bcast(void *buf, size_t n);
+	void cluster_gather(const void *send, size_t n, void *recv);
+	void cluster_scatter(const void *send, size_t n, void *recv);
+	uint64_t cluster_sum(uint64_t v); // at the root
+	int cluster_land(int v);          // at the root
+
 	// subroutines for profiling
 	void step_init();
 	void step_report(std::string step_name);
@@ -76,6 +93,11 @@ protected:
 protected:
 	// variables for MPI
 	MPI_Comm            m_mpi_comm;
+	thread_cluster_t   *m_cluster;  // the ranks as threads of this process, if they are
+
+	// variables for the two-party builds
+	Socket             *m_remote;
+	bool                m_session;  // one of those a service runs side by side
 
 	// variables for profiling
 	double              m_timer_gen;
@@ -90,6 +112,7 @@ protected:
 	vector<double>      m_timer_cmm_vec;
 
 	vector<std::string> m_step_name_vec;
+	vector<size_t>      m_step_cnt_vec;
 	vector<uint64_t>    m_comm_sz_vec;
 
 	// variables for Yao protocol
@@ -97,6 +120,7 @@ protected:
 	Bytes               m_gen_inp;
 	Bytes               m_gen_out;
 	Bytes               m_evl_out;
+	vector<Bytes>       m_inp_recs; // this party's input in every record of the private file
 
 	Prng                m_prng;
 };
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cstring>
+
 #include "garbled_circuit.h"
 
 
@@ -17,13 +20,12 @@ void delete_key(void *key)
 	if (key != 0) _mm_free(key);
 }
 
-const Bytes &get_const_key(garbled_circuit_t &cct, byte c, byte b)
+Bytes get_const_key(garbled_circuit_t &cct, byte c, byte b)
 {
 	assert(c == 0 || c == 1); // wire for constant 0 or 1
 	assert(b == 0 || b == 1); // with bit value 0 or 1
-	static Bytes tmp(16);
+	Bytes tmp(16);
 
-	tmp.resize(16);
 	if (b)
 	{
 		_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), _mm_xor_si128(cct.m_R, cct.m_const_wire[c]));
@@ -45,36 +47,38 @@ void set_const_key(garbled_circuit_t &cct, byte c, const Bytes &key)
 	cct.m_const_wire[c] = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
 }
 
-namespace
+// the gate code of one label width, picked by gen_init()/evl_init()
+struct gate_kernels_t
 {
-const int CIRCUIT_HASH_BUFFER_SIZE = 1024*1024;
-const int MAX_OUTPUT_SIZE = 1024;
+	void *(*gen_gate)(garbled_circuit_t &, struct PCFState *, struct PCFGate *);
+	void *(*evl_gate)(garbled_circuit_t &, struct PCFState *, struct PCFGate *);
+	void *(*gen_defer)(garbled_circuit_t &, struct PCFState *, struct PCFGate *);
+	void *(*evl_defer)(garbled_circuit_t &, struct PCFState *, struct PCFGate *);
+	ThreadPool::task_t gen_level;
+	ThreadPool::task_t evl_level;
+};
 
-void update_hash(garbled_circuit_t &cct, const Bytes &data)
+namespace
 {
-	cct.m_bufr += data;
+const int MAX_OUTPUT_SIZE = 1024;
 
-#ifdef RAND_SEED
-	if (cct.m_bufr.size() > CIRCUIT_HASH_BUFFER_SIZE) // hash the circuit by chunks
-	{
-		cct.m_hash.update(cct.m_bufr);
-		cct.m_bufr.clear();
-	}
-#endif
-}
+const gate_kernels_t *kernels_for(size_t k, bool privacy_free); // gate code for label width k
 
 };
 
-void gen_init(garbled_circuit_t &cct, const vector<Bytes> &ot_keys, const Bytes &gen_inp_mask, const Bytes &seed)
+void gen_init(garbled_circuit_t &cct, const vector<Bytes> &ot_keys, const Bytes &gen_inp_mask, const Bytes &seed, const Bytes &delta, bool privacy_free)
 {
 	cct.m_ot_keys = &ot_keys;
+	cct.m_ot_thread = 0;
+	cct.m_o_flush = 0;
+	cct.m_gen_inp_keys = 0;
 	cct.m_gen_inp_mask = gen_inp_mask;
 	cct.m_prng.srand(seed);
 
 	// R is a random k-bit string whose 0-th bit has to be 1
 	Bytes tmp;
 
-	tmp = cct.m_prng.rand(Env::k());
+	tmp = delta.empty()? cct.m_prng.rand(Env::k()) : delta;
 	tmp.set_ith_bit(0, 1);
 	tmp.resize(16, 0);
 	cct.m_R = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&tmp[0]));
@@ -88,6 +92,12 @@ void gen_init(garbled_circuit_t &cct, const vector<Bytes> &ot_keys, const Bytes
 	tmp.resize(16, 0);
 	cct.m_const_wire[1] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&tmp[0]));
 
+	if (privacy_free) // the lsb of a key is its value
+	{
+		cct.m_const_wire[0] = _mm_andnot_si128(_mm_cvtsi32_si128(1), cct.m_const_wire[0]);
+		cct.m_const_wire[1] = _mm_andnot_si128(_mm_cvtsi32_si128(1), cct.m_const_wire[1]);
+	}
+
 	cct.m_gate_ix = 0;
 
 	cct.m_gen_inp_ix = 0;
@@ -100,11 +110,16 @@ void gen_init(garbled_circuit_t &cct, const vector<Bytes> &ot_keys, const Bytes
 	tmp.assign(16, 0);
 	for (size_t ix = 0; ix < Env::k(); ix++) tmp.set_ith_bit(ix, 1);
 	cct.m_clear_mask = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
+
+	cct.m_kernels = kernels_for(Env::k(), privacy_free);
 }
 
-void evl_init(garbled_circuit_t &cct, const vector<Bytes> &ot_keys, const Bytes &masked_gen_inp, const Bytes &evl_inp)
+void evl_init(garbled_circuit_t &cct, const vector<Bytes> &ot_keys, const Bytes &masked_gen_inp, const Bytes &evl_inp, bool privacy_free)
 {
 	cct.m_ot_keys = &ot_keys;
+	cct.m_ot_thread = 0;
+	cct.m_o_flush = 0;
+	cct.m_gen_inp_keys = 0;
 	cct.m_gen_inp_mask = masked_gen_inp;
 	cct.m_evl_inp = evl_inp;
 
@@ -121,309 +136,988 @@ void evl_init(garbled_circuit_t &cct, const vector<Bytes> &ot_keys, const Bytes
 	cct.m_evl_out_ix = 0;
 
 	cct.m_i_bufr.clear();
+	cct.m_i_bufr_ix = cct.m_i_bufr.begin();
 
 	Bytes tmp(16);
 	for (size_t ix = 0; ix < Env::k(); ix++) tmp.set_ith_bit(ix, 1);
 	cct.m_clear_mask = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
 
-	cct.m_bufr.reserve(CIRCUIT_HASH_BUFFER_SIZE);
-	cct.m_bufr.clear();
+	cct.m_kernels = kernels_for(Env::k(), privacy_free);
+
 	cct.m_hash.init();
 }
 
+void ot_wait(garbled_circuit_t &cct)
+{
+	if (cct.m_ot_thread == 0) return;
+
+	pthread_join(*cct.m_ot_thread, 0);
+	cct.m_ot_thread = 0;
+}
 
-void *gen_next_gate(struct PCFState *st, struct PCFGate *current_gate)
+Bytes gen_cot_fix(const garbled_circuit_t &cct, vector<Bytes> &keys)
 {
-	garbled_circuit_t &cct =
-		*reinterpret_cast<garbled_circuit_t*>(get_external_state(st));
+	const size_t n = keys.size()/2, len = Env::key_size_in_bytes();
 
-	static __m128i current_zero_key;
+	Bytes R(16), fix;
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(&R[0]), cct.m_R);
 
-	if (current_gate->tag == TAG_INPUT_A)
+	fix.reserve(n*len);
+	for (size_t ix = 0; ix < n; ix++)
 	{
-		__m128i a[2];
+		for (size_t jx = 0; jx < len; jx++) fix.push_back(keys[2*ix+0][jx] ^ keys[2*ix+1][jx] ^ R[jx]);
+		keys[ix] = keys[2*ix+0];
+	}
+	keys.resize(n);
 
-		Bytes tmp = cct.m_prng.rand(Env::k());
-		tmp.resize(16, 0);
-		current_zero_key = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
+	return fix;
+}
 
-		uint32_t gen_inp_ix = current_gate->wire1;
+Bytes gen_inp_keys(const garbled_circuit_t &cct, const vector<Bytes> &zero_keys, const Bytes &bits)
+{
+	const size_t len = Env::key_size_in_bytes();
 
-		a[0] = current_zero_key;
-		a[1] = _mm_xor_si128(current_zero_key, cct.m_R);
+	Bytes R(16), keys;
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(&R[0]), cct.m_R);
 
-		//uint8_t bit = cct.m_gen_inp_mask.get_ith_bit(gen_inp_ix);
-		uint8_t bit = cct.m_gen_inp.get_ith_bit(gen_inp_ix);
+	keys.reserve(zero_keys.size()*len);
+	for (size_t ix = 0; ix < zero_keys.size(); ix++)
+	{
+		const byte bit = bits.get_ith_bit(ix);
+		for (size_t jx = 0; jx < len; jx++) keys.push_back(zero_keys[ix][jx] ^ (bit? R[jx] : 0));
+	}
 
-		_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), a[  bit]);
-		cct.m_o_bufr.insert(cct.m_o_bufr.end(), tmp.begin(), tmp.begin()+Env::key_size_in_bytes());
+	return keys;
+}
 
-		cct.m_gen_inp_ix++; // after PCF compiler, this isn't really necessary
+void evl_cot_fix(const garbled_circuit_t &cct, const Bytes &fix, vector<Bytes> &keys)
+{
+	const size_t len = Env::key_size_in_bytes();
+
+	assert(fix.size() == keys.size()*len);
+
+	for (size_t ix = 0; ix < keys.size(); ix++)
+		if (cct.m_evl_inp.get_ith_bit(ix))
+	{
+		for (size_t jx = 0; jx < len; jx++) keys[ix][jx] ^= fix[ix*len+jx];
 	}
-	else if (current_gate->tag == TAG_INPUT_B)
+}
+
+
+namespace
+{
+const size_t DEFER_SEGMENT_SIZE = 64*1024; // gates recorded before a flush
+const size_t DEFER_GRAIN = 64;             // gates claimed by a thread at a time
+
+//
+// The gate code is instantiated per label width KB (in bytes), so that keys
+// are moved with fixed-size loads/stores and the KDF output is trimmed with
+// a constant mask: KB = 10 serves k = 80 and KB = 16 serves k = 128. KB = 0
+// is the fallback that looks the width up in Env for any other k.
+//
+template <size_t KB> inline size_t key_bytes()
+{
+	return KB? KB : Env::key_size_in_bytes();
+}
+
+template <size_t KB> inline __m128i load_key(const uint8_t *in)
+{
+	if (KB == 16)
+	{
+		return _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+	}
+	else if (KB == 10)
+	{
+		uint16_t hi;
+		memcpy(&hi, in+8, sizeof(hi));
+		return _mm_insert_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(in)), hi, 4);
+	}
+
+	__m128i key = _mm_setzero_si128();
+	memcpy(&key, in, key_bytes<KB>());
+	return key;
+}
+
+template <size_t KB> inline void store_key(uint8_t *out, const __m128i &key)
+{
+	if (KB == 16)
 	{
-		__m128i a[2];
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out), key);
+	}
+	else if (KB == 10)
+	{
+		uint16_t hi = _mm_extract_epi16(key, 4);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(out), key);
+		memcpy(out+8, &hi, sizeof(hi));
+	}
+	else
+	{
+		memcpy(out, &key, key_bytes<KB>());
+	}
+}
 
-		Bytes tmp = cct.m_prng.rand(Env::k());
-		tmp.resize(16, 0);
-		current_zero_key = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
+// clear extra bits so that only k bits left
+template <size_t KB> inline __m128i clear_key(const garbled_circuit_t &cct, const __m128i &key)
+{
+	if (KB == 16)
+	{
+		return key;
+	}
+	else if (KB == 10)
+	{
+		return _mm_and_si128(key, _mm_set_epi32(0, 0xFFFF, -1, -1));
+	}
+	return _mm_and_si128(key, cct.m_clear_mask);
+}
+
+inline uint8_t *bufr_at(Bytes &bufr, size_t ofs)
+{
+	return bufr.empty()? 0 : &bufr[0] + ofs;
+}
+
+// make room for n more bytes at the end of bufr and return where they start
+inline uint8_t *bufr_grow(Bytes &bufr, size_t n)
+{
+	size_t ofs = bufr.size();
+	bufr.resize(ofs+n);
+	return bufr_at(bufr, ofs);
+}
+
+// the n bytes of the received frame that the gate at hand reads
+inline const uint8_t *frame_take(garbled_circuit_t &cct, size_t n)
+{
+	const uint8_t *in = bufr_at(cct.m_i_bufr, cct.m_i_bufr_ix - cct.m_i_bufr.begin());
+	cct.m_i_bufr_ix += n;
+	return in;
+}
 
-		uint32_t evl_inp_ix = current_gate->wire1;
+template <size_t KB> inline __m128i rand_key(garbled_circuit_t &cct)
+{
+	__m128i key;
+	cct.m_prng.fill(&key, 1); // the block m_prng.rand(Env::k()) would cut k bits from
+	return clear_key<KB>(cct, key);
+}
 
-		tmp = (*cct.m_ot_keys)[2*evl_inp_ix+0];
-		tmp.resize(16, 0);
-		a[0] = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
+inline bool is_output(uint32_t tag)
+{
+	return tag == TAG_OUTPUT_A || tag == TAG_OUTPUT_B;
+}
 
-		tmp = (*cct.m_ot_keys)[2*evl_inp_ix+1];
-		tmp.resize(16, 0);
-		a[1] = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
+inline bool is_free(uint8_t table)
+{
+#ifdef FREE_XOR
+	return table == 0x06;
+#else
+	return false;
+#endif
+}
 
-		// a[0] ^= zero_key; a[1] ^= zero_key ^ R;
-		a[0] = _mm_xor_si128(a[0], current_zero_key);
-		a[1] = _mm_xor_si128(a[1], _mm_xor_si128(current_zero_key, cct.m_R));
+//
+// Privacy-free garbling (PF = true), for when the evaluator may learn every
+// wire value. All zero-keys have their lsb cleared, so a key's lsb is the
+// bit it carries, and XOR-ing PF_ONE (bit 0 only) into a key negates its
+// wire. Gates whose truth table is affine cost nothing; the others are an
+// AND with negated inputs and output and take one ciphertext, following
+// Zahur-Rosulek-Evans: T = H(A0) ^ H(A0^R) ^ B0, and C0 = H(A0).
+//
+const __m128i PF_ONE = _mm_cvtsi32_si128(1);
+
+// f(x, y) = c3&x&y ^ c1&x ^ c2&y ^ c0 is affine iff c3, the parity of the table, is 0
+inline bool is_affine(uint8_t table)
+{
+	uint8_t c3 = table ^ (table>>1);
+	return ((c3 ^ (c3>>2)) & 0x01) == 0;
+}
 
-		// cct.m_o_bufr += a[0];
-		_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), a[0]);
-		cct.m_o_bufr.insert(cct.m_o_bufr.end(), tmp.begin(), tmp.begin()+Env::key_size_in_bytes());
+template <size_t KB, bool PF> inline __m128i rand_zero_key(garbled_circuit_t &cct)
+{
+	__m128i key = rand_key<KB>(cct);
+	return PF? _mm_andnot_si128(PF_ONE, key) : key;
+}
 
-		// cct.m_o_bufr += a[1];
-		_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), a[1]);
-		cct.m_o_bufr.insert(cct.m_o_bufr.end(), tmp.begin(), tmp.begin()+Env::key_size_in_bytes());
+// size of the message the generator sends for a non-input gate
+template <size_t KB, bool PF> inline size_t gate_bufr_size(uint8_t table, uint32_t tag)
+{
+	if (PF) return is_affine(table)? 0 : key_bytes<KB>(); // outputs are read off the lsb
 
-		cct.m_evl_inp_ix++; // after PCF compiler, this isn't really necessary
+	size_t size = 0;
+	if (!is_free(table))
+	{
+#ifdef GRR
+		size = 3*key_bytes<KB>();
+#else
+		size = 4*key_bytes<KB>();
+#endif
+	}
+	return is_output(tag)? size+1 : size; // plus the permutation bit
+}
+
+// size of the message the generator sends for one of its input gates
+template <size_t KB> inline size_t inp_a_bufr_size(const garbled_circuit_t &cct)
+{
+	return cct.m_gen_inp_keys? 0 : key_bytes<KB>();
+}
+
+// the zero-keys of m_gen_inp_keys are taken as they are, privacy-free ones
+// included
+template <size_t KB, bool PF>
+__m128i gen_inp_a(garbled_circuit_t &cct, uint32_t gen_inp_ix, uint8_t *out)
+{
+	cct.m_gen_inp_ix++; // after PCF compiler, this isn't really necessary
+
+	if (cct.m_gen_inp_keys)
+		return load_key<KB>(&(*cct.m_gen_inp_keys)[gen_inp_ix][0]);
+
+	__m128i zero_key = rand_zero_key<KB, PF>(cct);
+
+	//uint8_t bit = cct.m_gen_inp_mask.get_ith_bit(gen_inp_ix);
+	uint8_t bit = cct.m_gen_inp.get_ith_bit(gen_inp_ix);
+
+	store_key<KB>(out, bit? _mm_xor_si128(zero_key, cct.m_R) : zero_key);
+
+	return zero_key;
+}
+
+// the correlated OT has handed the evaluator its key already, so there is
+// nothing to send; privacy-free zero-keys have their lsb cleared
+template <size_t KB, bool PF>
+__m128i gen_inp_b(garbled_circuit_t &cct, uint32_t evl_inp_ix)
+{
+	// the evaluator has the gates so far to work on while the OTs finish
+	if (cct.m_ot_thread && cct.m_o_flush && !cct.m_o_bufr.empty())
+		cct.m_o_flush(cct.m_o_flush_arg);
+
+	ot_wait(cct);
+
+	__m128i zero_key = load_key<KB>(&(*cct.m_ot_keys)[evl_inp_ix][0]);
+
+	cct.m_evl_inp_ix++; // after PCF compiler, this isn't really necessary
+	return PF? _mm_andnot_si128(PF_ONE, zero_key) : zero_key;
+}
+
+// H(key) of a privacy-free gate, with the gate index in both the key and the
+// plaintext so that it also holds up as SHA-256 without AES-NI
+template <size_t KB>
+inline __m128i pf_hash(const garbled_circuit_t &cct, uint64_t gate_ix, const __m128i &key)
+{
+	__m128i aes_key[2], aes_plaintext, aes_ciphertext;
+
+	aes_plaintext = _mm_set1_epi64x(gate_ix);
+	aes_key[0] = key;
+	aes_key[1] = aes_plaintext;
+
+	KDF256((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)aes_key);
+	return _mm_andnot_si128(PF_ONE, clear_key<KB>(cct, aes_ciphertext));
+}
+
+// the truth table as f(x, y) = ((x^a) & (y^b)) ^ c, or c1&x ^ c2&y ^ c0 when affine
+struct pf_table_t
+{
+	uint8_t c0, c1, c2;
+
+	pf_table_t(uint8_t table)
+	{
+		const uint8_t f00 = (table>>3)&0x01, f10 = (table>>2)&0x01, f01 = (table>>1)&0x01;
+		c0 = f00; c1 = f00^f10; c2 = f00^f01;
+	}
+
+	uint8_t a() const { return c2; }
+	uint8_t b() const { return c1; }
+	uint8_t c() const { return c0 ^ (c1&c2); }
+};
+
+template <size_t KB>
+__m128i pf_gen_garble(const garbled_circuit_t &cct, uint8_t table, uint64_t gate_ix,
+	const __m128i &X0, const __m128i &Y0, uint8_t *out)
+{
+	const pf_table_t f(table);
+	const __m128i NOT = _mm_xor_si128(cct.m_R, PF_ONE); // the zero-key of a negated wire
+
+	if (is_affine(table))
+	{
+		__m128i Z0 = _mm_setzero_si128();
+		if (f.c1) Z0 = _mm_xor_si128(Z0, X0);
+		if (f.c2) Z0 = _mm_xor_si128(Z0, Y0);
+		if (f.c0) Z0 = _mm_xor_si128(Z0, NOT);
+		return Z0;
+	}
+
+	const __m128i A0 = f.a()? _mm_xor_si128(X0, NOT) : X0;
+	const __m128i B0 = f.b()? _mm_xor_si128(Y0, NOT) : Y0;
+
+	__m128i C0 = pf_hash<KB>(cct, gate_ix, A0);
+	__m128i T = _mm_xor_si128(C0, pf_hash<KB>(cct, gate_ix, _mm_xor_si128(A0, cct.m_R)));
+	store_key<KB>(out, _mm_xor_si128(T, B0));
+
+	return f.c()? _mm_xor_si128(C0, NOT) : C0;
+}
+
+template <size_t KB>
+__m128i pf_evl_garble(const garbled_circuit_t &cct, uint8_t table, uint64_t gate_ix,
+	const __m128i &X, const __m128i &Y, const uint8_t *in)
+{
+	const pf_table_t f(table);
+
+	if (is_affine(table))
+	{
+		__m128i Z = _mm_setzero_si128();
+		if (f.c1) Z = _mm_xor_si128(Z, X);
+		if (f.c2) Z = _mm_xor_si128(Z, Y);
+		if (f.c0) Z = _mm_xor_si128(Z, PF_ONE);
+		return Z;
+	}
+
+	const __m128i A = f.a()? _mm_xor_si128(X, PF_ONE) : X;
+	const __m128i B = f.b()? _mm_xor_si128(Y, PF_ONE) : Y;
+
+	__m128i C = pf_hash<KB>(cct, gate_ix, A);
+	if (_mm_extract_epi8(A, 0) & 0x01) // a = 1: C = C0 ^ b&R
+	{
+		C = _mm_xor_si128(C, _mm_xor_si128(load_key<KB>(in), B));
+	}
+
+	return f.c()? _mm_xor_si128(C, PF_ONE) : C;
+}
+
+//
+// Garbles a non-input gate with input zero-keys X0 and Y0 and writes its
+// gate_bufr_size() bytes to out. Only reads cct, so that gates of the same
+// level can be garbled concurrently. Z0 is the output zero-key picked by
+// the caller when GRR is off.
+//
+template <size_t KB, bool PF>
+__m128i gen_garble(const garbled_circuit_t &cct, uint8_t table, uint32_t tag, uint64_t gate_ix,
+	const __m128i &X0, const __m128i &Y0, const __m128i &Z0, uint8_t *out)
+{
+	if (PF) return pf_gen_garble<KB>(cct, table, gate_ix, X0, Y0, out);
+
+	__m128i zero_key;
+
+	if (is_free(table)) // if XOR gate
+	{
+		zero_key = _mm_xor_si128(X0, Y0);
 	}
 	else
 	{
-#ifdef FREE_XOR
-		if (current_gate->truth_table == 0x06) // if XOR gate
-		{
-			current_zero_key = _mm_xor_si128
-			(
-				*reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1)),
-				*reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2))
-			);
-		}
-		else
+		uint8_t bit;
+		__m128i aes_key[2], aes_plaintext, aes_ciphertext;
+		__m128i X[2], Y[2], Z[2];
+
+		aes_plaintext = _mm_set1_epi64x(gate_ix);
+
+		X[0] = X0;
+		Y[0] = Y0;
+
+		X[1] = _mm_xor_si128(X[0], cct.m_R); // X[1] = X[0] ^ R
+		Y[1] = _mm_xor_si128(Y[0], cct.m_R); // Y[1] = Y[0] ^ R
+
+		const uint8_t perm_x = _mm_extract_epi8(X[0], 0) & 0x01; // permutation bit for X
+		const uint8_t perm_y = _mm_extract_epi8(Y[0], 0) & 0x01; // permutation bit for Y
+		const uint8_t de_garbled_ix = (perm_y<<1)|perm_x; // wire1+2*wire2
+
+		// encrypt the 0-th entry : (X[x], Y[y])
+		aes_key[0] = _mm_load_si128(X+perm_x);
+		aes_key[1] = _mm_load_si128(Y+perm_y);
+
+		KDF256((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)aes_key);
+		aes_ciphertext = clear_key<KB>(cct, aes_ciphertext);
+		bit = (table>>(3-de_garbled_ix))&0x01;
+
+#ifdef GRR
+		// GRR technique: using zero entry's key as one of the output keys
+		_mm_store_si128(Z+bit, aes_ciphertext);
+		Z[1-bit] = _mm_xor_si128(Z[bit], cct.m_R);
+#else
+		Z[0] = Z0;
+		Z[1] = _mm_xor_si128(Z[0], cct.m_R);
+
+		aes_ciphertext = _mm_xor_si128(aes_ciphertext, Z[bit]);
+		store_key<KB>(out, aes_ciphertext);
+		out += key_bytes<KB>();
 #endif
-		{
-			uint8_t bit;
-			__m128i aes_key[2], aes_plaintext, aes_ciphertext;
-			__m128i X[2], Y[2], Z[2];
-			static Bytes tmp(16, 0);
 
-			aes_plaintext = _mm_set1_epi64x(cct.m_gate_ix);
+		// encrypt the 1st entry : (X[1-x], Y[y])
+		aes_key[0] = _mm_xor_si128(aes_key[0], cct.m_R);
+
+		KDF256((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)aes_key);
+		aes_ciphertext = clear_key<KB>(cct, aes_ciphertext);
+		bit = (table>>(3-(0x01^de_garbled_ix)))&0x01;
+		aes_ciphertext = _mm_xor_si128(aes_ciphertext, Z[bit]);
+		store_key<KB>(out, aes_ciphertext);
+		out += key_bytes<KB>();
+
+		// encrypt the 2nd entry : (X[x], Y[1-y])
+		aes_key[0] = _mm_xor_si128(aes_key[0], cct.m_R);
+		aes_key[1] = _mm_xor_si128(aes_key[1], cct.m_R);
+
+		KDF256((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)aes_key);
+		aes_ciphertext = clear_key<KB>(cct, aes_ciphertext);
+		bit = (table>>(3-(0x02^de_garbled_ix)))&0x01;
+		aes_ciphertext = _mm_xor_si128(aes_ciphertext, Z[bit]);
+		store_key<KB>(out, aes_ciphertext);
+		out += key_bytes<KB>();
+
+		// encrypt the 3rd entry : (X[1-x], Y[1-y])
+		aes_key[0] = _mm_xor_si128(aes_key[0], cct.m_R);
+
+		KDF256((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)aes_key);
+		aes_ciphertext = clear_key<KB>(cct, aes_ciphertext);
+		bit = (table>>(3-(0x03^de_garbled_ix)))&0x01;
+		aes_ciphertext = _mm_xor_si128(aes_ciphertext, Z[bit]);
+		store_key<KB>(out, aes_ciphertext);
+		out += key_bytes<KB>();
+
+		zero_key = _mm_load_si128(Z);
+	}
+
+	if (is_output(tag))
+	{
+		*out = _mm_extract_epi8(zero_key, 0) & 0x01; // permutation bit
+	}
 
-			X[0] = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1));
-			Y[0] = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2));
+	return zero_key;
+}
 
-			X[1] = _mm_xor_si128(X[0], cct.m_R); // X[1] = X[0] ^ R
-			Y[1] = _mm_xor_si128(Y[0], cct.m_R); // Y[1] = Y[0] ^ R
+template <size_t KB>
+__m128i evl_inp_a(garbled_circuit_t &cct, uint32_t gen_inp_ix, const uint8_t *in)
+{
+	cct.m_gen_inp_ix++;
+	return load_key<KB>(cct.m_gen_inp_keys? &(*cct.m_gen_inp_keys)[gen_inp_ix][0] : in);
+}
 
-			const uint8_t perm_x = _mm_extract_epi8(X[0], 0) & 0x01; // permutation bit for X
-			const uint8_t perm_y = _mm_extract_epi8(Y[0], 0) & 0x01; // permutation bit for Y
-			const uint8_t de_garbled_ix = (perm_y<<1)|perm_x; // wire1+2*wire2
+// the key is zero_key ^ bit*R, up to the lsb in privacy-free garbling,
+// which is the bit itself
+template <size_t KB, bool PF>
+__m128i evl_inp_b(garbled_circuit_t &cct, uint32_t evl_inp_ix)
+{
+	uint8_t bit = cct.m_evl_inp.get_ith_bit(evl_inp_ix);
 
-			// encrypt the 0-th entry : (X[x], Y[y])
-			aes_key[0] = _mm_load_si128(X+perm_x);
-			aes_key[1] = _mm_load_si128(Y+perm_y);
+	ot_wait(cct);
+	__m128i key = load_key<KB>(&(*cct.m_ot_keys)[evl_inp_ix][0]);
 
-			KDF256((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)aes_key);
-			aes_ciphertext = _mm_and_si128(aes_ciphertext, cct.m_clear_mask); // clear extra bits so that only k bits left
-			//bit = current_gate.m_table[de_garbled_ix];
-			bit = (current_gate->truth_table>>(3-de_garbled_ix))&0x01;
+	cct.m_evl_inp_ix++;
+	return PF? _mm_or_si128(_mm_andnot_si128(PF_ONE, key), _mm_cvtsi32_si128(bit)) : key;
+}
+
+// counterpart of gen_garble(): in holds the gate's message
+template <size_t KB, bool PF>
+__m128i evl_garble(const garbled_circuit_t &cct, uint8_t table, uint32_t tag, uint64_t gate_ix,
+	const __m128i &X, const __m128i &Y, const uint8_t *in, uint8_t &out_bit)
+{
+	if (PF)
+	{
+		__m128i current_key = pf_evl_garble<KB>(cct, table, gate_ix, X, Y, in);
+		if (is_output(tag)) out_bit = _mm_extract_epi8(current_key, 0) & 0x01;
+		return current_key;
+	}
+
+	__m128i current_key;
+
+	if (is_free(table))
+	{
+		current_key = _mm_xor_si128(X, Y);
+	}
+	else
+	{
+		__m128i aes_key[2], aes_plaintext, aes_ciphertext;
+
+		aes_plaintext = _mm_set1_epi64x(gate_ix);
+
+		aes_key[0] = X;
+		aes_key[1] = Y;
+
+		const uint8_t perm_x = _mm_extract_epi8(aes_key[0], 0) & 0x01;
+		const uint8_t perm_y = _mm_extract_epi8(aes_key[1], 0) & 0x01;
+
+		KDF256((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)aes_key);
+		aes_ciphertext = clear_key<KB>(cct, aes_ciphertext);
+		uint8_t garbled_ix = (perm_y<<1)|perm_x;
 
 #ifdef GRR
-			// GRR technique: using zero entry's key as one of the output keys
-			_mm_store_si128(Z+bit, aes_ciphertext);
-			Z[1-bit] = _mm_xor_si128(Z[bit], cct.m_R);
-			current_zero_key = _mm_load_si128(Z);
+		if (garbled_ix == 0)
+		{
+			current_key = _mm_load_si128(&aes_ciphertext);
+		}
+		else
+		{
+			current_key = _mm_xor_si128(aes_ciphertext, load_key<KB>(in+(garbled_ix-1)*key_bytes<KB>()));
+		}
+		in += 3*key_bytes<KB>();
 #else
-			tmp = cct.m_prng.rand(Env::k());
-			tmp.resize(16, 0);
-			Z[0] = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
-			Z[1] = _mm_xor_si128(Z[0], cct.m_R);
-
-			aes_ciphertext = _mm_xor_si128(aes_ciphertext, Z[bit]);
-			_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), aes_ciphertext);
-			cct.m_o_bufr.insert(cct.m_o_bufr.end(), tmp.begin(), tmp.begin()+Env::key_size_in_bytes());
+		current_key = _mm_xor_si128(aes_ciphertext, load_key<KB>(in+garbled_ix*key_bytes<KB>()));
+		in += 4*key_bytes<KB>();
 #endif
+	}
 
-			// encrypt the 1st entry : (X[1-x], Y[y])
-			aes_key[0] = _mm_xor_si128(aes_key[0], cct.m_R);
-
-			KDF256((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)aes_key);
-			aes_ciphertext = _mm_and_si128(aes_ciphertext, cct.m_clear_mask);
-			//bit = current_gate.m_table[0x01^de_garbled_ix];
-			bit = (current_gate->truth_table>>(3-(0x01^de_garbled_ix)))&0x01;
-			aes_ciphertext = _mm_xor_si128(aes_ciphertext, Z[bit]);
-			_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), aes_ciphertext);
-			cct.m_o_bufr.insert(cct.m_o_bufr.end(), tmp.begin(), tmp.begin()+Env::key_size_in_bytes());
-
-			// encrypt the 2nd entry : (X[x], Y[1-y])
-			aes_key[0] = _mm_xor_si128(aes_key[0], cct.m_R);
-			aes_key[1] = _mm_xor_si128(aes_key[1], cct.m_R);
-
-			KDF256((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)aes_key);
-			aes_ciphertext = _mm_and_si128(aes_ciphertext, cct.m_clear_mask);
-			//bit = current_gate.m_table[0x02^de_garbled_ix];
-			bit = (current_gate->truth_table>>(3-(0x02^de_garbled_ix)))&0x01;
-			aes_ciphertext = _mm_xor_si128(aes_ciphertext, Z[bit]);
-			_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), aes_ciphertext);
-			cct.m_o_bufr.insert(cct.m_o_bufr.end(), tmp.begin(), tmp.begin()+Env::key_size_in_bytes());
-
-			// encrypt the 3rd entry : (X[1-x], Y[1-y])
-			aes_key[0] = _mm_xor_si128(aes_key[0], cct.m_R);
-
-			KDF256((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)aes_key);
-			aes_ciphertext = _mm_and_si128(aes_ciphertext, cct.m_clear_mask);
-			//bit = current_gate.m_table[0x03^de_garbled_ix];
-			bit = (current_gate->truth_table>>(3-(0x03^de_garbled_ix)))&0x01;
-			aes_ciphertext = _mm_xor_si128(aes_ciphertext, Z[bit]);
-			_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), aes_ciphertext);
-			cct.m_o_bufr.insert(cct.m_o_bufr.end(), tmp.begin(), tmp.begin()+Env::key_size_in_bytes());
+	if (is_output(tag))
+	{
+		//assert(*in < 2);
+		out_bit = (_mm_extract_epi8(current_key, 0) & 0x01) ^ *in;
+	}
+
+	return current_key;
+}
+
+void set_output(garbled_circuit_t &cct, uint32_t tag, uint8_t out_bit)
+{
+	if (tag == TAG_OUTPUT_A)
+	{
+		if (cct.m_gen_out.size()*8 <= cct.m_gen_out_ix)
+		{
+			// dynamically grown output array
+			cct.m_gen_out.resize((cct.m_gen_out.size()+1)*2, 0);
 		}
+		cct.m_gen_out.set_ith_bit(cct.m_gen_out_ix, out_bit);
+		cct.m_gen_out_ix++;
+	}
+	else if (tag == TAG_OUTPUT_B)
+	{
+		if (cct.m_evl_out.size()*8 <= cct.m_evl_out_ix)
+		{
+			// dynamically grown output array
+			cct.m_evl_out.resize((cct.m_evl_out.size()+1)*2, 0);
+		}
+		cct.m_evl_out.set_ith_bit(cct.m_evl_out_ix, out_bit);
+		cct.m_evl_out_ix++;
+	}
+}
+
+template <size_t KB, bool PF>
+void *gen_gate(garbled_circuit_t &cct, struct PCFState *st, struct PCFGate *current_gate)
+{
+	if (current_gate->tag == TAG_INPUT_A)
+	{
+		cct.m_current_key = gen_inp_a<KB, PF>(cct, current_gate->wire1, bufr_grow(cct.m_o_bufr, inp_a_bufr_size<KB>(cct)));
+	}
+	else if (current_gate->tag == TAG_INPUT_B)
+	{
+		cct.m_current_key = gen_inp_b<KB, PF>(cct, current_gate->wire1);
+	}
+	else
+	{
+		__m128i Z0 = _mm_setzero_si128();
+#ifndef GRR
+		if (!PF && !is_free(current_gate->truth_table)) Z0 = rand_key<KB>(cct);
+#endif
+		uint8_t *out = bufr_grow(cct.m_o_bufr, gate_bufr_size<KB, PF>(current_gate->truth_table, current_gate->tag));
+
+		cct.m_current_key = gen_garble<KB, PF>
+		(
+			cct, current_gate->truth_table, current_gate->tag, cct.m_gate_ix,
+			*reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1)),
+			*reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2)),
+			Z0, out
+		);
 
 		if (current_gate->tag == TAG_OUTPUT_A)
 		{
-			cct.m_o_bufr.push_back(_mm_extract_epi8(current_zero_key, 0) & 0x01); // permutation bit
 			cct.m_gen_out_ix++;
 		}
 		else if (current_gate->tag == TAG_OUTPUT_B)
 		{
-			cct.m_o_bufr.push_back(_mm_extract_epi8(current_zero_key, 0) & 0x01); // permutation bit
 			cct.m_evl_out_ix++;
 		}
 	}
 
 	cct.m_gate_ix++;
-	return &current_zero_key;
+	return &cct.m_current_key;
+}
+
+template <size_t KB, bool PF>
+void *evl_gate(garbled_circuit_t &cct, struct PCFState *st, struct PCFGate *current_gate)
+{
+	if (current_gate->tag == TAG_INPUT_A)
+	{
+		const uint8_t *in = frame_take(cct, inp_a_bufr_size<KB>(cct));
+		cct.m_current_key = evl_inp_a<KB>(cct, current_gate->wire1, in);
+	}
+	else if (current_gate->tag == TAG_INPUT_B)
+	{
+		cct.m_current_key = evl_inp_b<KB, PF>(cct, current_gate->wire1);
+	}
+	else
+	{
+		uint8_t out_bit = 0;
+		const uint8_t *in = frame_take(cct, gate_bufr_size<KB, PF>(current_gate->truth_table, current_gate->tag));
+
+		cct.m_current_key = evl_garble<KB, PF>
+		(
+			cct, current_gate->truth_table, current_gate->tag, cct.m_gate_ix,
+			*reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1)),
+			*reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2)),
+			in, out_bit
+		);
+
+		set_output(cct, current_gate->tag, out_bit);
+	}
+
+	cct.m_gate_ix++;
+
+	return &cct.m_current_key;
+}
+
+};
+
+void *gen_next_gate(struct PCFState *st, struct PCFGate *current_gate)
+{
+	garbled_circuit_t &cct =
+		*reinterpret_cast<garbled_circuit_t*>(get_external_state(st));
+
+	return cct.m_kernels->gen_gate(cct, st, current_gate);
 }
 
 void * evl_next_gate(struct PCFState *st, struct PCFGate *current_gate)
 {
 	garbled_circuit_t &cct = *reinterpret_cast<garbled_circuit_t*>(get_external_state(st));
 
-	static __m128i current_key;
-	__m128i a;
-	static Bytes tmp;
+	return cct.m_kernels->evl_gate(cct, st, current_gate);
+}
 
-	if (current_gate->tag == TAG_INPUT_A)
-	{
-		Bytes::const_iterator it = cct.m_i_bufr_ix;
-		tmp.assign(it, it+Env::key_size_in_bytes());
-		tmp.resize(16, 0);
-		current_key = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
+//
+// Deferred mode. The PCF interpreter runs ahead of the cryptography: the
+// keys it copies around are handles into cct.m_slots, and every gate is
+// only recorded together with the depth of its output wire. Input gates
+// are handled on the spot, as they draw from the PRNG or need the OT keys.
+// A flush then processes the recorded gates one depth level at a time,
+// with the gates of a level spread over the thread pool. Messages are
+// written to precomputed offsets, so the stream is byte-for-byte the one
+// the serial callbacks produce.
+//
 
-		cct.m_gen_inp_ix++;
-	}
-	else if (current_gate->tag == TAG_INPUT_B)
+namespace
+{
+
+inline uint32_t slot_of(void *key)
+{
+	return _mm_cvtsi128_si32(*reinterpret_cast<__m128i*>(key));
+}
+
+inline void set_slot(void *key, uint32_t slot)
+{
+	*reinterpret_cast<__m128i*>(key) = _mm_cvtsi32_si128(slot);
+}
+
+inline uint32_t slot_cnt(const Bytes &slots)
+{
+	return slots.size() / sizeof(__m128i);
+}
+
+inline __m128i load_slot(const Bytes &slots, uint32_t slot)
+{
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(&slots[0] + slot*sizeof(__m128i)));
+}
+
+inline void store_slot(Bytes &slots, uint32_t slot, const __m128i &key)
+{
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(&slots[0] + slot*sizeof(__m128i)), key);
+}
+
+inline void push_slot(Bytes &slots, const __m128i &key)
+{
+	uint32_t slot = slot_cnt(slots);
+	slots.resize(slots.size() + sizeof(__m128i));
+	store_slot(slots, slot, key);
+}
+
+void *record_gate(garbled_circuit_t &cct, deferred_gate_t &gate, const __m128i &key, uint32_t depth)
+{
+	gate.m_z = slot_cnt(cct.m_slots);
+
+	push_slot(cct.m_slots, key);
+	cct.m_depth.push_back(depth);
+	cct.m_gates.push_back(gate);
+
+	cct.m_gate_ix++;
+
+	cct.m_current_key = _mm_cvtsi32_si128(gate.m_z);
+	return &cct.m_current_key;
+}
+
+deferred_gate_t new_gate(garbled_circuit_t &cct, struct PCFState *st, struct PCFGate *current_gate, uint32_t &depth)
+{
+	deferred_gate_t gate;
+
+	gate.m_gate_ix = cct.m_gate_ix;
+	gate.m_ofs     = cct.m_seg_bufr.size();
+	gate.m_tag     = current_gate->tag;
+	gate.m_table   = current_gate->truth_table;
+	gate.m_out_bit = 0;
+	gate.m_x = gate.m_y = 0;
+
+	depth = 0; // inputs are ready right away
+	if (current_gate->tag != TAG_INPUT_A && current_gate->tag != TAG_INPUT_B)
 	{
-		uint32_t evl_inp_ix = current_gate->wire1;
+		gate.m_x = slot_of(get_wire_key(st, current_gate->wire1));
+		gate.m_y = slot_of(get_wire_key(st, current_gate->wire2));
+		depth = std::max(cct.m_depth[gate.m_x], cct.m_depth[gate.m_y]) + 1;
+	}
 
-		uint8_t bit = cct.m_evl_inp.get_ith_bit(evl_inp_ix);
-		Bytes::const_iterator it = cct.m_i_bufr_ix + bit*Env::key_size_in_bytes();
+	return gate;
+}
+
+struct level_t
+{
+	garbled_circuit_t *cct;
+	const uint32_t    *order;
+};
 
-		tmp = (*cct.m_ot_keys)[evl_inp_ix];
-		tmp.resize(16, 0);
-		current_key = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
+template <size_t KB, bool PF>
+void gen_level(void *arg, size_t begin, size_t end)
+{
+	level_t &level = *reinterpret_cast<level_t*>(arg);
+	garbled_circuit_t &cct = *level.cct;
 
-		tmp.assign(it, it+Env::key_size_in_bytes());
-		tmp.resize(16, 0);
-		a = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
+	for (size_t ix = begin; ix < end; ix++)
+	{
+		const deferred_gate_t &gate = cct.m_gates[level.order[ix]];
+		store_slot(cct.m_slots, gate.m_z, gen_garble<KB, PF>
+		(
+			cct, gate.m_table, gate.m_tag, gate.m_gate_ix,
+			load_slot(cct.m_slots, gate.m_x), load_slot(cct.m_slots, gate.m_y), load_slot(cct.m_slots, gate.m_z),
+			bufr_at(cct.m_seg_bufr, gate.m_ofs)
+		));
+	}
+}
 
-		current_key = _mm_xor_si128(current_key, a);
+template <size_t KB, bool PF>
+void evl_level(void *arg, size_t begin, size_t end)
+{
+	level_t &level = *reinterpret_cast<level_t*>(arg);
+	garbled_circuit_t &cct = *level.cct;
 
-		cct.m_i_bufr_ix += Env::key_size_in_bytes()*2;
-		cct.m_evl_inp_ix++;
+	for (size_t ix = begin; ix < end; ix++)
+	{
+		deferred_gate_t &gate = cct.m_gates[level.order[ix]];
+		store_slot(cct.m_slots, gate.m_z, evl_garble<KB, PF>
+		(
+			cct, gate.m_table, gate.m_tag, gate.m_gate_ix,
+			load_slot(cct.m_slots, gate.m_x), load_slot(cct.m_slots, gate.m_y),
+			bufr_at(cct.m_seg_bufr, gate.m_ofs), gate.m_out_bit
+		));
 	}
-	else
+}
+
+// bucket the pending gates by depth and run the buckets in increasing order
+void run_levels(garbled_circuit_t &cct, ThreadPool::task_t task)
+{
+	std::vector<uint32_t> start(1, 0);
+
+	for (size_t ix = 0; ix < cct.m_gates.size(); ix++)
 	{
-#ifdef FREE_XOR
-		if (current_gate->truth_table == 0x06)
-		{
-			current_key = _mm_xor_si128
-			(
-				*reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1)),
-				*reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2))
-			);
-		}
-		else
-#endif
-		{
-			__m128i aes_key[2], aes_plaintext, aes_ciphertext;
+		uint32_t depth = cct.m_depth[cct.m_gates[ix].m_z];
+		if (depth == 0) continue;
+		if (start.size() <= depth+1) start.resize(depth+2, 0);
+		start[depth+1]++;
+	}
 
-			aes_plaintext = _mm_set1_epi64x(cct.m_gate_ix);
+	for (size_t ix = 1; ix < start.size(); ix++)
+		start[ix] += start[ix-1];
 
-			aes_key[0] = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1));
-			aes_key[1] = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2));
+	cct.m_order.resize(start.back());
 
-			const uint8_t perm_x = _mm_extract_epi8(aes_key[0], 0) & 0x01;
-			const uint8_t perm_y = _mm_extract_epi8(aes_key[1], 0) & 0x01;
+	std::vector<uint32_t> next(start);
+	for (size_t ix = 0; ix < cct.m_gates.size(); ix++)
+	{
+		uint32_t depth = cct.m_depth[cct.m_gates[ix].m_z];
+		if (depth == 0) continue;
+		cct.m_order[next[depth]++] = ix;
+	}
 
-			KDF256((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)aes_key);
-			aes_ciphertext = _mm_and_si128(aes_ciphertext, cct.m_clear_mask);
-			uint8_t garbled_ix = (perm_y<<1)|perm_x;
+	for (size_t depth = 1; depth+1 < start.size(); depth++)
+	{
+		level_t level = { &cct, &cct.m_order[0] + start[depth] };
+		cct.m_pool->parallel_for(start[depth+1]-start[depth], DEFER_GRAIN, task, &level);
+	}
+}
 
-#ifdef GRR
-			if (garbled_ix == 0)
-			{
-				current_key = _mm_load_si128(&aes_ciphertext);
-			}
-			else
-			{
-				Bytes::const_iterator it = cct.m_i_bufr_ix+(garbled_ix-1)*Env::key_size_in_bytes();
-				tmp.assign(it, it+Env::key_size_in_bytes());
-				tmp.resize(16, 0);
-				a = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
-				current_key = _mm_xor_si128(aes_ciphertext, a);
-			}
-			cct.m_i_bufr_ix += 3*Env::key_size_in_bytes();
-#else
-			it = cct.m_i_bufr_ix + garbled_ix*Env::key_size_in_bytes();
-			tmp.assign(it, it+Env::key_size_in_bytes());
-			tmp.resize(16, 0);
-			current_key = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
-			current_key = _mm_xor_si128(current_key, aes_ciphertext);
+template <size_t KB, bool PF>
+void *gen_defer(garbled_circuit_t &cct, struct PCFState *st, struct PCFGate *current_gate)
+{
+	uint32_t depth;
+	deferred_gate_t gate = new_gate(cct, st, current_gate, depth);
+	__m128i key = _mm_setzero_si128();
 
-			cct.m_i_bufr_ix += 4*Env::key_size_in_bytes();
+	if (current_gate->tag == TAG_INPUT_A)
+	{
+		key = gen_inp_a<KB, PF>(cct, current_gate->wire1, bufr_grow(cct.m_seg_bufr, inp_a_bufr_size<KB>(cct)));
+	}
+	else if (current_gate->tag == TAG_INPUT_B)
+	{
+		key = gen_inp_b<KB, PF>(cct, current_gate->wire1);
+	}
+	else
+	{
+#ifndef GRR
+		if (!PF && !is_free(current_gate->truth_table)) key = rand_key<KB>(cct); // keep the PRNG in gate order
 #endif
-		}
+		bufr_grow(cct.m_seg_bufr, gate_bufr_size<KB, PF>(current_gate->truth_table, current_gate->tag));
 
 		if (current_gate->tag == TAG_OUTPUT_A)
 		{
-			if (cct.m_gen_out.size()*8 <= cct.m_gen_out_ix)
-			{
-				// dynamically grown output array
-				cct.m_gen_out.resize((cct.m_gen_out.size()+1)*2, 0);
-			}
-                        //assert(*cct.m_i_bufr_ix < 2);
-			uint8_t out_bit = _mm_extract_epi8(current_key, 0) & 0x01;
-			out_bit ^= *cct.m_i_bufr_ix;
-			cct.m_gen_out.set_ith_bit(cct.m_gen_out_ix, out_bit);
-			cct.m_i_bufr_ix++;
-
 			cct.m_gen_out_ix++;
 		}
 		else if (current_gate->tag == TAG_OUTPUT_B)
 		{
-			if (cct.m_evl_out.size()*8 <= cct.m_evl_out_ix)
-			{
-				// dynamically grown output array
-				cct.m_evl_out.resize((cct.m_evl_out.size()+1)*2, 0);
-			}
+			cct.m_evl_out_ix++;
+		}
+	}
 
-			uint8_t out_bit = _mm_extract_epi8(current_key, 0) & 0x01;
-			out_bit ^= *cct.m_i_bufr_ix;
-			cct.m_evl_out.set_ith_bit(cct.m_evl_out_ix, out_bit);
-			cct.m_i_bufr_ix++;
+	return record_gate(cct, gate, key, depth);
+}
 
-			cct.m_evl_out_ix++;
+template <size_t KB, bool PF>
+void *evl_defer(garbled_circuit_t &cct, struct PCFState *st, struct PCFGate *current_gate)
+{
+	uint32_t depth;
+	deferred_gate_t gate = new_gate(cct, st, current_gate, depth);
+	__m128i key = _mm_setzero_si128();
+
+	if (current_gate->tag == TAG_INPUT_A)
+	{
+		key = evl_inp_a<KB>(cct, current_gate->wire1, frame_take(cct, inp_a_bufr_size<KB>(cct)));
+	}
+	else if (current_gate->tag == TAG_INPUT_B)
+	{
+		key = evl_inp_b<KB, PF>(cct, current_gate->wire1);
+	}
+	else
+	{
+		const size_t n = gate_bufr_size<KB, PF>(current_gate->truth_table, current_gate->tag);
+		const uint8_t *in = frame_take(cct, n);
+		cct.m_seg_bufr.insert(cct.m_seg_bufr.end(), in, in+n);
+	}
+
+	return record_gate(cct, gate, key, depth);
+}
+
+};
+
+namespace
+{
+
+#define KERNELS(KB, PF) \
+	{ gen_gate<KB, PF>, evl_gate<KB, PF>, gen_defer<KB, PF>, evl_defer<KB, PF>, gen_level<KB, PF>, evl_level<KB, PF> }
+
+const gate_kernels_t KERNELS_80     = KERNELS(10, false);
+const gate_kernels_t KERNELS_128    = KERNELS(16, false);
+const gate_kernels_t KERNELS_ANY    = KERNELS(0,  false);
+
+const gate_kernels_t KERNELS_80_PF  = KERNELS(10, true);
+const gate_kernels_t KERNELS_128_PF = KERNELS(16, true);
+const gate_kernels_t KERNELS_ANY_PF = KERNELS(0,  true);
+
+#undef KERNELS
+
+const gate_kernels_t *kernels_for(size_t k, bool privacy_free)
+{
+	switch (k)
+	{
+	case 80:  return privacy_free? &KERNELS_80_PF  : &KERNELS_80;
+	case 128: return privacy_free? &KERNELS_128_PF : &KERNELS_128;
+	default:  return privacy_free? &KERNELS_ANY_PF : &KERNELS_ANY;
+	}
+}
+
+};
+
+void defer_init(garbled_circuit_t &cct, ThreadPool *pool)
+{
+	cct.m_pool = pool;
+
+	cct.m_slots.clear();
+	cct.m_depth.clear();
+	cct.m_gates.clear();
+	cct.m_gates.reserve(DEFER_SEGMENT_SIZE);
+	cct.m_seg_bufr.clear();
+
+	// slots 0 and 1 hold the keys for constant 0 and 1
+	for (uint32_t c = 0; c < 2; c++)
+	{
+		push_slot(cct.m_slots, cct.m_const_wire[c]);
+		cct.m_depth.push_back(0);
+		cct.m_const_handle[c] = _mm_cvtsi32_si128(c);
+	}
+}
+
+bool defer_full(const garbled_circuit_t &cct)
+{
+	return cct.m_gates.size() >= DEFER_SEGMENT_SIZE;
+}
+
+// Drop a flushed segment and renumber the slots still held by the
+// interpreter, so that m_slots stays bounded by the size of the wire table.
+// Must not be called after get_next_gate() returned 0 (the wires are gone).
+void defer_compact(garbled_circuit_t &cct)
+{
+	struct PCFState *st = cct.m_st;
+	const uint32_t NONE = UINT32_MAX;
+
+	std::vector<uint32_t> remap(slot_cnt(cct.m_slots), NONE);
+	Bytes slots;
+
+	for (uint32_t ix = 0; ix < 2 + PCF_WIRE_TABLE_SIZE; ix++)
+	{
+		void *key = ix < 2? st->constant_keys[ix] : st->wires[ix-2].keydata;
+		if (key == 0) continue;
+
+		uint32_t slot = slot_of(key);
+		if (remap[slot] == NONE)
+		{
+			remap[slot] = slot_cnt(slots);
+			push_slot(slots, load_slot(cct.m_slots, slot));
 		}
+		set_slot(key, remap[slot]);
 	}
 
-	update_hash(cct, cct.m_i_bufr);
-	cct.m_gate_ix++;
+	cct.m_slots.swap(slots);
+	cct.m_depth.assign(slot_cnt(cct.m_slots), 0);
+	cct.m_gates.clear();
+	cct.m_seg_bufr.clear();
+}
 
-	return &current_key;
+void gen_flush(garbled_circuit_t &cct)
+{
+	run_levels(cct, cct.m_kernels->gen_level);
+}
+
+void evl_flush(garbled_circuit_t &cct)
+{
+	run_levels(cct, cct.m_kernels->evl_level);
+
+	for (size_t ix = 0; ix < cct.m_gates.size(); ix++)
+	{
+		set_output(cct, cct.m_gates[ix].m_tag, cct.m_gates[ix].m_out_bit);
+	}
+}
+
+bool defer_frame(garbled_circuit_t &cct, size_t &ix, size_t n)
+{
+	const size_t cnt = cct.m_gates.size();
+	const size_t from = ix < cnt? cct.m_gates[ix].m_ofs : cct.m_seg_bufr.size();
+
+	size_t to = from;
+	while (ix < cnt && cct.m_o_bufr.size() + (to-from) < n)
+	{
+		ix++;
+		to = ix < cnt? cct.m_gates[ix].m_ofs : cct.m_seg_bufr.size();
+	}
+
+	Bytes::const_iterator it = cct.m_seg_bufr.begin();
+	cct.m_o_bufr.insert(cct.m_o_bufr.end(), it+from, it+to);
+
+	return frame_full(cct, n);
+}
+
+void *gen_defer_gate(struct PCFState *st, struct PCFGate *current_gate)
+{
+	garbled_circuit_t &cct = *reinterpret_cast<garbled_circuit_t*>(get_external_state(st));
+
+	return cct.m_kernels->gen_defer(cct, st, current_gate);
 }
 
+void *evl_defer_gate(struct PCFState *st, struct PCFGate *current_gate)
+{
+	garbled_circuit_t &cct = *reinterpret_cast<garbled_circuit_t*>(get_external_state(st));
+
+	return cct.m_kernels->evl_defer(cct, st, current_gate);
+}
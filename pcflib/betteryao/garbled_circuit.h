@@ -6,19 +6,44 @@
 #include "Env.h"
 #include "Prng.h"
 #include "Hash.h"
+#include "ThreadPool.h"
 
 extern "C" {
 #include "pcflib.h"
 }
 
+// a gate whose garbling/evaluation is postponed until its segment is flushed
 typedef struct
 {
-	Bytes               m_bufr;
-	Hash                m_hash;
+	uint64_t            m_gate_ix;
+	uint32_t            m_x, m_y, m_z;   // key slots of wire1, wire2 and reswire
+	uint32_t            m_ofs;           // where its message starts in m_seg_bufr
+	uint32_t            m_tag;
+	uint8_t             m_table;
+	uint8_t             m_out_bit;
+}
+deferred_gate_t;
+
+struct gate_kernels_t; // the gate code instantiated for one label width
+
+typedef struct
+{
+	CircuitHash         m_hash;          // over the received messages, as they arrive
 
 	__m128i             m_R;
 
 	const std::vector<Bytes>  *m_ot_keys;
+	pthread_t                 *m_ot_thread;  // still making m_ot_keys, if not 0
+
+	// sends the generator's frame so far, if set, before its input gates
+	// wait for m_ot_thread
+	void                     (*m_o_flush)(void *arg);
+	void                      *m_o_flush_arg;
+
+	// the generator's zero-keys or the evaluator's keys of the generator's
+	// inputs, for a circuit garbled before they are known; its input gates
+	// then carry nothing
+	const std::vector<Bytes>  *m_gen_inp_keys;
 
 	Prng                m_prng;
 
@@ -30,6 +55,7 @@ typedef struct
 	uint32_t            m_evl_out_ix;
 
 	__m128i             m_clear_mask;
+	const gate_kernels_t *m_kernels;
 
 	Bytes               m_gen_inp_mask;
 	Bytes               m_gen_inp;
@@ -37,17 +63,49 @@ typedef struct
 	Bytes               m_gen_out;
 	Bytes               m_evl_out;
 
-	Bytes               m_o_bufr;
-	Bytes               m_i_bufr;
-	Bytes::iterator     m_i_bufr_ix;
+	Bytes               m_o_bufr;        // the frame the generator builds up
+	Bytes               m_i_bufr;        // the frame the evaluator has received last
+	Bytes::iterator     m_i_bufr_ix;     // where the gate at hand reads from it
 
 	struct PCFState    *m_st;
 	__m128i             m_const_wire[2]; // keys for constant 0 and 1
+	__m128i             m_current_key;   // returned to the PCF interpreter
+
+	// deferred mode: the interpreter only sees slot handles, and gates are
+	// garbled/evaluated level by level on m_pool when a segment is flushed
+	ThreadPool                   *m_pool;
+	Bytes                         m_slots;         // one key per 16 bytes
+	std::vector<uint32_t>         m_depth;
+	std::vector<deferred_gate_t>  m_gates;
+	std::vector<uint32_t>         m_order;
+	Bytes                         m_seg_bufr;
+	__m128i                       m_const_handle[2];
 }
 garbled_circuit_t;
 
-void gen_init(garbled_circuit_t &cct, const std::vector<Bytes> &keys, const Bytes &gen_inp_mask, const Bytes &seed);
-void evl_init(garbled_circuit_t &cct, const std::vector<Bytes> &keys, const Bytes &masked_gen_inp, const Bytes &seed);
+// The evaluator's input keys come out of a correlated OT whose correlation
+// is R: keys[ix] is the zero-key of its input ix on the generator's side and
+// the key of its input bit on its own, so input gates of the evaluator send
+// nothing. delta is R as the OT has made it (bit 0 is forced to 1), or empty
+// to draw R from seed and correlate random OTs with gen_cot_fix(). privacy_free
+// picks the one-ciphertext garbling that shows the evaluator every wire value.
+void gen_init(garbled_circuit_t &cct, const std::vector<Bytes> &keys, const Bytes &gen_inp_mask, const Bytes &seed, const Bytes &delta, bool privacy_free = false);
+void evl_init(garbled_circuit_t &cct, const std::vector<Bytes> &keys, const Bytes &masked_gen_inp, const Bytes &seed, bool privacy_free = false);
+
+// generator, after gen_init(): keys holds both keys of every random OT and
+// is cut down to the first of each, the zero-keys; returns k0 ^ k1 ^ R for
+// every OT, one key each, for the evaluator
+Bytes gen_cot_fix(const garbled_circuit_t &cct, std::vector<Bytes> &keys);
+
+// evaluator, after evl_init(): xors those into the keys its 1-bits chose
+void evl_cot_fix(const garbled_circuit_t &cct, const Bytes &fix, std::vector<Bytes> &keys);
+
+// generator, after gen_init(): the keys of bits on the wires with zero_keys,
+// one key each
+Bytes gen_inp_keys(const garbled_circuit_t &cct, const std::vector<Bytes> &zero_keys, const Bytes &bits);
+
+// join m_ot_thread, if any; input gates of the evaluator do it themselves
+void ot_wait(garbled_circuit_t &cct);
 
 inline void trim_output(garbled_circuit_t &cct)
 {
@@ -55,21 +113,52 @@ inline void trim_output(garbled_circuit_t &cct)
 	cct.m_evl_out.resize((cct.m_evl_out_ix+7)/8);
 }
 
-inline void recv(garbled_circuit_t &cct, const Bytes &i_data)
+//
+// The gates go over the wire in frames of many gates, never splitting one,
+// rather than one message per gate: the generator's gates build up in
+// m_o_bufr, which goes out once it holds n bytes or more, and the evaluator
+// decodes them in place from m_i_bufr. An empty frame ends the circuit, and
+// the gates after the last one carry nothing. The two parties swap buffers
+// with the caller's, so that the storage of a frame is reused for the next.
+//
+
+inline bool frame_full(const garbled_circuit_t &cct, size_t n)
+{
+	return !cct.m_o_bufr.empty() && cct.m_o_bufr.size() >= n;
+}
+
+// the frame built up so far, in exchange for the storage of the last one
+inline void send(garbled_circuit_t &cct, Bytes &frame)
 {
-	cct.m_i_bufr.clear();
-	cct.m_i_bufr += i_data;
-        //assert(cct.m_i_bufr.size() > 0);
+	frame.swap(cct.m_o_bufr);
+	cct.m_o_bufr.clear();
+}
+
+inline void recv(garbled_circuit_t &cct, Bytes &frame)
+{
+	cct.m_i_bufr.swap(frame);
 	cct.m_i_bufr_ix = cct.m_i_bufr.begin();
+	cct.m_hash.update(cct.m_i_bufr); // every received byte once
 }
 
-inline const Bytes send(garbled_circuit_t &cct)
+// whether gates of the frame received last are still to be evaluated
+inline bool frame_left(const garbled_circuit_t &cct)
 {
-	Bytes o_data;
-	o_data.swap(cct.m_o_bufr);
-	return o_data;
+	return cct.m_i_bufr_ix < cct.m_i_bufr.end();
 }
 
+void defer_init(garbled_circuit_t &cct, ThreadPool *pool);
+bool defer_full(const garbled_circuit_t &cct);
+void defer_compact(garbled_circuit_t &cct);
+
+void gen_flush(garbled_circuit_t &cct);
+void evl_flush(garbled_circuit_t &cct);
+
+// the messages of a flushed segment from its gate ix on go to m_o_bufr,
+// up to the first gate that makes it a full frame of n bytes; false if
+// the segment runs out first
+bool defer_frame(garbled_circuit_t &cct, size_t &ix, size_t n);
+
 #define  _mm_extract_epi8(x, imm) \
 	((((imm) & 0x1) == 0) ?   \
 	_mm_extract_epi16((x), (imm) >> 1) & 0xff : \
@@ -82,7 +171,7 @@ void KDF128(const uint8_t *in, uint8_t *out, const uint8_t *key);
 void KDF256(const uint8_t *in, uint8_t *out, const uint8_t *key);
 
 void set_const_key(garbled_circuit_t &cct, byte c, const Bytes &key);
-const Bytes &get_const_key(garbled_circuit_t &cct, byte c, byte b);
+Bytes get_const_key(garbled_circuit_t &cct, byte c, byte b);
 
 #ifdef __CPLUSPLUS
 extern "C" {
@@ -94,6 +183,9 @@ void delete_key(void *);
 void *gen_next_gate(struct PCFState *st, struct PCFGate *gate);
 void *evl_next_gate(struct PCFState *st, struct PCFGate *gate);
 
+void *gen_defer_gate(struct PCFState *st, struct PCFGate *gate);
+void *evl_defer_gate(struct PCFState *st, struct PCFGate *gate);
+
 #ifdef __CPLUSPLUS
 }
 #endif
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <cstring>
+
 #include "garbled_circuit_m.h"
 
 const Bytes get_const_key(garbled_circuit_m_t &cct, byte c, byte b)
@@ -30,25 +33,88 @@ void set_const_key(garbled_circuit_m_t &cct, byte c, const Bytes &key)
 
 namespace
 {
-const int CIRCUIT_HASH_BUFFER_SIZE = 1024*1024;
 const int MAX_OUTPUT_SIZE = 1024;
 
-void update_hash(garbled_circuit_m_t &cct, const Bytes &data)
+//
+// Both decommitments of every generator input, for its two keys, and their
+// commitments are made up-front over contiguous buffers, so that an input
+// gate only copies its part. Decommitments 2*ix and 2*ix+1 open the keys
+// for the bits mask[ix] and 1-mask[ix] of the ix-th input.
+//
+void gen_inp_commit(garbled_circuit_m_t &cct, uint32_t gen_inp_cnt)
 {
-	cct.m_bufr += data;
+	const size_t len = Env::key_size_in_bytes();
+
+	// zero-key and two nonces per input
+	__m128i *rnd = (__m128i*)_mm_malloc(3*gen_inp_cnt*sizeof(__m128i), sizeof(__m128i));
+	if (gen_inp_cnt > 0) cct.m_prng.fill(rnd, 3*gen_inp_cnt);
+
+	cct.m_gen_inp_decom.resize(2*gen_inp_cnt*decom_size());
+	cct.m_gen_inp_com.resize(2*gen_inp_cnt*len);
+
+	byte *decom = cct.m_gen_inp_decom.begin();
+	for (size_t ix = 0; ix < gen_inp_cnt; ix++)
+	{
+		__m128i a[2], r[2];
+
+		a[0] = _mm_and_si128(rnd[3*ix+0], cct.m_clear_mask);
+		a[1] = _mm_xor_si128(a[0], cct.m_R);
 
-#ifdef RAND_SEED
-	if (cct.m_bufr.size() > CIRCUIT_HASH_BUFFER_SIZE) // hash the circuit by chunks
+		r[0] = _mm_and_si128(rnd[3*ix+1], cct.m_clear_mask);
+		r[1] = _mm_and_si128(rnd[3*ix+2], cct.m_clear_mask);
+
+		uint8_t bit = cct.m_gen_inp_mask.get_ith_bit(ix);
+
+		memcpy(decom, a+bit, len);     decom += len;
+		memcpy(decom, r+0, len);       decom += len;
+		memcpy(decom, a+(1-bit), len); decom += len;
+		memcpy(decom, r+1, len);       decom += len;
+	}
+
+	_mm_free(rnd);
+
+	if (gen_inp_cnt > 0)
 	{
-		cct.m_hash.update(cct.m_bufr);
-		cct.m_bufr.clear();
+		commit(&cct.m_gen_inp_decom[0], &cct.m_gen_inp_com[0], 2*gen_inp_cnt);
 	}
-#endif
+}
+
+inline __m128i load_key(const byte *in)
+{
+	__m128i key = _mm_setzero_si128();
+	memcpy(&key, in, Env::key_size_in_bytes());
+	return key;
 }
 };
 
+// Com(d) = KDF256(COMMIT_TWEAK, d) cut to k bits, where the key and the
+// randomness of d fill a 128-bit half each: AES-256 keyed by d with AES-NI,
+// SHA-256(d) otherwise. No gate index equals the tweak.
+void commit(const byte *decom, byte *com, size_t n)
+{
+	const size_t len = Env::key_size_in_bytes();
+	const __m128i COMMIT_TWEAK = _mm_set1_epi32(-1);
+
+	Bytes mask(16, 0);
+	for (size_t ix = 0; ix < Env::k(); ix++) mask.set_ith_bit(ix, 1);
+	const __m128i clear_mask = _mm_loadu_si128(reinterpret_cast<__m128i*>(&mask[0]));
+
+	__m128i key[2], out;
+	key[0] = key[1] = _mm_setzero_si128();
+
+	for (size_t ix = 0; ix < n; ix++, decom += 2*len, com += len)
+	{
+		memcpy(key+0, decom,     len);
+		memcpy(key+1, decom+len, len);
+
+		KDF256((uint8_t*)&COMMIT_TWEAK, (uint8_t*)&out, (uint8_t*)key);
+		out = _mm_and_si128(out, clear_mask);
+		memcpy(com, &out, len);
+	}
+}
 
-void gen_init(garbled_circuit_m_t &cct, const vector<Bytes> &ot_keys, const Bytes &gen_inp_mask, const Bytes &seed)
+
+void gen_init(garbled_circuit_m_t &cct, const vector<Bytes> &ot_keys, const Bytes &gen_inp_mask, uint32_t gen_inp_cnt, const Bytes &seed)
 {
 	cct.m_ot_keys = &ot_keys;
 	cct.m_gen_inp_mask = gen_inp_mask;
@@ -73,7 +139,9 @@ void gen_init(garbled_circuit_m_t &cct, const vector<Bytes> &ot_keys, const Byte
 
 	init(cct);
 
-	cct.m_gen_inp_decom.clear();
+	cct.m_hash.init(); // over the messages of a hashed check copy
+
+	gen_inp_commit(cct, gen_inp_cnt);
 }
 
 void evl_init(garbled_circuit_m_t &cct, const vector<Bytes> &ot_keys, const Bytes &masked_gen_inp, const Bytes &evl_inp)
@@ -89,81 +157,71 @@ void evl_init(garbled_circuit_m_t &cct, const vector<Bytes> &ot_keys, const Byte
 
 	init(cct);
 
-	cct.m_bufr.reserve(CIRCUIT_HASH_BUFFER_SIZE);
-	cct.m_bufr.clear();
 	cct.m_hash.init();
 
 	cct.m_gen_inp_com.clear();
 	//cct.m_gen_inp_decom.clear();
 }
 
-
-void *gen_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
+void gen_cot_fix(garbled_circuit_m_t &cct)
 {
-	garbled_circuit_m_t &cct =
-		*reinterpret_cast<garbled_circuit_m_t*>(get_external_state(st));
+	const size_t n = cct.m_ot_keys->size()/2, len = Env::key_size_in_bytes();
 
-	static __m128i current_zero_key;
+	const size_t ofs = cct.m_o_bufr.size();
+	cct.m_o_bufr.resize(ofs + n*len);
 
-	if (current_gate->tag == TAG_INPUT_A)
+	for (size_t ix = 0; ix < n; ix++)
 	{
-		__m128i a[2];
+		__m128i fix = _mm_xor_si128(load_key(&(*cct.m_ot_keys)[2*ix+0][0]), load_key(&(*cct.m_ot_keys)[2*ix+1][0]));
+		fix = _mm_xor_si128(fix, cct.m_R);
+		memcpy(&cct.m_o_bufr[ofs + ix*len], &fix, len);
+	}
+}
+
+void evl_cot_fix(garbled_circuit_m_t &cct)
+{
+	assert(cct.m_i_bufr.size() == cct.m_ot_keys->size()*Env::key_size_in_bytes());
+	cct.m_cot_fix = cct.m_i_bufr;
+}
 
-		Bytes tmp = cct.m_prng.rand(Env::k());
-		tmp.resize(16, 0);
-		current_zero_key = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
 
-		uint32_t gen_inp_ix = current_gate->wire1;
+namespace
+{
 
-		a[0] = current_zero_key;
-		a[1] = _mm_xor_si128(current_zero_key, cct.m_R);
+inline bool is_input(const struct PCFGate *gate)
+{
+	return gate->tag == TAG_INPUT_A || gate->tag == TAG_INPUT_B;
+}
 
-		uint8_t bit = cct.m_gen_inp_mask.get_ith_bit(gen_inp_ix);
+//
+// Garbles current_gate for one circuit, where X0 and Y0 are the zero-keys of
+// its input wires (unused for input gates), and appends the gate's message
+// to cct.m_o_bufr. Returns the zero-key of the output wire.
+//
+__m128i gen_gate_m(garbled_circuit_m_t &cct, const struct PCFGate *current_gate, const __m128i &X0, const __m128i &Y0)
+{
+	__m128i current_zero_key;
 
-		assert(cct.m_gen_inp_decom.size() == 2*gen_inp_ix);
+	if (current_gate->tag == TAG_INPUT_A)
+	{
+		const size_t len = Env::key_size_in_bytes();
+		uint32_t gen_inp_ix = current_gate->wire1;
 
-		_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), a[bit]);
-		cct.m_gen_inp_decom.push_back(
-			Bytes(tmp.begin(), tmp.begin()+Env::key_size_in_bytes())+cct.m_prng.rand(Env::k()));
+		assert(cct.m_gen_inp_com.size() >= (2*gen_inp_ix+2)*len);
 
-		_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), a[1-bit]);
-		cct.m_gen_inp_decom.push_back(
-			Bytes(tmp.begin(), tmp.begin()+Env::key_size_in_bytes())+cct.m_prng.rand(Env::k()));
+		// decommitment 2*ix+mask[ix] opens the zero-key, see gen_inp_commit()
+		uint8_t bit = cct.m_gen_inp_mask.get_ith_bit(gen_inp_ix);
+		current_zero_key = load_key(&cct.m_gen_inp_decom[(2*gen_inp_ix+bit)*decom_size()]);
 
-		cct.m_o_bufr += cct.m_gen_inp_decom[2*gen_inp_ix+0].hash(Env::k());
-		cct.m_o_bufr += cct.m_gen_inp_decom[2*gen_inp_ix+1].hash(Env::k());
+		Bytes::const_iterator it = cct.m_gen_inp_com.begin()+2*gen_inp_ix*len;
+		cct.m_o_bufr.insert(cct.m_o_bufr.end(), it, it+2*len);
 
 		cct.m_gen_inp_ix++; // after PCF compiler, this isn't really necessary
 	}
 	else if (current_gate->tag == TAG_INPUT_B)
 	{
-		__m128i a[2];
-
-		Bytes tmp = cct.m_prng.rand(Env::k());
-		tmp.resize(16, 0);
-		current_zero_key = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
-
-		uint32_t evl_inp_ix = current_gate->wire1;
-
-		tmp = (*cct.m_ot_keys)[2*evl_inp_ix+0];
-		tmp.resize(16, 0);
-		a[0] = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
-
-		tmp = (*cct.m_ot_keys)[2*evl_inp_ix+1];
-		tmp.resize(16, 0);
-		a[1] = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
-
-		// a[0] ^= zero_key; a[1] ^= zero_key ^ R;
-		a[0] = _mm_xor_si128(a[0], current_zero_key);
-		a[1] = _mm_xor_si128(a[1], _mm_xor_si128(current_zero_key, cct.m_R));
-
-		// cct.m_o_bufr += a[0];
-		_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), a[0]);
-		cct.m_o_bufr.insert(cct.m_o_bufr.end(), tmp.begin(), tmp.begin()+Env::key_size_in_bytes());
-
-		// cct.m_o_bufr += a[1];
-		_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), a[1]);
-		cct.m_o_bufr.insert(cct.m_o_bufr.end(), tmp.begin(), tmp.begin()+Env::key_size_in_bytes());
+		// the zero-key is the OT's first key, see gen_cot_fix()
+		current_zero_key = load_key(&(*cct.m_ot_keys)[2*current_gate->wire1][0]);
 
 		cct.m_evl_inp_ix++; // after PCF compiler, this isn't really necessary
 	}
@@ -172,11 +230,7 @@ void *gen_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
 #ifdef FREE_XOR
 		if (current_gate->truth_table == 0x06) // if XOR gate
 		{
-			current_zero_key = _mm_xor_si128
-			(
-				*reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1)),
-				*reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2))
-			);
+			current_zero_key = _mm_xor_si128(X0, Y0);
 		}
 		else
 #endif
@@ -184,12 +238,12 @@ void *gen_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
 			uint8_t bit;
 			__m128i aes_key[2], aes_plaintext, aes_ciphertext;
 			__m128i X[2], Y[2], Z[2];
-			static Bytes tmp(16, 0);
+			Bytes tmp(16, 0);
 
 			aes_plaintext = _mm_set1_epi64x(cct.m_gate_ix);
 
-			X[0] = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1));
-			Y[0] = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2));
+			X[0] = X0;
+			Y[0] = Y0;
 
 			X[1] = _mm_xor_si128(X[0], cct.m_R); // X[1] = X[0] ^ R
 			Y[1] = _mm_xor_si128(Y[0], cct.m_R); // Y[1] = Y[0] ^ R
@@ -213,10 +267,10 @@ void *gen_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
 			Z[1-bit] = _mm_xor_si128(Z[bit], cct.m_R);
 			current_zero_key = _mm_load_si128(Z);
 #else
-			tmp = cct.m_prng.rand(Env::k());
-			tmp.resize(16, 0);
-			Z[0] = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
+			cct.m_prng.fill(Z, 1);
+			Z[0] = _mm_and_si128(Z[0], cct.m_clear_mask);
 			Z[1] = _mm_xor_si128(Z[0], cct.m_R);
+			current_zero_key = _mm_load_si128(Z);
 
 			aes_ciphertext = _mm_xor_si128(aes_ciphertext, Z[bit]);
 			_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), aes_ciphertext);
@@ -256,23 +310,8 @@ void *gen_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
 			aes_ciphertext = _mm_xor_si128(aes_ciphertext, Z[bit]);
 			_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), aes_ciphertext);
 			cct.m_o_bufr.insert(cct.m_o_bufr.end(), tmp.begin(), tmp.begin()+Env::key_size_in_bytes());
-
 		}
-/*
-		Bytes tmp(16);
-		__m128i XX;
-		XX = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1));
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), XX);
-std::cerr << " " << current_gate->wire1 << " (" << Bytes(tmp.begin(), tmp.begin()+Env::key_size_in_bytes()).to_hex();
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), _mm_xor_si128(XX, cct.m_R));
-std::cerr << ", " << Bytes(tmp.begin(), tmp.begin()+Env::key_size_in_bytes()).to_hex() << ")";
-
-		XX = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2));
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), XX);
-std::cerr << " " << current_gate->wire2 << " (" << Bytes(tmp.begin(), tmp.begin()+Env::key_size_in_bytes()).to_hex();
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), _mm_xor_si128(XX, cct.m_R));
-std::cerr << ", " << Bytes(tmp.begin(), tmp.begin()+Env::key_size_in_bytes()).to_hex() << ")\t";
-*/
+
 		if (current_gate->tag == TAG_OUTPUT_A)
 		{
 			cct.m_o_bufr.push_back(_mm_extract_epi8(current_zero_key, 0) & 0x01); // permutation bit
@@ -284,39 +323,17 @@ std::cerr << ", " << Bytes(tmp.begin(), tmp.begin()+Env::key_size_in_bytes()).to
 			cct.m_evl_out_ix++;
 		}
 	}
-/*
-{
-switch(current_gate->tag)
-{
-case TAG_INPUT_A:
-std::cerr << "INP_A "; break;
-case TAG_INPUT_B:
-std::cerr << "INP_B "; break;
-case TAG_OUTPUT_A:
-std::cerr << "OUT_A "; break;
-case TAG_OUTPUT_B:
-std::cerr << "OUT_B "; break;
-default:
-std::cerr << "  ETC "; break;
-}
-Bytes tmp(16);
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), current_zero_key);
-std::cerr << cct.m_gate_ix << ": (" << Bytes(tmp.begin(), tmp.begin()+Env::key_size_in_bytes()).to_hex();
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), _mm_xor_si128(current_zero_key, cct.m_R));
-std::cerr << ", " << Bytes(tmp.begin(), tmp.begin()+Env::key_size_in_bytes()).to_hex() << ")" << std::endl;
-}
-*/
+
 	cct.m_gate_ix++;
-	return &current_zero_key;
+	return current_zero_key;
 }
 
-void *evl_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
+// the evaluator's counterpart of gen_gate_m(), reading from cct.m_i_bufr
+__m128i evl_gate_m(garbled_circuit_m_t &cct, const struct PCFGate *current_gate, const __m128i &X, const __m128i &Y)
 {
-	garbled_circuit_m_t &cct = *reinterpret_cast<garbled_circuit_m_t*>(get_external_state(st));
-
-	static __m128i current_key;
+	__m128i current_key;
 	__m128i a;
-	static Bytes tmp;
+	Bytes tmp;
 
 	if (current_gate->tag == TAG_INPUT_A)
 	{
@@ -325,15 +342,12 @@ void *evl_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
 
 		uint32_t gen_inp_ix = current_gate->wire1;
 
-		assert(cct.m_gen_inp_com.size() == gen_inp_ix);
+		assert(cct.m_gen_inp_com.size() == gen_inp_ix*Env::key_size_in_bytes());
 
-		//cct.m_gen_inp_com[gen_inp_ix] = Bytes(it, it+Env::key_size_in_bytes());
-		cct.m_gen_inp_com.push_back(Bytes(it, it+Env::key_size_in_bytes()));
+		cct.m_gen_inp_com.insert(cct.m_gen_inp_com.end(), it, it+Env::key_size_in_bytes());
+		cct.m_i_bufr_ix += 2*Env::key_size_in_bytes();
 
-		it = cct.m_gen_inp_decom[gen_inp_ix].begin();
-		tmp.assign(it, it+Env::key_size_in_bytes());
-		tmp.resize(16, 0);
-		current_key = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
+		current_key = load_key(&cct.m_gen_inp_decom[gen_inp_ix*decom_size()]);
 
 		cct.m_gen_inp_ix++;
 	}
@@ -341,20 +355,14 @@ void *evl_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
 	{
 		uint32_t evl_inp_ix = current_gate->wire1;
 
-		uint8_t bit = cct.m_evl_inp.get_ith_bit(evl_inp_ix);
-		Bytes::const_iterator it = cct.m_i_bufr_ix + bit*Env::key_size_in_bytes();
+		// k0 ^ bit*(k0 ^ k1 ^ R) = k0 ^ bit*R from the key the bit chose
+		current_key = load_key(&(*cct.m_ot_keys)[evl_inp_ix][0]);
 
-		tmp = (*cct.m_ot_keys)[evl_inp_ix];
-		tmp.resize(16, 0);
-		current_key = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
-
-		tmp.assign(it, it+Env::key_size_in_bytes());
-		tmp.resize(16, 0);
-		a = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
-
-		current_key = _mm_xor_si128(current_key, a);
+		if (cct.m_evl_inp.get_ith_bit(evl_inp_ix))
+		{
+			current_key = _mm_xor_si128(current_key, load_key(&cct.m_cot_fix[evl_inp_ix*Env::key_size_in_bytes()]));
+		}
 
-		cct.m_i_bufr_ix += Env::key_size_in_bytes()*2;
 		cct.m_evl_inp_ix++;
 	}
 	else
@@ -362,11 +370,7 @@ void *evl_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
 #ifdef FREE_XOR
 		if (current_gate->truth_table == 0x06)
 		{
-			current_key = _mm_xor_si128
-			(
-				*reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1)),
-				*reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2))
-			);
+			current_key = _mm_xor_si128(X, Y);
 		}
 		else
 #endif
@@ -375,8 +379,8 @@ void *evl_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
 
 			aes_plaintext = _mm_set1_epi64x(cct.m_gate_ix);
 
-			aes_key[0] = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1));
-			aes_key[1] = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2));
+			aes_key[0] = X;
+			aes_key[1] = Y;
 
 			const uint8_t perm_x = _mm_extract_epi8(aes_key[0], 0) & 0x01;
 			const uint8_t perm_y = _mm_extract_epi8(aes_key[1], 0) & 0x01;
@@ -400,7 +404,7 @@ void *evl_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
 			}
 			cct.m_i_bufr_ix += 3*Env::key_size_in_bytes();
 #else
-			it = cct.m_i_bufr_ix + garbled_ix*Env::key_size_in_bytes();
+			Bytes::const_iterator it = cct.m_i_bufr_ix + garbled_ix*Env::key_size_in_bytes();
 			tmp.assign(it, it+Env::key_size_in_bytes());
 			tmp.resize(16, 0);
 			current_key = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
@@ -409,10 +413,6 @@ void *evl_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
 			cct.m_i_bufr_ix += 4*Env::key_size_in_bytes();
 #endif
 		}
-//	_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1)));
-//std::cout << " " << current_gate->wire1 << " " << Bytes(tmp.begin(), tmp.begin()+Env::key_size_in_bytes()).to_hex();
-//	_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2)));
-//std::cout << " " << current_gate->wire2 << " " << Bytes(tmp.begin(), tmp.begin()+Env::key_size_in_bytes()).to_hex() << "\t";
 
 		if (current_gate->tag == TAG_OUTPUT_A)
 		{
@@ -444,115 +444,286 @@ void *evl_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
 			cct.m_evl_out_ix++;
 		}
 	}
-/*
-switch(current_gate->tag)
+
+	cct.m_gate_ix++;
+
+	return current_key;
+}
+
+};
+
+void *gen_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
 {
-case TAG_INPUT_A:
-std::cout << "INP_A "; break;
-case TAG_INPUT_B:
-std::cout << "INP_B "; break;
-case TAG_OUTPUT_A:
-std::cout << "OUT_A "; break;
-case TAG_OUTPUT_B:
-std::cout << "OUT_B "; break;
+	garbled_circuit_m_t &cct =
+		*reinterpret_cast<garbled_circuit_m_t*>(get_external_state(st));
+
+	__m128i X0 = _mm_setzero_si128(), Y0 = _mm_setzero_si128();
+	if (!is_input(current_gate))
+	{
+		X0 = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1));
+		Y0 = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2));
+	}
+
+	cct.m_current_key = gen_gate_m(cct, current_gate, X0, Y0);
+	return &cct.m_current_key;
 }
-	tmp.resize(16);
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), current_key);
-std::cout << cct.m_gate_ix << ": " << Bytes(tmp.begin(), tmp.begin()+Env::key_size_in_bytes()).to_hex() << std::endl;
-*/
-	update_hash(cct, cct.m_i_bufr);
-	cct.m_gate_ix++;
 
-	return &current_key;
+void *evl_next_gate_m(struct PCFState *st, struct PCFGate *current_gate)
+{
+	garbled_circuit_m_t &cct = *reinterpret_cast<garbled_circuit_m_t*>(get_external_state(st));
+
+	__m128i X = _mm_setzero_si128(), Y = _mm_setzero_si128();
+	if (!is_input(current_gate))
+	{
+		X = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1));
+		Y = *reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2));
+	}
+
+	cct.m_current_key = evl_gate_m(cct, current_gate, X, Y);
+	return &cct.m_current_key;
 }
 
-void gen_next_gen_inp_com(garbled_circuit_m_t &cct, const Bytes &row, size_t kx)
+//
+// Multi-copy keys: a count n in the first __m128i, followed by the n keys
+// of a wire, one per circuit copy, back to back.
+//
+
+void *copy_keys_m(void *old_keys)
 {
-	Bytes tmp;
+	__m128i *new_keys = 0;
+	if (old_keys != 0)
+	{
+		const __m128i *keys = reinterpret_cast<__m128i*>(old_keys);
+		const size_t cnt = _mm_cvtsi128_si32(keys[0]) + 1;
 
-	__m128i out_key[2];
-	tmp = cct.m_prng.rand(Env::k());
-	tmp.set_ith_bit(0, 0);
-	tmp.resize(16, 0);
-	out_key[0] = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
-	out_key[1] = _mm_xor_si128(out_key[0], cct.m_R);
+		new_keys = (__m128i*)_mm_malloc(cnt*sizeof(__m128i), sizeof(__m128i));
+		std::copy(keys, keys+cnt, new_keys);
+	}
+	return new_keys;
+}
 
-	assert(cct.m_gen_inp_decom.size() % 2 == 0);
+void delete_keys_m(void *keys)
+{
+	if (keys != 0) _mm_free(keys);
+}
+
+namespace
+{
 
-	Bytes msg(cct.m_gen_inp_decom[0].size());
-	for (size_t jx = 0; jx < cct.m_gen_inp_decom.size()/2; jx++)
+__m128i *new_keys_m(size_t n)
+{
+	__m128i *keys = (__m128i*)_mm_malloc((n+1)*sizeof(__m128i), sizeof(__m128i));
+	keys[0] = _mm_cvtsi32_si128(n);
+	return keys;
+}
+
+};
+
+void copies_init(garbled_copies_m_t &ccts, std::vector<garbled_circuit_m_t> &gcs, const Bytes &chks, bool hash_chks)
+{
+	ccts.m_gcs = &gcs;
+	ccts.m_chks = chks;
+	ccts.m_chks.resize(gcs.size(), 0);
+	ccts.m_hash_chks = hash_chks;
+
+	ccts.m_keys = new_keys_m(gcs.size());
+
+	for (size_t c = 0; c < 2; c++)
 	{
-		if (row.get_ith_bit(jx))
+		ccts.m_const_keys[c] = new_keys_m(gcs.size());
+		for (size_t ix = 0; ix < gcs.size(); ix++)
 		{
-			byte bit = cct.m_gen_inp_mask.get_ith_bit(jx);
-			msg ^= cct.m_gen_inp_decom[2*jx+bit];
+			ccts.m_const_keys[c][ix+1] = gcs[ix].m_const_wire[c];
 		}
 	}
+}
 
-	__m128i in_key[2], aes_plaintext, aes_ciphertext;
+void copies_free(garbled_copies_m_t &ccts)
+{
+	delete_keys_m(ccts.m_keys);
+	delete_keys_m(ccts.m_const_keys[0]);
+	delete_keys_m(ccts.m_const_keys[1]);
 
-	aes_plaintext = _mm_set1_epi64x((uint64_t)kx+10);
+	ccts.m_keys = ccts.m_const_keys[0] = ccts.m_const_keys[1] = 0;
+}
 
-	tmp.assign(msg.begin(), msg.begin()+Env::key_size_in_bytes());
-	tmp.resize(16, 0);
-	in_key[0] = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
-	in_key[1] = _mm_xor_si128(in_key[0], cct.m_R);
+void *gen_next_gate_mc(struct PCFState *st, struct PCFGate *current_gate)
+{
+	garbled_copies_m_t &ccts = *reinterpret_cast<garbled_copies_m_t*>(get_external_state(st));
+	std::vector<garbled_circuit_m_t> &gcs = *ccts.m_gcs;
 
-	KDF128((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)&in_key[0]);
-	aes_ciphertext = _mm_and_si128(aes_ciphertext, cct.m_clear_mask);
-	out_key[0] = _mm_xor_si128(out_key[0], aes_ciphertext);
+	const __m128i *X = ccts.m_keys, *Y = ccts.m_keys; // the zero-keys at [1] are never read for inputs
+	if (!is_input(current_gate))
+	{
+		X = reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1));
+		Y = reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2));
+	}
+
+	for (size_t ix = 0; ix < gcs.size(); ix++)
+	{
+		ccts.m_keys[ix+1] = gen_gate_m(gcs[ix], current_gate, X[ix+1], Y[ix+1]);
+	}
 
-	KDF128((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)&in_key[1]);
-	aes_ciphertext = _mm_and_si128(aes_ciphertext, cct.m_clear_mask);
-	out_key[1] = _mm_xor_si128(out_key[1], aes_ciphertext);
+	return ccts.m_keys;
+}
 
-	const byte bit = msg.get_ith_bit(0);
+void *evl_next_gate_mc(struct PCFState *st, struct PCFGate *current_gate)
+{
+	garbled_copies_m_t &ccts = *reinterpret_cast<garbled_copies_m_t*>(get_external_state(st));
+	std::vector<garbled_circuit_m_t> &gcs = *ccts.m_gcs;
 
-	tmp.resize(16);
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), out_key[  bit]);
-	cct.m_o_bufr.insert(cct.m_o_bufr.end(), tmp.begin(), tmp.begin()+Env::key_size_in_bytes());
+	const __m128i *X = ccts.m_keys, *Y = ccts.m_keys;
+	if (!is_input(current_gate))
+	{
+		X = reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire1));
+		Y = reinterpret_cast<__m128i*>(get_wire_key(st, current_gate->wire2));
+	}
 
-	_mm_storeu_si128(reinterpret_cast<__m128i*>(&tmp[0]), out_key[1-bit]);
-	cct.m_o_bufr.insert(cct.m_o_bufr.end(), tmp.begin(), tmp.begin()+Env::key_size_in_bytes());
+	for (size_t ix = 0; ix < gcs.size(); ix++)
+	{
+		ccts.m_keys[ix+1] = ccts.m_chks[ix]?
+			gen_gate_m(gcs[ix], current_gate, X[ix+1], Y[ix+1]) : // check circuit: re-generate
+			evl_gate_m(gcs[ix], current_gate, X[ix+1], Y[ix+1]);
+	}
 
-	cct.m_gen_inp_hash_ix++;
+	return ccts.m_keys;
 }
 
-void evl_next_gen_inp_com(garbled_circuit_m_t &cct, const Bytes &row, size_t kx)
+namespace
 {
-	Bytes out(cct.m_gen_inp_decom[0].size());
 
-	for (size_t jx = 0; jx < cct.m_gen_inp_decom.size(); jx++)
+//
+// The 2-UHF check as a bit-matrix product over GF(2): acc[kx] gets the XOR
+// of the n input keys picked by the kx-th row of the matrix. Rows are walked
+// 64 bits at a time and only their set bits touch a key.
+//
+void matrix_xor(const std::vector<Bytes> &matrix, const __m128i *keys, size_t n, __m128i *acc)
+{
+	for (size_t kx = 0; kx < matrix.size(); kx++)
 	{
-		if (row.get_ith_bit(jx)) { out ^= cct.m_gen_inp_decom[jx]; }
+		const Bytes &row = matrix[kx];
+		assert(row.size()*8 >= n);
+
+		__m128i key = _mm_setzero_si128();
+
+		for (size_t wx = 0; wx*64 < n; wx++)
+		{
+			uint64_t word = 0;
+			memcpy(&word, &row[0]+wx*8, std::min<size_t>(8, row.size()-wx*8));
+
+			if (n-wx*64 < 64) word &= (uint64_t(1)<<(n-wx*64))-1; // beyond the last input
+
+			for (; word != 0; word &= word-1)
+			{
+				size_t jx = wx*64 + __builtin_ctzll(word);
+				key = _mm_xor_si128(key, keys[jx]);
+			}
+		}
+
+		acc[kx] = key;
+	}
+}
+
+};
+
+// all rows of the matrix for one circuit, in a single message
+void gen_gen_inp_hash(garbled_circuit_m_t &cct, const std::vector<Bytes> &matrix)
+{
+	const size_t len = Env::key_size_in_bytes();
+	const size_t n = cct.m_gen_inp_decom.size()/(2*decom_size());
+
+	__m128i *keys = (__m128i*)_mm_malloc(n*sizeof(__m128i), sizeof(__m128i));
+	__m128i *acc = (__m128i*)_mm_malloc(matrix.size()*sizeof(__m128i), sizeof(__m128i));
+	__m128i *rnd = (__m128i*)_mm_malloc(matrix.size()*sizeof(__m128i), sizeof(__m128i));
+
+	// the zero-keys, see gen_inp_commit()
+	for (size_t jx = 0; jx < n; jx++)
+	{
+		byte bit = cct.m_gen_inp_mask.get_ith_bit(jx);
+		keys[jx] = load_key(&cct.m_gen_inp_decom[(2*jx+bit)*decom_size()]);
 	}
 
-	byte bit = out.get_ith_bit(0);
+	matrix_xor(matrix, keys, n, acc);
 
-	static Bytes tmp;
+	if (!matrix.empty()) cct.m_prng.fill(rnd, matrix.size());
 
-	Bytes::iterator it = cct.m_i_bufr_ix + bit*Env::key_size_in_bytes();
+	const __m128i clear_bit0 = _mm_set_epi32(-1, -1, -1, -2);
 
-	__m128i aes_key, aes_plaintext, aes_ciphertext, out_key;
+	size_t ofs = cct.m_o_bufr.size();
+	cct.m_o_bufr.resize(ofs+2*len*matrix.size());
+	byte *out = &cct.m_o_bufr[0]+ofs;
 
-	tmp.assign(out.begin(), out.begin()+Env::key_size_in_bytes());
-	tmp.resize(16, 0);
-	aes_key = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
+	for (size_t kx = 0; kx < matrix.size(); kx++, out += 2*len)
+	{
+		__m128i out_key[2], in_key[2], aes_plaintext, aes_ciphertext;
 
-	aes_plaintext = _mm_set1_epi64x((uint64_t)kx+10);
+		out_key[0] = _mm_and_si128(_mm_and_si128(rnd[kx], cct.m_clear_mask), clear_bit0);
+		out_key[1] = _mm_xor_si128(out_key[0], cct.m_R);
 
-	KDF128((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)&aes_key);
-	aes_ciphertext = _mm_and_si128(aes_ciphertext, cct.m_clear_mask);
+		aes_plaintext = _mm_set1_epi64x((uint64_t)kx+10);
 
-	tmp.assign(it, it+Env::key_size_in_bytes());
-	tmp.resize(16, 0);
-	out_key = _mm_loadu_si128(reinterpret_cast<__m128i*>(&tmp[0]));
-	out_key = _mm_xor_si128(out_key, aes_ciphertext);
+		in_key[0] = acc[kx];
+		in_key[1] = _mm_xor_si128(in_key[0], cct.m_R);
+
+		KDF128((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)&in_key[0]);
+		aes_ciphertext = _mm_and_si128(aes_ciphertext, cct.m_clear_mask);
+		out_key[0] = _mm_xor_si128(out_key[0], aes_ciphertext);
+
+		KDF128((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)&in_key[1]);
+		aes_ciphertext = _mm_and_si128(aes_ciphertext, cct.m_clear_mask);
+		out_key[1] = _mm_xor_si128(out_key[1], aes_ciphertext);
 
-	bit = _mm_extract_epi8(out_key, 0) & 0x01;
-	cct.m_gen_inp_hash.set_ith_bit(kx, bit);
+		const byte bit = _mm_extract_epi8(acc[kx], 0) & 0x01;
+
+		memcpy(out,     out_key+bit,     len);
+		memcpy(out+len, out_key+(1-bit), len);
+	}
+
+	_mm_free(rnd);
+	_mm_free(acc);
+	_mm_free(keys);
+
+	cct.m_gen_inp_hash_ix += matrix.size();
+}
+
+void evl_gen_inp_hash(garbled_circuit_m_t &cct, const std::vector<Bytes> &matrix)
+{
+	const size_t len = Env::key_size_in_bytes();
+	const size_t n = cct.m_gen_inp_decom.size()/decom_size();
+
+	__m128i *keys = (__m128i*)_mm_malloc(n*sizeof(__m128i), sizeof(__m128i));
+	__m128i *acc = (__m128i*)_mm_malloc(matrix.size()*sizeof(__m128i), sizeof(__m128i));
+
+	for (size_t jx = 0; jx < n; jx++)
+	{
+		keys[jx] = load_key(&cct.m_gen_inp_decom[jx*decom_size()]);
+	}
+
+	matrix_xor(matrix, keys, n, acc);
+
+	assert(cct.m_i_bufr.end()-cct.m_i_bufr_ix >= (ptrdiff_t)(2*len*matrix.size()));
+
+	for (size_t kx = 0; kx < matrix.size(); kx++)
+	{
+		__m128i aes_plaintext, aes_ciphertext, out_key;
+
+		byte bit = _mm_extract_epi8(acc[kx], 0) & 0x01;
+
+		aes_plaintext = _mm_set1_epi64x((uint64_t)kx+10);
+
+		KDF128((uint8_t*)&aes_plaintext, (uint8_t*)&aes_ciphertext, (uint8_t*)&acc[kx]);
+		aes_ciphertext = _mm_and_si128(aes_ciphertext, cct.m_clear_mask);
+
+		out_key = _mm_xor_si128(load_key(cct.m_i_bufr_ix + bit*len), aes_ciphertext);
+
+		bit = _mm_extract_epi8(out_key, 0) & 0x01;
+		cct.m_gen_inp_hash.set_ith_bit(kx, bit);
+
+		cct.m_i_bufr_ix += 2*len;
+	}
 
-	cct.m_i_bufr_ix += 2*Env::key_size_in_bytes();
+	_mm_free(acc);
+	_mm_free(keys);
 
-	cct.m_gen_inp_hash_ix++;
+	cct.m_gen_inp_hash_ix += matrix.size();
 }
@@ -2,6 +2,7 @@
 #define GARBLED_CIRCUIT_M_H_
 
 #include <emmintrin.h>
+#include <algorithm>
 
 #include "Env.h"
 #include "Prng.h"
@@ -13,8 +14,7 @@ extern "C" {
 
 typedef struct
 {
-	Bytes               m_bufr;
-	Hash                m_hash;
+	CircuitHash         m_hash;          // over the received messages, as they arrive
 
 	__m128i             m_R;
 
@@ -38,9 +38,10 @@ typedef struct
 	Bytes               m_gen_out;
 	Bytes               m_evl_out;
 
-	std::vector<Bytes>  m_gen_inp_com;
-	std::vector<Bytes>  m_gen_inp_decom;
+	Bytes               m_gen_inp_com;   // k-bit commitments, back to back
+	Bytes               m_gen_inp_decom; // decom_size() bytes each, back to back
 	Bytes               m_gen_inp_hash;
+	Bytes               m_cot_fix;       // k0 ^ k1 ^ R of the evaluator's inputs, back to back
 
 	Bytes               m_o_bufr;
 	Bytes               m_i_bufr;
@@ -50,23 +51,60 @@ typedef struct
 	uint32_t            m_gen_inp_cnt;
 	uint32_t            m_evl_inp_cnt;
 	__m128i             m_const_wire[2]; // keys for constant 0 and 1
+	__m128i             m_current_key;   // returned to the PCF interpreter
 }
 garbled_circuit_m_t;
 
-void gen_init(garbled_circuit_m_t &cct, const std::vector<Bytes> &keys, const Bytes &gen_inp_mask, const Bytes &seed);
+// all the circuit copies of a node, driven by a single PCF interpreter
+typedef struct
+{
+	std::vector<garbled_circuit_m_t>  *m_gcs;
+	Bytes                              m_chks;          // 1 for copies the evaluator re-generates
+	bool                               m_hash_chks;     // check copies are hashed, not sent
+	__m128i                           *m_keys;          // returned to the PCF interpreter
+	__m128i                           *m_const_keys[2]; // for load_pcf_file()
+}
+garbled_copies_m_t;
+
+void gen_init(garbled_circuit_m_t &cct, const std::vector<Bytes> &keys, const Bytes &gen_inp_mask, uint32_t gen_inp_cnt, const Bytes &seed);
 void evl_init(garbled_circuit_m_t &cct, const std::vector<Bytes> &keys, const Bytes &masked_gen_inp, const Bytes &seed);
 
+// The evaluator's input keys are correlated with R before the gates: the
+// generator appends k0 ^ k1 ^ R for every input to the copy's message, k0
+// being the zero-key, and the evaluator takes them from the message it has
+// received, so input gates of the evaluator send nothing.
+void gen_cot_fix(garbled_circuit_m_t &cct);
+void evl_cot_fix(garbled_circuit_m_t &cct);
+
 inline void trim_output(garbled_circuit_m_t &cct)
 {
 	cct.m_gen_out.resize((cct.m_gen_out_ix+7)/8);
 	cct.m_evl_out.resize((cct.m_evl_out_ix+7)/8);
 }
 
+// a decommitment is a key followed by k bits of randomness
+inline size_t decom_size()
+{
+	return 2*Env::key_size_in_bytes();
+}
+
+inline Bytes get_gen_inp_decom(const garbled_circuit_m_t &cct, size_t ix)
+{
+	Bytes::const_iterator it = cct.m_gen_inp_decom.begin()+ix*decom_size();
+	return Bytes(it, it+decom_size());
+}
+
+inline void set_gen_inp_decom(garbled_circuit_m_t &cct, size_t ix, const Bytes &decom)
+{
+	assert(decom.size() == decom_size());
+	std::copy(decom.begin(), decom.end(), cct.m_gen_inp_decom.begin()+ix*decom_size());
+}
+
 inline void recv(garbled_circuit_m_t &cct, const Bytes &i_data)
 {
-	cct.m_i_bufr.clear();
-	cct.m_i_bufr += i_data;
+	cct.m_i_bufr.assign(i_data.begin(), i_data.end());
 	cct.m_i_bufr_ix = cct.m_i_bufr.begin();
+	cct.m_hash.update(cct.m_i_bufr); // every received byte once
 }
 
 inline const Bytes send(garbled_circuit_m_t &cct)
@@ -76,6 +114,142 @@ inline const Bytes send(garbled_circuit_m_t &cct)
 	return o_data;
 }
 
+//
+// The gates go over the wire in frames of many gates, as in
+// garbled_circuit.h: a copy's gates build up in m_o_bufr until it holds n
+// bytes or more, and the evaluator reads them off m_i_bufr gate by gate. An
+// empty frame ends the circuit. With the copies sharing an interpreter, a
+// frame is the sections of all the sent copies, back to back.
+//
+
+inline bool frame_full(const garbled_circuit_m_t &cct, size_t n)
+{
+	return !cct.m_o_bufr.empty() && cct.m_o_bufr.size() >= n;
+}
+
+// the frame built up so far, in exchange for the storage of the last one
+inline void send(garbled_circuit_m_t &cct, Bytes &frame)
+{
+	frame.swap(cct.m_o_bufr);
+	cct.m_o_bufr.clear();
+}
+
+// the keys copies_init() allocates are multi-copy keys, see copy_keys_m();
+// copies_free() releases them and leaves null pointers behind
+void copies_init(garbled_copies_m_t &ccts, std::vector<garbled_circuit_m_t> &gcs, const Bytes &chks, bool hash_chks = false);
+void copies_free(garbled_copies_m_t &ccts);
+
+// whether copy ix puts its messages on the wire
+inline bool is_sent(const garbled_copies_m_t &ccts, size_t ix)
+{
+	return !(ccts.m_hash_chks && ccts.m_chks[ix]);
+}
+
+// with hashed check copies, a node holding only check copies sends nothing
+inline bool is_silent(const garbled_copies_m_t &ccts)
+{
+	for (size_t ix = 0; ix < ccts.m_gcs->size(); ix++)
+		if (is_sent(ccts, ix)) return false;
+	return true;
+}
+
+// fold the messages of a copy since the last frame into its circuit hash
+inline void hash_o_bufr(garbled_circuit_m_t &cct)
+{
+	cct.m_hash.update(cct.m_o_bufr);
+	cct.m_o_bufr.clear();
+}
+
+// whether the copies have built up a frame of n bytes, hashed ones included
+inline bool frame_full(const garbled_copies_m_t &ccts, size_t n)
+{
+	size_t size = 0;
+	for (size_t ix = 0; ix < ccts.m_gcs->size(); ix++) size += (*ccts.m_gcs)[ix].m_o_bufr.size();
+	return size > 0 && size >= n;
+}
+
+// the messages of all sent copies since the last frame, back to back, in
+// o_data's storage
+inline void send(garbled_copies_m_t &ccts, Bytes &o_data)
+{
+	o_data.clear();
+	for (size_t ix = 0; ix < ccts.m_gcs->size(); ix++)
+	{
+		if (!is_sent(ccts, ix)) { hash_o_bufr((*ccts.m_gcs)[ix]); continue; }
+
+		o_data += (*ccts.m_gcs)[ix].m_o_bufr;
+		(*ccts.m_gcs)[ix].m_o_bufr.clear();
+	}
+}
+
+// every sent copy's section of a message has the same length
+inline void recv(garbled_copies_m_t &ccts, const Bytes &i_data)
+{
+	size_t cnt = 0;
+	for (size_t ix = 0; ix < ccts.m_gcs->size(); ix++) cnt += is_sent(ccts, ix);
+
+	const size_t len = cnt? i_data.size()/cnt : 0;
+	Bytes::const_iterator it = i_data.begin();
+	for (size_t ix = 0; ix < ccts.m_gcs->size(); ix++)
+	{
+		garbled_circuit_m_t &cct = (*ccts.m_gcs)[ix];
+		if (!is_sent(ccts, ix)) { cct.m_i_bufr.clear(); cct.m_i_bufr_ix = cct.m_i_bufr.begin(); continue; }
+
+		cct.m_i_bufr.assign(it, it+len); // straight from the network buffer
+		cct.m_i_bufr_ix = cct.m_i_bufr.begin();
+		cct.m_hash.update(cct.m_i_bufr); // every received byte once
+		it += len;
+	}
+}
+
+// whether copy ix has gates left in the frame received last: an evaluated
+// copy until it has read all of its section, a re-generated one until it
+// has made as many bytes
+inline bool frame_left(const garbled_copies_m_t &ccts, size_t ix)
+{
+	const garbled_circuit_m_t &cct = (*ccts.m_gcs)[ix];
+	if (ccts.m_chks[ix]) return cct.m_o_bufr.size() < cct.m_i_bufr.size();
+	return cct.m_i_bufr_ix < cct.m_i_bufr.end();
+}
+
+// the same for the copies sharing an interpreter, which keep in step
+inline bool frame_left(const garbled_copies_m_t &ccts)
+{
+	for (size_t ix = 0; ix < ccts.m_gcs->size(); ix++)
+		if (is_sent(ccts, ix)) return frame_left(ccts, ix);
+	return false;
+}
+
+// whether the re-generated check copies match the frame received last;
+// hashed check copies are only folded into their hash, see chk_hash()
+inline bool pass_regen(garbled_copies_m_t &ccts)
+{
+	bool pass = true;
+	for (size_t ix = 0; ix < ccts.m_gcs->size(); ix++)
+		if (ccts.m_chks[ix])
+	{
+		garbled_circuit_m_t &cct = (*ccts.m_gcs)[ix];
+		if (ccts.m_hash_chks) { hash_o_bufr(cct); continue; }
+
+		pass &= (cct.m_o_bufr == cct.m_i_bufr);
+		cct.m_o_bufr.clear();
+	}
+	return pass;
+}
+
+// the hashes of all the hashed check copies, back to back; both parties
+// compute it once the whole circuit has gone through the interpreter
+inline Bytes chk_hash(garbled_copies_m_t &ccts)
+{
+	Bytes hash;
+	for (size_t ix = 0; ix < ccts.m_gcs->size(); ix++)
+		if (!is_sent(ccts, ix))
+	{
+		hash += (*ccts.m_gcs)[ix].m_hash.sig(256);
+	}
+	return hash;
+}
+
 #define  _mm_extract_epi8(x, imm) \
 	((((imm) & 0x1) == 0) ?   \
 	_mm_extract_epi16((x), (imm) >> 1) & 0xff : \
@@ -87,6 +261,9 @@ Bytes KDF256(const Bytes &in, const Bytes &key);
 void KDF128(const uint8_t *in, uint8_t *out, const uint8_t *key);
 void KDF256(const uint8_t *in, uint8_t *out, const uint8_t *key);
 
+// com gets the k-bit commitments to the n decommitments in decom
+void commit(const byte *decom, byte *com, size_t n);
+
 void set_const_key(garbled_circuit_m_t &cct, byte c, const Bytes &key);
 const Bytes get_const_key(garbled_circuit_m_t &cct, byte c, byte b);
 
@@ -97,23 +274,28 @@ extern "C" {
 void *gen_next_gate_m(struct PCFState *st, struct PCFGate *gate);
 void *evl_next_gate_m(struct PCFState *st, struct PCFGate *gate);
 
-void gen_next_gen_inp_com(garbled_circuit_m_t &cct, const Bytes &row, size_t kx);
-void evl_next_gen_inp_com(garbled_circuit_m_t &cct, const Bytes &row, size_t kx);
+void *copy_keys_m(void *);
+void delete_keys_m(void *);
+
+void *gen_next_gate_mc(struct PCFState *st, struct PCFGate *gate);
+void *evl_next_gate_mc(struct PCFState *st, struct PCFGate *gate);
+
+void gen_gen_inp_hash(garbled_circuit_m_t &cct, const std::vector<Bytes> &matrix);
+void evl_gen_inp_hash(garbled_circuit_m_t &cct, const std::vector<Bytes> &matrix);
 
 #ifdef __CPLUSPLUS
 }
 #endif
 
+// whether the opened decommitments match the commitments sent with the circuit
 inline bool pass_check(const garbled_circuit_m_t &cct)
 {
-	assert(cct.m_gen_inp_decom.size() == cct.m_gen_inp_com.size());
+	const size_t n = cct.m_gen_inp_decom.size()/decom_size();
+	assert(cct.m_gen_inp_com.size() == n*Env::key_size_in_bytes());
 
-	bool pass_chk = true;
-	for (size_t ix = 0; ix < cct.m_gen_inp_decom.size(); ix++)
-	{
-		pass_chk &= (cct.m_gen_inp_decom[ix].hash(Env::k()) == cct.m_gen_inp_com[ix]);
-	}
-	return pass_chk;
+	Bytes com(cct.m_gen_inp_com.size());
+	if (n > 0) commit(&cct.m_gen_inp_decom[0], &com[0], n);
+	return com == cct.m_gen_inp_com;
 }
 
 inline void init(garbled_circuit_m_t &cct)
@@ -0,0 +1,238 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <dirent.h>
+#include <unistd.h>
+
+#include "Env.h"
+#include "gc_store.h"
+
+namespace
+{
+
+const size_t ID_LEN = 16;
+
+// after the id, where the key length used to come first: the messages are
+// frames of gates (see garbled_circuit.h), not one message per gate
+const uint64_t FORMAT = 0x4743460000000002ULL;
+
+void put_u64(Bytes &b, uint64_t v)
+{
+	for (size_t ix = 0; ix < 8; ix++) b.push_back(v >> (56-8*ix));
+}
+
+// false if fewer than 8 bytes are left at p
+bool get_u64(const byte *&p, const byte *end, uint64_t &v)
+{
+	if (end - p < 8) return false;
+
+	v = 0;
+	for (size_t ix = 0; ix < 8; ix++) v = (v << 8) | *p++;
+	return true;
+}
+
+bool get_bytes(const byte *&p, const byte *end, size_t n, Bytes &b)
+{
+	if (size_t(end - p) < n) return false;
+
+	b.assign(p, p+n);
+	p += n;
+	return true;
+}
+
+// the length of a message, in one byte below 0xFF and else in four more
+void put_len(Bytes &b, uint32_t n)
+{
+	if (n >= 0xFF)
+	{
+		b.push_back(0xFF);
+		for (size_t ix = 0; ix < 4; ix++) b.push_back(n >> (24-8*ix));
+	}
+	else
+	{
+		b.push_back(n);
+	}
+}
+
+// moves ofs past the length; false if it or the message runs past the end
+bool get_len(const Bytes &b, size_t &ofs, size_t &n)
+{
+	if (ofs >= b.size()) return false;
+
+	n = b[ofs++];
+	if (n == 0xFF)
+	{
+		if (b.size() - ofs < 4) return false;
+
+		n = 0;
+		for (size_t ix = 0; ix < 4; ix++) n = (n << 8) | b[ofs++];
+	}
+	return b.size() - ofs >= n;
+}
+
+std::string file_prefix(int rank)
+{
+	std::ostringstream prefix;
+	prefix << "gc." << rank << ".";
+	return prefix.str();
+}
+
+}
+
+std::string gc_store_path(const char *dir, int rank, uint64_t seq)
+{
+	std::ostringstream path;
+	path << dir << "/" << file_prefix(rank) << seq;
+	return path.str();
+}
+
+bool gc_store_seqs(const char *dir, int rank, uint64_t &first, uint64_t &next)
+{
+	const std::string prefix = file_prefix(rank);
+
+	first = UINT64_MAX;
+	next = 0;
+
+	DIR *d = opendir(dir);
+	if (!d) return false;
+
+	for (struct dirent *e; (e = readdir(d)) != 0; )
+	{
+		const char *name = e->d_name;
+		if (strncmp(name, prefix.c_str(), prefix.size()) != 0) continue;
+
+		// only names that end in the seq, which leaves out the ".tmp" ones
+		char *end;
+		uint64_t seq = strtoull(name+prefix.size(), &end, 10);
+		if (end == name+prefix.size() || *end != 0) continue;
+
+		first = std::min(first, seq);
+		next = std::max(next, seq+1);
+	}
+	closedir(d);
+
+	return first != UINT64_MAX;
+}
+
+bool gc_store_load(gc_store_t &store, const std::string &path)
+{
+	Bytes data;
+
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) return false;
+
+	bool ok = fseek(f, 0, SEEK_END) == 0;
+	long len = ftell(f);
+	ok = ok && len >= 0 && fseek(f, 0, SEEK_SET) == 0;
+	if (ok)
+	{
+		data.resize(len);
+		ok = len == 0 || fread(&data[0], 1, len, f) == size_t(len);
+	}
+	fclose(f);
+
+	if (!ok || data.empty()) return false;
+
+	const byte *p = &data[0], *end = p + data.size();
+	uint64_t format, key_len, gen_inp_cnt, evl_inp_cnt, gen_out_cnt, evl_out_cnt, seed_len, msgs_len;
+
+	ok = get_bytes(p, end, ID_LEN, store.id);
+	ok = ok && get_u64(p, end, format) && format == FORMAT;
+	ok = ok && get_u64(p, end, key_len) && key_len == Env::key_size_in_bytes() && p < end;
+	if (!ok) return false;
+
+	store.path = path;
+	store.privacy_free = *p++;
+
+	ok = get_u64(p, end, gen_inp_cnt) && get_u64(p, end, evl_inp_cnt);
+	ok = ok && get_u64(p, end, gen_out_cnt) && get_u64(p, end, evl_out_cnt);
+	ok = ok && get_u64(p, end, seed_len) && get_bytes(p, end, seed_len, store.seed);
+	if (!ok) return false;
+
+	store.gen_inp_cnt = gen_inp_cnt;
+	store.evl_inp_cnt = evl_inp_cnt;
+	store.gen_out_cnt = gen_out_cnt;
+	store.evl_out_cnt = evl_out_cnt;
+
+	// the keys are there on the generator's side only, the one with the seed
+	const size_t key_cnt = store.seed.empty()? 0 : gen_inp_cnt + evl_inp_cnt;
+	if (size_t(end - p) < key_cnt*key_len) return false;
+
+	store.gen_keys.resize(store.seed.empty()? 0 : gen_inp_cnt);
+	store.evl_keys.resize(store.seed.empty()? 0 : evl_inp_cnt);
+
+	for (size_t ix = 0; ix < store.gen_keys.size(); ix++, p += key_len) store.gen_keys[ix] = Bytes(p, p+key_len);
+	for (size_t ix = 0; ix < store.evl_keys.size(); ix++, p += key_len) store.evl_keys[ix] = Bytes(p, p+key_len);
+
+	ok = get_u64(p, end, msgs_len) && get_bytes(p, end, msgs_len, store.msgs) && p == end;
+	if (!ok) return false;
+
+	// every length has to stay within the messages, so that gc_store_pop()
+	// only has to watch for the end
+	for (size_t ofs = 0, n; ofs < store.msgs.size(); ofs += n)
+		if (!get_len(store.msgs, ofs, n)) return false;
+
+	return true;
+}
+
+bool gc_store_save(const gc_store_t &store)
+{
+	assert(store.id.size() == ID_LEN);
+	assert(store.gen_keys.size() == (store.seed.empty()? 0 : store.gen_inp_cnt));
+	assert(store.evl_keys.size() == (store.seed.empty()? 0 : store.evl_inp_cnt));
+
+	Bytes data = store.id;
+	put_u64(data, FORMAT);
+	put_u64(data, Env::key_size_in_bytes());
+	data.push_back(store.privacy_free);
+	put_u64(data, store.gen_inp_cnt);
+	put_u64(data, store.evl_inp_cnt);
+	put_u64(data, store.gen_out_cnt);
+	put_u64(data, store.evl_out_cnt);
+	put_u64(data, store.seed.size());
+	data += store.seed;
+	for (size_t ix = 0; ix < store.gen_keys.size(); ix++) data += store.gen_keys[ix];
+	for (size_t ix = 0; ix < store.evl_keys.size(); ix++) data += store.evl_keys[ix];
+	put_u64(data, store.msgs.size());
+	data += store.msgs;
+
+	// under a temporary name first, so that a half-written circuit is never seen
+	std::string tmp = store.path + ".tmp";
+
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (!f) return false;
+
+	bool ok = fwrite(&data[0], 1, data.size(), f) == data.size();
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	ok &= fclose(f) == 0;
+
+	if (!ok || rename(tmp.c_str(), store.path.c_str()) != 0)
+	{
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool gc_store_drop(const gc_store_t &store)
+{
+	return unlink(store.path.c_str()) == 0;
+}
+
+void gc_store_push(gc_store_t &store, const Bytes &msg)
+{
+	put_len(store.msgs, msg.size());
+	store.msgs += msg;
+}
+
+Bytes gc_store_pop(const gc_store_t &store, size_t &ofs)
+{
+	size_t n;
+	if (!get_len(store.msgs, ofs, n)) return Bytes(); // past the last one
+
+	Bytes::const_iterator it = store.msgs.begin() + ofs;
+	ofs += n;
+	return Bytes(it, it+n);
+}
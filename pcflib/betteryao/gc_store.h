@@ -0,0 +1,53 @@
+#ifndef GC_STORE_H_
+#define GC_STORE_H_
+
+#include <string>
+#include <vector>
+
+#include "Bytes.h"
+
+//
+// Circuits garbled offline, before the inputs are known, one file per
+// circuit and process. The generator keeps the seed gen_init() draws R and
+// the constant keys from, and the zero-keys of every input; the evaluator
+// keeps the messages the generator would have sent it in circuit_evaluate(),
+// from the constant keys to the closing empty one. The generator's input
+// gates carry nothing in there, as their keys only come online. A circuit
+// is evaluated once only: its file is gone before any key of it is out.
+//
+
+typedef struct
+{
+	std::string        path;
+	Bytes              id;           // made by the generator, the same on both sides
+	bool               privacy_free;
+	size_t             gen_inp_cnt;
+	size_t             evl_inp_cnt;
+	size_t             gen_out_cnt;  // generator only, as it sees no gate go by online
+	size_t             evl_out_cnt;  // generator only
+	Bytes              seed;         // generator only
+	std::vector<Bytes> gen_keys;     // generator only: zero-keys of its inputs
+	std::vector<Bytes> evl_keys;     // generator only: zero-keys of the evaluator's
+	Bytes              msgs;         // evaluator only: each after its length
+}
+gc_store_t;
+
+// the circuit seq of this process in dir
+std::string gc_store_path(const char *dir, int rank, uint64_t seq);
+
+// first gets the oldest circuit of this process in dir and next the seq
+// for a new one; false if there is none
+bool gc_store_seqs(const char *dir, int rank, uint64_t &first, uint64_t &next);
+
+bool gc_store_load(gc_store_t &store, const std::string &path);
+bool gc_store_save(const gc_store_t &store);
+
+// removes the file once the circuit is in memory
+bool gc_store_drop(const gc_store_t &store);
+
+void gc_store_push(gc_store_t &store, const Bytes &msg);
+
+// the message at ofs, which moves on to the next one
+Bytes gc_store_pop(const gc_store_t &store, size_t &ofs);
+
+#endif /* GC_STORE_H_ */
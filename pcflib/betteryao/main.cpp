@@ -7,6 +7,16 @@
 //#include "BetterYao3.h"
 #include "BetterYao4.h"
 
+YaoBase *new_yao(EnvParams &params)
+{
+	return new Yao(params);
+}
+
+YaoBase *new_betteryao4(EnvParams &params)
+{
+	return new BetterYao4(params);
+}
+
 int main(int argc, char **argv)
 {
 	MPI_Init(&argc, &argv);
@@ -17,14 +27,38 @@ int main(int argc, char **argv)
 	if (argc < 8)
 	{
 		std::cout << "Usage:" << std::endl
-			<< "\tbetteryao [secu_param] [stat_param] [pcf_file] [input_file] [ip_server] [port_base] [mode]" << std::endl
+			<< "\tbetteryao [secu_param] [stat_param] [pcf_file] [input_file] [ip_server] [port_base] [mode] ([thread_cnt] [session_cnt])" << std::endl
 			<< std::endl
 			<< "[secu_param]: multiple of 8 but 128 at most" << std::endl
 			<< "[stat_param]: multiple of the cluster size" << std::endl
 			<< "  [pcf_file]: from the PCF compiler" << std::endl
+			<< "[input_file]: the evaluator's input on a line, the generator's on the next; more such" << std::endl
+			<< "              records make modes 0 and 3 run a batch, a circuit for each record" << std::endl
 			<< " [ip_server]: the IP (not domain name) of the IP exchanger" << std::endl
 			<< " [port_base]: for the \"IP address in use\" hassles" << std::endl
-			<< "      [mode]: 0=>honest-but-curious, 4=>malicious" << std::endl
+			<< "      [mode]: 0=>honest-but-curious, 1=>malicious, 2=>malicious with hashed check circuits," << std::endl
+			<< "              3=>privacy-free (the evaluator learns every wire value)," << std::endl
+			<< "              4=>offline random OTs for modes 0 and 3, 5=>offline random OTs for modes 1 and 2," << std::endl
+			<< "              6=>offline garbled circuits for mode 0, 7=>offline garbled circuits for mode 3" << std::endl
+			<< "[thread_cnt]: threads garbling/evaluating the circuit, or its cut-and-choose copies side by side, and running the OTs (default 1)" << std::endl
+			<< "[session_cnt]: honest-but-curious runs over one connection, sharing the OT CRS (default 1)" << std::endl
+			<< std::endl
+			<< "BETTERYAO_TABLES=[dir] keeps the CRS, the claw-free collection and their fixed-base" << std::endl
+			<< "tables in [dir] for the next runs" << std::endl
+			<< "BETTERYAO_OTS=[dir] keeps the random OTs of modes 4 and 5, enough for [session_cnt]" << std::endl
+			<< "runs, in [dir], and has the other modes use them up rather than run OTs online" << std::endl
+			<< "BETTERYAO_GCS=[dir] keeps the circuits of modes 6 and 7, one for each of [session_cnt]" << std::endl
+			<< "runs, in [dir], and has modes 0 and 3 evaluate them rather than garble online" << std::endl
+			<< "BETTERYAO_SERVE=[n] runs modes 0 and 3 as a service: evl keeps the circuit and its input" << std::endl
+			<< "and serves n connections at once at [port_base]+1 until killed, and gen, as a load" << std::endl
+			<< "generator, opens n connections to [ip_server] and runs [session_cnt] sessions over each" << std::endl
+			<< "BETTERYAO_CAPTURE=[file] has gen in modes 0 and 3 write what it sends, and the keys of" << std::endl
+			<< "evl's inputs, to [file]; BETTERYAO_REPLAY=[file] has evl run on such a capture, with no" << std::endl
+			<< "gen and no network, for profiling evaluation and for deterministic reruns" << std::endl
+			<< "BETTERYAO_RANKS=[n] runs the cluster of a party as n threads of one process, sharing its" << std::endl
+			<< "memory, rather than as MPI processes: [stat_param] has to be a multiple of n instead" << std::endl
+			<< "BETTERYAO_FRAME=[KB] has gen send the garbled gates [KB] kilobytes at a time, flushed" << std::endl
+			<< "early when it waits for the OTs and at the end of the circuit (default 256)" << std::endl
 			<< std::endl;
 		exit(EXIT_FAILURE);
 	}
@@ -33,6 +67,7 @@ int main(int argc, char **argv)
 	EnvParams params;
 
 	YaoBase *sys = 0;
+	YaoBase *(*make)(EnvParams &) = 0;
 
 #ifdef _BETTERYAO
 	params.secu_param   = atoi(argv[1]);
@@ -45,17 +80,69 @@ int main(int argc, char **argv)
 
 	params.port_base    = atoi(argv[6]);
 
+	if (argc > 8)
+		params.thread_cnt = atoi(argv[8]);
+
+	if (argc > 9)
+		params.session_cnt = atoi(argv[9]);
+
         // The special file that holds the inputs
         params.input_file = argv[4];
 
+	params.ot_store = getenv("BETTERYAO_OTS");
+	params.gc_store = getenv("BETTERYAO_GCS");
+
+	params.capture_file = getenv("BETTERYAO_CAPTURE");
+	params.replay_file = getenv("BETTERYAO_REPLAY");
+
+	if (getenv("BETTERYAO_RANKS"))
+		params.rank_cnt = atoi(getenv("BETTERYAO_RANKS"));
+
+	if (getenv("BETTERYAO_SERVE"))
+		params.worker_cnt = atoi(getenv("BETTERYAO_SERVE"));
+
+	if (getenv("BETTERYAO_FRAME") && atoi(getenv("BETTERYAO_FRAME")) > 0)
+		params.frame_size = atoi(getenv("BETTERYAO_FRAME"))*size_t(1024);
+
 	switch(atoi(argv[7]))
 	{
 	case 0:
-		sys = new Yao(params);
+		make = new_yao;
 		break;
 
 	case 1:
-		sys = new BetterYao4(params);
+		make = new_betteryao4;
+		break;
+
+	case 2: // the evaluator re-generates check circuits and only compares hashes
+		params.hash_chks = true;
+		make = new_betteryao4;
+		break;
+
+	case 3: // honest-but-curious with privacy-free garbling, one ciphertext per non-XOR gate
+		params.privacy_free = true;
+		make = new_yao;
+		break;
+
+	case 4: // random OTs for the evaluator's inputs, before they are known
+		params.ot_offline = true;
+		make = new_yao;
+		break;
+
+	case 5:
+		params.ot_offline = true;
+		make = new_betteryao4;
+		break;
+
+	case 6: // honest-but-curious circuits, garbled before the inputs are known
+		params.gc_offline = true;
+		make = new_yao;
+		break;
+
+	case 7:
+		params.gc_offline = true;
+		params.privacy_free = true;
+		make = new_yao;
 		break;
 
 	default:
@@ -73,17 +160,25 @@ int main(int argc, char **argv)
 #ifndef MALIC
         params.secu_param = 80;
         params.stat_param = 1;
-        sys = new Yao(params);
+        make = new_yao;
 #else
         params.secu_param = 80;
         params.stat_param = atoi(argv[5]);
         std::cerr << "Here" << std::endl;
-        sys = new BetterYao4(params);
+        make = new_betteryao4;
 #endif
 #endif
 
-	sys->start();
-	delete sys; // delete MPI objects before MPI_Finalize()
+	if (params.rank_cnt > 1)
+	{
+		YaoBase::run_ranks(params, make);
+	}
+	else
+	{
+		sys = make(params);
+		sys->start();
+		delete sys; // delete MPI objects before MPI_Finalize()
+	}
 
 	MPI_Finalize();
 
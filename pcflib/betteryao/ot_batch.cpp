@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <cassert>
+
+#include "Env.h"
+#include "ot_batch.h"
+
+namespace
+{
+
+const size_t OT_GRAIN = 4; // bits per chunk, each worth a handful of exponentiations
+
+typedef struct
+{
+	const G            *g, *h;
+	const Bytes        *bits;
+	const Bytes        *seeds;  // 16 bytes per bit
+	const Bytes        *i_msg;
+	std::vector<Z>     *r;
+	const std::vector<Z> *r_in;
+	std::vector<Bytes> *keys;
+	Bytes              *o_msg;
+}
+batch_t;
+
+inline Prng bit_prng(const batch_t &b, size_t bix)
+{
+	Bytes::const_iterator it = b.seeds->begin() + 16*bix;
+	return Prng(Bytes(it, it+16));
+}
+
+inline void put(Bytes &msg, size_t ix, const G &elm)
+{
+	Bytes tmp = elm.to_bytes();
+	assert(tmp.size() == Env::elm_size_in_bytes());
+	std::copy(tmp.begin(), tmp.end(), msg.begin()+ix*Env::elm_size_in_bytes());
+}
+
+inline void get(const Bytes &msg, size_t ix, G &elm)
+{
+	Bytes::const_iterator it = msg.begin() + ix*Env::elm_size_in_bytes();
+	elm.from_bytes(Bytes(it, it+Env::elm_size_in_bytes()));
+}
+
+// gr=g[b]^r, hr=h[b]^r, where b is the receiver's bit
+void query_task(void *arg, size_t begin, size_t end)
+{
+	const batch_t &b = *reinterpret_cast<batch_t*>(arg);
+	G gr, hr;
+
+	for (size_t bix = begin; bix < end; bix++)
+	{
+		Prng prng = bit_prng(b, bix);
+		Z &r = (*b.r)[bix];
+		r.random(prng);
+
+		int bit_value = b.bits->get_ith_bit(bix);
+		power(gr, b.g[bit_value], r);
+		power(hr, b.h[bit_value], r);
+
+		put(*b.o_msg, 2*bix+0, gr);
+		put(*b.o_msg, 2*bix+1, hr);
+	}
+}
+
+// X[b] = ( g[b]^s[b] ) * ( h[b]^t[b] ) and
+// Y[b] = ( gr^s[b] ) * ( hr^t[b] ) * K[b], where b = 0, 1
+void reply_task(void *arg, size_t begin, size_t end)
+{
+	const batch_t &b = *reinterpret_cast<batch_t*>(arg);
+	G gr, hr, X[2], Y[2], tmp;
+	Z st[2]; // s[b], t[b]
+
+	const G *r[2] = { &gr, &hr };
+
+	for (size_t bix = begin; bix < end; bix++)
+	{
+		Prng prng = bit_prng(b, bix);
+
+		get(*b.i_msg, 2*bix+0, gr);
+		get(*b.i_msg, 2*bix+1, hr);
+
+		for (size_t jx = 0; jx < 2; jx++)
+		{
+			Y[jx].random(prng); // K[jx] sampled at random
+			(*b.keys)[2*bix+jx] = Y[jx].to_bytes().hash(Env::k());
+
+			st[0].random(prng);
+			st[1].random(prng);
+
+			const G *gh[2] = { &b.g[jx], &b.h[jx] };
+			multi_exp(X[jx], gh, st, 2);
+
+			multi_exp(tmp, r, st, 2); Y[jx] *= tmp;
+		}
+
+		put(*b.o_msg, 4*bix+0, X[0]);
+		put(*b.o_msg, 4*bix+1, X[1]);
+		put(*b.o_msg, 4*bix+2, Y[0]);
+		put(*b.o_msg, 4*bix+3, Y[1]);
+	}
+}
+
+// K = Y[b]/(X[b]^r)
+void keys_task(void *arg, size_t begin, size_t end)
+{
+	const batch_t &b = *reinterpret_cast<batch_t*>(arg);
+	G X, Y, tmp;
+
+	for (size_t bix = begin; bix < end; bix++)
+	{
+		int bit_value = b.bits->get_ith_bit(bix);
+
+		get(*b.i_msg, 4*bix +     bit_value, X); // X[b]
+		get(*b.i_msg, 4*bix + 2 + bit_value, Y); // Y[b]
+
+		power(tmp, X, (*b.r_in)[bix]);
+		Y /= tmp;
+		(*b.keys)[bix] = Y.to_bytes().hash(Env::k());
+	}
+}
+
+void fixed_base_task(void *arg, size_t begin, size_t end)
+{
+	G *elms = reinterpret_cast<G*>(arg);
+	for (size_t ix = begin; ix < end; ix++) elms[ix].fixed_base();
+}
+
+}
+
+Bytes ot_query(const G g[2], const G h[2], const Bytes &bits, size_t n, std::vector<Z> &r, Prng &prng, ThreadPool &pool)
+{
+	assert(bits.size() >= (n+7)/8);
+
+	Bytes seeds = prng.rand(128*n), query(2*n*Env::elm_size_in_bytes());
+	r.resize(n);
+
+	batch_t b = { g, h, &bits, &seeds, 0, &r, 0, 0, &query };
+	pool.parallel_for(n, OT_GRAIN, query_task, &b);
+
+	return query;
+}
+
+Bytes ot_reply(const G g[2], const G h[2], const Bytes &query, size_t n, std::vector<Bytes> &keys, Prng &prng, ThreadPool &pool)
+{
+	assert(query.size() == 2*n*Env::elm_size_in_bytes());
+
+	Bytes seeds = prng.rand(128*n), reply(4*n*Env::elm_size_in_bytes());
+	keys.resize(2*n);
+
+	batch_t b = { g, h, 0, &seeds, &query, 0, 0, &keys, &reply };
+	pool.parallel_for(n, OT_GRAIN, reply_task, &b);
+
+	return reply;
+}
+
+void ot_keys(const Bytes &bits, const std::vector<Z> &r, const Bytes &reply, size_t n, std::vector<Bytes> &keys, ThreadPool &pool)
+{
+	assert(reply.size() == 4*n*Env::elm_size_in_bytes());
+	assert(r.size() == n);
+
+	keys.resize(n);
+
+	batch_t b = { 0, 0, &bits, 0, &reply, 0, &r, &keys, 0 };
+	pool.parallel_for(n, OT_GRAIN, keys_task, &b);
+}
+
+void ot_crs(G g[2], G h[2])
+{
+	Bytes crs = read_table_file("ot-crs");
+	if (crs.size() == 4*Env::elm_size_in_bytes())
+	{
+		get(crs, 0, g[0]); get(crs, 1, g[1]);
+		get(crs, 2, h[0]); get(crs, 3, h[1]);
+		return;
+	}
+
+	Z y, a;
+	y.random();
+	a.random();
+
+	g[0].random();
+	g[1] = g[0]^y;          // g[1] = g[0]^y
+
+	h[0] = g[0]^a;          // h[0] = g[0]^a
+	h[1] = g[1]^(a + Z(1)); // h[1] = g[1]^(a+1)
+
+	crs = g[0].to_bytes() + g[1].to_bytes() + h[0].to_bytes() + h[1].to_bytes();
+	write_table_file("ot-crs", crs);
+}
+
+void fixed_base(G *elms, size_t n, ThreadPool &pool)
+{
+	pool.parallel_for(n, 1, fixed_base_task, elms);
+}
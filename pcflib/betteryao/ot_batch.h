@@ -0,0 +1,37 @@
+#ifndef OT_BATCH_H_
+#define OT_BATCH_H_
+
+#include <vector>
+
+#include "Algebra.h"
+#include "Bytes.h"
+#include "Prng.h"
+#include "ThreadPool.h"
+
+//
+// The SS11 OTs over the CRS g[0], g[1], h[0], h[1], a whole batch at a
+// time: one message from the receiver with a (gr, hr) per choice bit, and
+// one back with an (X[0], X[1], Y[0], Y[1]) per bit. The bits are spread
+// over the threads of pool. Each OT draws from its own PRNG, seeded in
+// turn from the caller's, so the outcome does not depend on the thread
+// count.
+//
+
+// receiver: the query for the n choice bits in bits; r gets their exponents
+Bytes ot_query(const G g[2], const G h[2], const Bytes &bits, size_t n, std::vector<Z> &r, Prng &prng, ThreadPool &pool);
+
+// sender: the reply to a query for n bits; keys gets the two k-bit keys of
+// every OT, back to back
+Bytes ot_reply(const G g[2], const G h[2], const Bytes &query, size_t n, std::vector<Bytes> &keys, Prng &prng, ThreadPool &pool);
+
+// receiver: keys gets the k-bit key each of the n bits has chosen
+void ot_keys(const Bytes &bits, const std::vector<Z> &r, const Bytes &reply, size_t n, std::vector<Bytes> &keys, ThreadPool &pool);
+
+// a fresh CRS, or the one kept in G_Base::TABLE_DIR by an earlier run so
+// that its fixed-base tables can be mapped from there
+void ot_crs(G g[2], G h[2]);
+
+// fixed_base() on n elements, one table per thread
+void fixed_base(G *elms, size_t n, ThreadPool &pool);
+
+#endif /* OT_BATCH_H_ */
@@ -0,0 +1,180 @@
+#include <emmintrin.h>
+#include <cassert>
+
+#include "Env.h"
+#include "Hash.h"
+#include "Prng.h"
+#include "ot_extension.h"
+
+void bit_transpose(const byte *in, size_t rows, size_t cols, byte *out)
+{
+	assert(rows%16 == 0 && cols%8 == 0);
+
+	const size_t in_len = cols/8, out_len = rows/8;
+
+	for (size_t rr = 0; rr < rows; rr += 16)
+		for (size_t cc = 0; cc < in_len; cc++)
+	{
+		// byte cc of the 16 rows, i.e., an 8 x 16 block of the output
+		const byte *p = in + rr*in_len + cc;
+		__m128i vec = _mm_set_epi8
+		(
+			p[15*in_len], p[14*in_len], p[13*in_len], p[12*in_len],
+			p[11*in_len], p[10*in_len], p[ 9*in_len], p[ 8*in_len],
+			p[ 7*in_len], p[ 6*in_len], p[ 5*in_len], p[ 4*in_len],
+			p[ 3*in_len], p[ 2*in_len], p[ 1*in_len], p[ 0*in_len]
+		);
+
+		// bit b of every byte moved up to its sign bit, then gathered
+		for (int b = 7; b >= 0; b--)
+		{
+			int mask = _mm_movemask_epi8(_mm_slli_epi64(vec, 7-b));
+
+			byte *q = out + (cc*8+b)*out_len + rr/8;
+			q[0] = mask & 0xFF;
+			q[1] = mask >> 8;
+		}
+	}
+}
+
+namespace
+{
+
+inline size_t pad_rows(size_t k) { return (k+15)/16*16; }
+inline size_t pad_cols(size_t m) { return (m+7)/8*8; }
+
+// the key of the ix-th extended OT: H(ix || row), row being k bits
+Bytes row_key(uint64_t ix, const byte *row, size_t k)
+{
+	byte tweak[8];
+	for (size_t jx = 0; jx < 8; jx++) tweak[jx] = ix >> (56-8*jx);
+
+	Hash hash;
+	hash.update(tweak, sizeof(tweak));
+	hash.update(row, (k+7)/8);
+	return hash.sig(Env::k());
+}
+
+// row gets the cols bits the PRG expands a base-OT key to
+void expand(const Bytes &key, byte *row, size_t cols)
+{
+	Prng prng(key);
+	prng.rand(row, cols);
+}
+
+// the transpose of the receiver's matrix t, whose row i is t^i; u gets
+// the message to the sender
+Bytes recv_matrix(const std::vector<Bytes> &base_keys, const Bytes &choices, size_t m, Bytes &u)
+{
+	const size_t k = base_keys.size()/2, rows = pad_rows(k), cols = pad_cols(m);
+	const size_t len = cols/8;
+
+	assert(choices.size()*8 >= m);
+
+	Bytes t(rows*len, 0), bufr(len);
+	u.resize(k*len);
+
+	// t_j = G(k0_j), u_j = t_j ^ G(k1_j) ^ r
+	for (size_t jx = 0; jx < k && m > 0; jx++)
+	{
+		byte *tj = &t[jx*len], *uj = &u[jx*len];
+
+		expand(base_keys[2*jx+0], tj, cols);
+		expand(base_keys[2*jx+1], &bufr[0], cols);
+
+		for (size_t ix = 0; ix < len; ix++) uj[ix] = tj[ix] ^ bufr[ix] ^ choices[ix];
+	}
+
+	Bytes tt(cols*rows/8);
+	if (m > 0) bit_transpose(&t[0], rows, cols, &tt[0]);
+
+	return tt;
+}
+
+// the transpose of the sender's matrix q, whose row i is t^i ^ r_i*s
+Bytes send_matrix(const std::vector<Bytes> &base_keys, const Bytes &s, const Bytes &msg, size_t m)
+{
+	const size_t k = base_keys.size(), rows = pad_rows(k), cols = pad_cols(m);
+	const size_t len = cols/8;
+
+	assert(msg.size() == k*len);
+
+	// q_j = G(k[s_j]_j) ^ s_j*u_j = t_j ^ s_j*r
+	Bytes q(rows*len, 0);
+	for (size_t jx = 0; jx < k && m > 0; jx++)
+	{
+		byte *qj = &q[jx*len];
+		expand(base_keys[jx], qj, cols);
+
+		if (s.get_ith_bit(jx))
+			for (size_t ix = 0; ix < len; ix++) qj[ix] ^= msg[jx*len+ix];
+	}
+
+	Bytes qt(cols*rows/8);
+	if (m > 0) bit_transpose(&q[0], rows, cols, &qt[0]);
+
+	return qt;
+}
+
+}
+
+Bytes ot_ext_recv(const std::vector<Bytes> &base_keys, const Bytes &choices, size_t m, std::vector<Bytes> &keys)
+{
+	const size_t k = base_keys.size()/2, rows = pad_rows(k);
+
+	Bytes u, tt = recv_matrix(base_keys, choices, m, u);
+
+	// the key of OT i is the hash of row i of the transpose of t
+	for (size_t ix = 0; ix < m; ix++)
+	{
+		keys.push_back(row_key(ix, &tt[ix*rows/8], k));
+	}
+
+	return u;
+}
+
+void ot_ext_send(const std::vector<Bytes> &base_keys, const Bytes &s, const Bytes &msg, size_t m, std::vector<Bytes> &keys)
+{
+	const size_t k = base_keys.size(), rows = pad_rows(k);
+
+	Bytes qt = send_matrix(base_keys, s, msg, m), row(rows/8);
+
+	// row i of the transpose is t^i ^ r_i*s, so the two keys of OT i are
+	// the hashes of it and of it xored with s
+	for (size_t ix = 0; ix < m; ix++)
+	{
+		const byte *qi = &qt[ix*rows/8];
+		for (size_t jx = 0; jx < row.size(); jx++) row[jx] = qi[jx] ^ (jx < s.size()? s[jx] : 0);
+
+		keys.push_back(row_key(ix, qi, k));
+		keys.push_back(row_key(ix, &row[0], k));
+	}
+}
+
+Bytes cot_ext_recv(const std::vector<Bytes> &base_keys, const Bytes &choices, size_t m, std::vector<Bytes> &keys)
+{
+	const size_t rows = pad_rows(base_keys.size()/2), len = Env::key_size_in_bytes();
+
+	Bytes u, tt = recv_matrix(base_keys, choices, m, u);
+
+	for (size_t ix = 0; ix < m; ix++)
+	{
+		Bytes::const_iterator it = tt.begin() + ix*rows/8;
+		keys.push_back(Bytes(it, it+len));
+	}
+
+	return u;
+}
+
+void cot_ext_send(const std::vector<Bytes> &base_keys, const Bytes &s, const Bytes &msg, size_t m, std::vector<Bytes> &keys)
+{
+	const size_t rows = pad_rows(base_keys.size()), len = Env::key_size_in_bytes();
+
+	Bytes qt = send_matrix(base_keys, s, msg, m);
+
+	for (size_t ix = 0; ix < m; ix++)
+	{
+		Bytes::const_iterator it = qt.begin() + ix*rows/8;
+		keys.push_back(Bytes(it, it+len));
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef OT_EXTENSION_H_
+#define OT_EXTENSION_H_
+
+#include <vector>
+
+#include "Bytes.h"
+
+//
+// IKNP extension of k base OTs to any number m of (random) OTs, secure
+// against semi-honest parties. The roles are swapped for the base OTs: the
+// receiver of the extended OTs sends the k base OTs, and the sender of the
+// extended OTs receives them with its k-bit secret s as the choice bits.
+// Past the base OTs, it takes one message from the receiver to the sender
+// and only AES (the PRG expanding the base keys) and SHA-256 (the keys of
+// the extended OTs).
+//
+
+// out, a cols x rows bit matrix, gets the transpose of in, a rows x cols
+// bit matrix; rows are packed LSB-first as Bytes::get_ith_bit() reads them,
+// rows is a multiple of 16 and cols a multiple of 8
+void bit_transpose(const byte *in, size_t rows, size_t cols, byte *out);
+
+// receiver: base_keys holds the k pairs of base-OT keys it has sent, back to
+// back, and choices the m choice bits. keys gets the m chosen keys, and the
+// returned message goes to the sender.
+Bytes ot_ext_recv(const std::vector<Bytes> &base_keys, const Bytes &choices, size_t m, std::vector<Bytes> &keys);
+
+// sender: base_keys holds the k base-OT keys chosen by s, and msg is the
+// receiver's message. keys gets the m pairs of keys, back to back.
+void ot_ext_send(const std::vector<Bytes> &base_keys, const Bytes &s, const Bytes &msg, size_t m, std::vector<Bytes> &keys);
+
+// The same extension as correlated OT, whose correlation is s: the rows of
+// the matrices are the keys, not their hashes, so the sender's two keys of
+// OT i are q^i and q^i ^ s, and the receiver gets q^i ^ r_i*s. Keys are
+// Env::key_size_in_bytes() long; only the sender's zero-keys are returned.
+Bytes cot_ext_recv(const std::vector<Bytes> &base_keys, const Bytes &choices, size_t m, std::vector<Bytes> &keys);
+void cot_ext_send(const std::vector<Bytes> &base_keys, const Bytes &s, const Bytes &msg, size_t m, std::vector<Bytes> &keys);
+
+#endif /* OT_EXTENSION_H_ */
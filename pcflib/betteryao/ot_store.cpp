@@ -0,0 +1,190 @@
+#include <cstdio>
+#include <sstream>
+#include <unistd.h>
+
+#include "Env.h"
+#include "ot_store.h"
+
+namespace
+{
+
+const size_t ID_LEN = 16;
+const size_t USED_AT = ID_LEN + 2*8; // where the used count sits in the file
+const size_t HEAD_LEN = ID_LEN + 4*8 + 1;
+
+void put_u64(Bytes &b, uint64_t v)
+{
+	for (size_t ix = 0; ix < 8; ix++) b.push_back(v >> (56-8*ix));
+}
+
+uint64_t get_u64(const byte *p)
+{
+	uint64_t v = 0;
+	for (size_t ix = 0; ix < 8; ix++) v = (v << 8) | p[ix];
+	return v;
+}
+
+inline bool is_recv(const ot_store_t &store) { return !store.choices.empty(); }
+
+size_t key_cnt(const ot_store_t &store)
+{
+	return store.copies*store.cnt*(is_recv(store)? 1 : 2);
+}
+
+// the count goes to disk before the keys are out, so that a crash can only
+// waste OTs, never hand them out again
+bool write_used(const ot_store_t &store, size_t used)
+{
+	FILE *f = fopen(store.path.c_str(), "r+b");
+	if (!f) return false;
+
+	Bytes b;
+	put_u64(b, used);
+
+	bool ok = fseek(f, USED_AT, SEEK_SET) == 0;
+	ok = ok && fwrite(&b[0], 1, b.size(), f) == b.size();
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	ok &= fclose(f) == 0;
+
+	return ok;
+}
+
+}
+
+std::string ot_store_path(const char *dir, int rank)
+{
+	std::ostringstream path;
+	path << dir << "/ots." << rank;
+	return path.str();
+}
+
+bool ot_store_load(ot_store_t &store, const std::string &path)
+{
+	Bytes data;
+
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) return false;
+
+	byte bufr[4096];
+	for (size_t n; (n = fread(bufr, 1, sizeof(bufr), f)) > 0; )
+		data.insert(data.end(), bufr, bufr+n);
+	fclose(f);
+
+	if (data.size() < HEAD_LEN) return false;
+
+	const byte *p = &data[0];
+
+	store.path   = path;
+	store.id     = Bytes(p, p+ID_LEN);
+	store.copies = get_u64(p+ID_LEN);
+	store.cnt    = get_u64(p+ID_LEN+8);
+	store.used   = get_u64(p+ID_LEN+16);
+
+	const size_t key_len = get_u64(p+ID_LEN+24), bits_len = p[HEAD_LEN-1]? (store.cnt+7)/8 : 0;
+	if (key_len != Env::key_size_in_bytes() || store.used > store.cnt) return false;
+
+	const size_t cnt = store.copies*store.cnt*(bits_len? 1 : 2);
+	if (data.size() != HEAD_LEN + bits_len + cnt*key_len) return false;
+
+	p += HEAD_LEN;
+	store.choices = Bytes(p, p+bits_len);
+	p += bits_len;
+
+	store.keys.resize(cnt);
+	for (size_t ix = 0; ix < cnt; ix++, p += key_len) store.keys[ix] = Bytes(p, p+key_len);
+
+	return true;
+}
+
+bool ot_store_save(const ot_store_t &store)
+{
+	assert(store.id.size() == ID_LEN && store.keys.size() == key_cnt(store));
+
+	Bytes data = store.id;
+	put_u64(data, store.copies);
+	put_u64(data, store.cnt);
+	put_u64(data, store.used);
+	put_u64(data, Env::key_size_in_bytes());
+	data.push_back(is_recv(store));
+	data += store.choices;
+	for (size_t ix = 0; ix < store.keys.size(); ix++) data += store.keys[ix];
+
+	// under a temporary name first, so that a half-written store is never seen
+	std::string tmp = store.path + ".tmp";
+
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (!f) return false;
+
+	bool ok = fwrite(&data[0], 1, data.size(), f) == data.size();
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	ok &= fclose(f) == 0;
+
+	if (!ok || rename(tmp.c_str(), store.path.c_str()) != 0)
+	{
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool ot_store_recv(ot_store_t &store, const Bytes &bits, size_t n, std::vector<std::vector<Bytes> > &keys, Bytes &msg)
+{
+	assert(is_recv(store));
+
+	if (store.used + n > store.cnt || !write_used(store, store.used + n)) return false;
+
+	// d = x ^ c
+	Bytes d((n+7)/8, 0);
+	for (size_t ix = 0; ix < n; ix++)
+		d.set_ith_bit(ix, bits.get_ith_bit(ix) ^ store.choices.get_ith_bit(store.used+ix));
+
+	keys.resize(store.copies);
+	for (size_t cix = 0; cix < store.copies; cix++)
+	{
+		std::vector<Bytes>::const_iterator it = store.keys.begin() + cix*store.cnt + store.used;
+		keys[cix].assign(it, it+n);
+	}
+
+	msg = store.id;
+	put_u64(msg, store.used);
+	msg += d;
+
+	store.used += n;
+	return true;
+}
+
+size_t ot_store_msg_size(size_t n)
+{
+	return ID_LEN + 8 + (n+7)/8;
+}
+
+bool ot_store_send(ot_store_t &store, const Bytes &msg, size_t n, std::vector<std::vector<Bytes> > &keys)
+{
+	assert(!is_recv(store));
+
+	if (msg.size() != ot_store_msg_size(n)) return false;
+	if (Bytes(msg.begin(), msg.begin()+ID_LEN) != store.id) return false;
+	if (get_u64(&msg[ID_LEN]) != store.used) return false;
+
+	if (store.used + n > store.cnt || !write_used(store, store.used + n)) return false;
+
+	const Bytes d(msg.begin()+ID_LEN+8, msg.end());
+
+	// key b of OT ix is the stored key b ^ d_ix
+	keys.resize(store.copies);
+	for (size_t cix = 0; cix < store.copies; cix++)
+	{
+		keys[cix].resize(2*n);
+		for (size_t ix = 0; ix < n; ix++)
+		{
+			size_t jx = 2*(cix*store.cnt + store.used + ix);
+			byte bit = d.get_ith_bit(ix);
+
+			keys[cix][2*ix+0] = store.keys[jx+bit];
+			keys[cix][2*ix+1] = store.keys[jx+1-bit];
+		}
+	}
+
+	store.used += n;
+	return true;
+}
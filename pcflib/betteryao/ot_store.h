@@ -0,0 +1,49 @@
+#ifndef OT_STORE_H_
+#define OT_STORE_H_
+
+#include <string>
+#include <vector>
+
+#include "Bytes.h"
+
+//
+// Random OTs made offline, before the inputs are known, and kept in a file
+// per process. The receiver holds random choice bits c and the keys they
+// chose, the sender both keys of every OT, for some circuit copies sharing
+// the choice bits. Online, the receiver with input x sends d = x ^ c
+// (Beaver's derandomization) and the sender swaps the two keys wherever d
+// is 1, which leaves the receiver with the key x chooses. The keys only
+// mask the input labels, so nothing else goes over the wire. No OT is ever
+// used twice: the count of the ones gone is on disk before any key is.
+//
+
+typedef struct
+{
+	std::string        path;
+	Bytes              id;      // made by the sender, the same on both sides
+	size_t             copies;  // each with its own keys
+	size_t             cnt;     // OTs per copy
+	size_t             used;    // OTs per copy gone already
+	Bytes              choices; // receiver only
+	std::vector<Bytes> keys;    // receiver: keys[cix*cnt+ix], sender: keys[2*(cix*cnt+ix)+b]
+}
+ot_store_t;
+
+// the store of this process in dir
+std::string ot_store_path(const char *dir, int rank);
+
+bool ot_store_load(ot_store_t &store, const std::string &path);
+bool ot_store_save(const ot_store_t &store);
+
+// receiver: keys[cix] gets the n keys bits choose in every copy, and msg
+// the message for the sender; false if the store is short
+bool ot_store_recv(ot_store_t &store, const Bytes &bits, size_t n, std::vector<std::vector<Bytes> > &keys, Bytes &msg);
+
+// the size of that message for n OTs
+size_t ot_store_msg_size(size_t n);
+
+// sender: keys[cix] gets the n pairs of keys of every copy, swapped as msg
+// says; false if the store is short or out of step with the receiver's
+bool ot_store_send(ot_store_t &store, const Bytes &msg, size_t n, std::vector<std::vector<Bytes> > &keys);
+
+#endif /* OT_STORE_H_ */
@@ -0,0 +1,52 @@
+#include <cassert>
+#include <cstring>
+
+#include "thread_cluster.h"
+
+void thread_cluster_init(thread_cluster_t &cluster, size_t size)
+{
+	cluster.size = size;
+	cluster.bufs.assign(size, 0);
+
+	int ret = pthread_barrier_init(&cluster.barrier, 0, size);
+	assert(ret == 0);
+}
+
+void thread_cluster_destroy(thread_cluster_t &cluster)
+{
+	pthread_barrier_destroy(&cluster.barrier);
+}
+
+void thread_cluster_barrier(thread_cluster_t &cluster)
+{
+	pthread_barrier_wait(&cluster.barrier);
+}
+
+void thread_cluster_bcast(thread_cluster_t &cluster, int rank, void *buf, size_t n)
+{
+	if (rank == 0) cluster.bufs[0] = buf;
+	thread_cluster_barrier(cluster);
+
+	if (rank != 0 && n != 0) memcpy(buf, cluster.bufs[0], n);
+	thread_cluster_barrier(cluster);
+}
+
+void thread_cluster_gather(thread_cluster_t &cluster, int rank, const void *send, size_t n, void *recv)
+{
+	cluster.bufs[rank] = send;
+	thread_cluster_barrier(cluster);
+
+	if (rank == 0 && n != 0)
+		for (size_t ix = 0; ix < cluster.size; ix++)
+			memcpy(reinterpret_cast<char*>(recv)+ix*n, cluster.bufs[ix], n);
+	thread_cluster_barrier(cluster);
+}
+
+void thread_cluster_scatter(thread_cluster_t &cluster, int rank, const void *send, size_t n, void *recv)
+{
+	if (rank == 0) cluster.bufs[0] = send;
+	thread_cluster_barrier(cluster);
+
+	if (n != 0) memcpy(recv, reinterpret_cast<const char*>(cluster.bufs[0])+rank*n, n);
+	thread_cluster_barrier(cluster);
+}
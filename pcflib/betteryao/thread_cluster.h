@@ -0,0 +1,35 @@
+#ifndef THREAD_CLUSTER_H_
+#define THREAD_CLUSTER_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <vector>
+
+//
+// The ranks of a party as threads of one process rather than processes of
+// MPI, with the collectives of the cluster in shared memory. As with MPI,
+// every rank makes the same calls in the same order, and rank 0 is the
+// root. A rank puts up a pointer to its buffer and the others copy from it
+// between two barriers, the second of which keeps the buffer alive until
+// everyone is done with it.
+//
+typedef struct
+{
+	size_t                    size;
+	pthread_barrier_t         barrier;
+	std::vector<const void *> bufs; // of every rank, for the collective under way
+}
+thread_cluster_t;
+
+void thread_cluster_init(thread_cluster_t &cluster, size_t size);
+void thread_cluster_destroy(thread_cluster_t &cluster);
+
+void thread_cluster_barrier(thread_cluster_t &cluster);
+
+// n bytes, as MPI_Bcast(), MPI_Gather() and MPI_Scatter() of MPI_BYTE do
+// with root 0: recv of gather is the root's only, send of scatter too
+void thread_cluster_bcast(thread_cluster_t &cluster, int rank, void *buf, size_t n);
+void thread_cluster_gather(thread_cluster_t &cluster, int rank, const void *send, size_t n, void *recv);
+void thread_cluster_scatter(thread_cluster_t &cluster, int rank, const void *send, size_t n, void *recv);
+
+#endif /* THREAD_CLUSTER_H_ */
@@ -7,7 +7,6 @@
 #include <string.h>
 #include "opdefs.h"
 
-struct PCFGate _gate;
 #define DEBUG_OUTPUT 0
 
 void clear_op(struct PCFState * st, struct PCFOP  * op)
@@ -364,7 +363,7 @@ void gate_op(struct PCFState * st, struct PCFOP * op)
       // Time for the callback
       assert((st->wires[op1idx].keydata != 0) && (st->wires[op2idx].keydata != 0));
 
-      st->curgate = &_gate;
+      st->curgate = &st->g_copy; /* of this state, as others may run at once */
 
       st->curgate->wire1 = op1idx;
       st->curgate->wire2 = op2idx;
@@ -883,7 +883,7 @@ PCFState * load_pcf_file(const char * fname, void * key0, void * key1, void *(*c
   ret->wires = (struct wire *)malloc(1000000 * sizeof(struct wire));
   check_alloc(ret->wires);
 
-  for(i = 0; i < 200000; i++)
+  for(i = 0; i < PCF_WIRE_TABLE_SIZE; i++)
     {
       ret->wires[i].flags = KNOWN_WIRE;
       ret->wires[i].value = 0;
@@ -947,7 +947,7 @@ PCFState * load_pcf_file(const char * fname, void * key0, void * key1, void *(*c
 void finalize(PCFState * st)
 {
   uint32_t i = 0;
-  for(i = 0; i < 200000; i++)
+  for(i = 0; i < PCF_WIRE_TABLE_SIZE; i++)
     {
       if(st->wires[i].keydata != 0)
         st->delete_key(st->wires[i].keydata);
@@ -956,6 +956,66 @@ void finalize(PCFState * st)
   //  free(st);
 }
 
+PCFState * copy_pcf_state(PCFState * st)
+{
+  PCFState * ret;
+  uint32_t i = 0;
+
+  ret = (PCFState*)malloc(sizeof(struct PCFState));
+  check_alloc(ret);
+
+  /* The ops and the labels are only read once loaded */
+  *ret = *st;
+
+  ret->alice_outputs = 0;
+  ret->bob_outputs = 0;
+  ret->inp_i = 0;
+  ret->constant_keys[0] = 0;
+  ret->constant_keys[1] = 0;
+  ret->call_stack = 0;
+  ret->curgate = 0;
+  ret->done = 0;
+  ret->base = 1;
+  ret->PC = 0;
+
+  ret->wires = (struct wire *)malloc(1000000 * sizeof(struct wire));
+  check_alloc(ret->wires);
+
+  for(i = 0; i < PCF_WIRE_TABLE_SIZE; i++)
+    {
+      ret->wires[i].flags = KNOWN_WIRE;
+      ret->wires[i].value = 0;
+      ret->wires[i].keydata = 0;
+    }
+
+  ret->wires[0].value = 1;
+
+  return ret;
+}
+
+void set_constant_keys(PCFState * st, void * key0, void * key1)
+{
+  uint32_t i = 0;
+
+  assert(st->constant_keys[0] == 0 && st->constant_keys[1] == 0);
+
+  st->constant_keys[0] = st->copy_key(key0);
+  st->constant_keys[1] = st->copy_key(key1);
+
+  for(i = 0; i < PCF_WIRE_TABLE_SIZE; i++)
+    {
+      assert(st->wires[i].keydata == 0);
+      st->wires[i].keydata = st->copy_key(st->constant_keys[i == 0]);
+    }
+}
+
+void free_pcf_state(PCFState * st)
+{
+  st->delete_key(st->constant_keys[0]);
+  st->delete_key(st->constant_keys[1]);
+  free(st);
+}
+
 struct PCFGate * get_next_gate(struct PCFState * st)
 {
   st->curgate = 0;
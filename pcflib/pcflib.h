@@ -59,6 +59,10 @@ typedef struct wire {
 
   enum {KNOWN_WIRE = 0, UNKNOWN_WIRE = 1};
 
+  /* Wires below this index are initialized by load_pcf_file and have
+     their keys released by finalize; keys never live above it. */
+#define PCF_WIRE_TABLE_SIZE 200000
+
 struct activation_record {
   uint32_t ret_pc;
   uint32_t base;
@@ -131,12 +135,21 @@ typedef struct PCFState {
   void reinitialize(PCFState *);
   PCFState * load_pcf_file(const char *, void *, void *, void *(*)(void*));
 
+  /* Sets the constant keys of a state fresh from copy_pcf_state(),
+     along with the wires that start out holding them. */
   void set_constant_keys(PCFState *, void *, void*);
 
   uint32_t get_input_size(PCFState *, uint32_t);
 
+  /* Another run of a loaded program, which shares its ops and labels and
+     can go on next to it in another thread.  Its wires have no keys until
+     set_constant_keys(). */
   PCFState * copy_pcf_state(struct PCFState *);
 
+  /* Releases a copy once get_next_gate() has returned 0, leaving the
+     program it came from alone. */
+  void free_pcf_state(struct PCFState *);
+
   wire * getWire(struct PCFState *, uint32_t);
   void * get_wire_key(struct PCFState *, uint32_t);
   void set_wire_key(struct PCFState *, uint32_t, void *);